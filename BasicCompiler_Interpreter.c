@@ -2,19 +2,278 @@
  * Basic Arithmetic Interpreter in C
  * * Features:
  * - Implements a Recursive Descent Parser.
- * - Supports integer arithmetic (+, -, *, /).
+ * - Supports integer arithmetic (+, -, *, /) on numbers of any size.
  * - Handles Operator Precedence (multiplication before addition).
  * - Handles Parentheses for grouping.
  * - Ignores whitespace for flexible input.
+ * - Variables and several statements per line: 'x = 4; y = x * 2; x + y'.
+ *   Variables keep their values from one line to the next.
+ * - Compiles each line once to bytecode for a small stack machine, so
+ *   evaluating it again does not mean parsing it again. On the way the
+ *   syntax tree is optimized: constants are folded, x*1, x+0 and x*0 are
+ *   simplified, multiplying or dividing by a power of two becomes a shift,
+ *   and a repeated subexpression is computed only once.
+ * - Lines run on ints, checking every operation for overflow. One that
+ *   overflows is finished in 64 bits, and past that in arbitrary
+ *   precision, multiplying large numbers by Karatsuba's method.
+ * - '--batch file [-j threads]' evaluates a file with one line per
+ *   expression: it is mapped, cut into chunks at line ends and spread over a
+ *   pool of threads, and the results are written in input order, one line
+ *   each. Errors go to stderr as 'file:line: message'.
+ * - On x86-64 a program that will run many times can be compiled further,
+ *   to machine code, with variables kept in registers.
+ * - '--columns line file.csv' evaluates a line for every row of a table
+ *   whose header names the columns; '--columns line a=a.bin b=b.bin' does
+ *   the same with each column in its own file of 4-byte integers. Rows are
+ *   evaluated a block at a time, with AVX2 where the processor has it.
+ * - Compiled lines are cached by their text (spacing aside), so a line
+ *   that comes again skips parsing, up to the last CACHE_ENTRIES different
+ *   ones. Type 'cache' to see how often that happened.
+ * - '-d' prints the bytecode of each line before running it.
+ * - '-B count' benchmarks evaluations per second of the bytecode machine
+ *   against evaluating directly while parsing and against machine code,
+ *   and with the optimizer on and off, by rows and by columns, and with and
+ *   without the cache; and the multiplication of numbers of 10,000 digits.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-// Global pointer to track where we are in the string
-const char *expression;
+// GCC and Clang can jump straight from one instruction to the next
+// ("computed goto"); other compilers get a switch in a loop. Build with
+// -DUSE_COMPUTED_GOTO=0 to compare the two.
+#ifndef USE_COMPUTED_GOTO
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO 1
+#else
+#define USE_COMPUTED_GOTO 0
+#endif
+#endif
+
+// The JIT writes x86-64 machine code; elsewhere the VM runs everything.
+// Build with -DJIT_SUPPORTED=0 to turn it off.
+#ifndef JIT_SUPPORTED
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+#endif
+// Column mode picks AVX2 loops at run time where the processor has them
+#ifndef COLUMNS_AVX2
+#if defined(__x86_64__) && defined(__GNUC__)
+#define COLUMNS_AVX2 1
+#else
+#define COLUMNS_AVX2 0
+#endif
+#endif
+#if COLUMNS_AVX2
+#include <immintrin.h>
+#endif
+
+#define JIT_ERROR INT64_MIN  // Returned by machine code on division by zero
+#define JIT_OVERFLOW (INT64_MIN + 1) // ...and when a result does not fit an int
+
+#define MAX_VARS 256      // Variable slots; an instruction names one in a byte
+#define MAX_TEMPS 256     // Saved common subexpressions per program
+#define NODE_BUCKETS 64   // Hash chains for finding identical syntax tree nodes
+#define BLOCK_NODES 256   // Syntax tree nodes are allocated this many at a time
+#define BATCH_CHUNK (256 * 1024) // Input bytes per unit of work in batch mode
+#define BATCH_AHEAD 4     // Chunks per thread that may wait to be written
+#define COLUMN_BLOCK 1024 // Rows column mode evaluates at a time
+#define MAX_CONSTANTS 256 // Numbers too large for an int, per program
+#define KARATSUBA_THRESHOLD 32 // Limbs from which multiplication splits numbers
+#define CACHE_ENTRIES 1024 // Compiled lines kept by an expression cache
+#define CACHE_BUCKETS 2048 // Its hash chains (a power of two)
+#define CACHE_HOT 100     // Hits after which a cached line becomes machine code
+
+// Bytecode instructions. Operands are popped from the stack and the result
+// pushed back. A one-byte operand follows LOAD, STORE, TEE, GET, CONST, SHL
+// and SHR. Arithmetic that overflows an int goes on in run_exact().
+enum Opcode {
+    OP_PUSH,     // Followed by a 4-byte integer
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_SHL,      // Multiply by 2^n
+    OP_SHR,      // Divide by 2^n, rounding towards zero like '/'
+    OP_LOAD,     // Push a variable
+    OP_STORE,    // Pop into a variable
+    OP_TEE,      // Copy the top of the stack into a temporary
+    OP_GET,      // Push a temporary
+    OP_CONST,    // Push a number too large for an int, from the constants
+    OP_HALT      // The result is on top of the stack
+};
+
+// Syntax tree node kinds
+enum NodeKind {
+    N_NUM,
+    N_VAR,
+    N_CONST,
+    N_ADD,
+    N_SUB,
+    N_MUL,
+    N_DIV
+};
+
+struct Node {
+    enum NodeKind kind;
+    int value;              // N_NUM: the number; N_VAR: the variable's slot;
+                            // N_CONST: its index in the program's constants
+    struct Node *left;
+    struct Node *right;
+    int traps;              // Might fail when run: divides by something that may be 0
+    int uses;               // Parents referring to it in the code generated
+    int temp;               // Temporary holding its value once computed, or -1
+    struct Node *chain;     // Next node in the same hash bucket
+};
+
+struct NodeBlock {
+    struct NodeBlock *next;
+    struct Node nodes[BLOCK_NODES];
+};
+
+// 'name = value', or just a value when slot is -1
+struct Statement {
+    int slot;
+    int store;              // Its value still has to be stored
+    struct Node *value;
+};
+
+// State while compiling a line. Each thread keeps one, and the memory it
+// has grown, for the next line.
+struct Compiler {
+    struct Program *prog;
+    struct NodeBlock *first_block;
+    struct NodeBlock *block;  // Where the next node comes from
+    int block_used;
+    struct Node *buckets[NODE_BUCKETS];
+    struct Statement *stmts;
+    int num_stmts;
+    int stmts_cap;
+    int assigned[MAX_VARS];   // Given a value earlier on this line
+    struct Node *current[MAX_VARS]; // The (optimized) value it was given
+};
+
+// An integer of any size: 'small' unless limbs is set, in which case it
+// is the magnitude, least significant 32 bits first
+struct Number {
+    int64_t small;
+    uint32_t *limbs;
+    size_t len;
+    int negative;
+};
+
+// A compiled line; it can be run any number of times. Start from
+// { 0 }: compiling into a program again reuses its memory.
+struct Program {
+    unsigned char *code;
+    size_t len;
+    size_t cap;
+    int depth;       // Stack slots in use at this point while compiling
+    int max_depth;   // Stack slots run_program() needs
+    int num_temps;
+    int error;       // Compilation failed (already reported)
+    struct Number *constants;     // For OP_CONST
+    int num_constants;
+    int64_t (*native)(int *vars); // Machine code from jit_compile(), or NULL
+    size_t native_size;
+};
+
+// A compiled line in the expression cache
+struct CacheEntry {
+    uint64_t hash;
+    char *text;                // Normalized source
+    size_t text_len;
+    int optimized;             // Compiled with the optimizer on
+    long runs;                 // Hits since it was compiled
+    struct Program prog;
+    struct CacheEntry *chain;  // Next entry in the same hash bucket
+    struct CacheEntry *newer;  // Neighbours in order of last use
+    struct CacheEntry *older;
+};
+
+// Compiled lines by source text, dropping the least recently used when
+// full. Not locked: each thread has its own. Start from calloc().
+struct Cache {
+    struct CacheEntry entries[CACHE_ENTRIES];
+    int used;
+    struct CacheEntry *buckets[CACHE_BUCKETS];
+    struct CacheEntry *newest;
+    struct CacheEntry *oldest;
+    struct Program spare;      // Compiled into before it is known to compile
+    char *scratch;             // The normalized line
+    size_t scratch_cap;
+    long hits;
+    long misses;
+};
+
+// A growable byte buffer for batch output
+struct Buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+// One slice of a batch input, ending at a line end, and what it produced
+struct Chunk {
+    const char *start;
+    const char *end;
+    long lines;
+    struct Buffer out;         // One line per input line
+    struct Buffer errors;      // Messages, each prefixed by its line within the chunk
+    int done;
+};
+
+struct Batch {
+    const char *file;
+    struct Chunk *chunks;
+    size_t num_chunks;
+    size_t next;               // Next chunk to hand out
+    size_t written;            // Chunks already written out
+    size_t ahead;              // How far 'next' may run ahead of 'written'
+    pthread_mutex_t lock;
+    pthread_cond_t taken;      // 'written' moved on
+    pthread_cond_t finished;   // A chunk is done
+};
+
+// Global pointer to track where we are in the string (one per thread, so
+// batch workers can each compile their own line)
+_Thread_local const char *expression;
+
+// Where errors go: the terminal, or the batch chunk being worked on
+_Thread_local struct Chunk *error_chunk;
+_Thread_local long error_line;
+
+// Variables live for the whole session; programs refer to them by slot.
+// Each thread names its own slots: batch workers start every line afresh
+// (see vars_forget()), so a line never depends on what came before it.
+_Thread_local char *var_names[MAX_VARS];
+_Thread_local int num_vars;
+int var_defined[MAX_VARS];
+int variables[MAX_VARS];      // Their values in the REPL
+int optimize = 1;             // Run the optimizer (off only to compare)
+
+// Variables whose values do not fit an int, and a result that did not
+// (run_program() returns 1). Each thread has its own.
+_Thread_local struct Number wide_vars[MAX_VARS];
+_Thread_local char var_wide[MAX_VARS];
+_Thread_local int num_wide;
+_Thread_local struct Number wide_result;
+int batch_mode = 0;           // Every line has its own variables
 
 // Function Prototypes for the Parser
 int parse_expression();
@@ -22,14 +281,60 @@ int parse_term();
 int parse_factor();
 void skip_whitespace();
 
-int main() {
+// Function Prototypes for the Compiler and VM
+int compile(const char *src, struct Program *prog);
+struct Node *ast_expression(struct Compiler *c);
+struct Node *ast_term(struct Compiler *c);
+struct Node *ast_factor(struct Compiler *c);
+struct Node *optimize_node(struct Compiler *c, struct Node *n);
+void program_free(struct Program *prog);
+void program_dump(const struct Program *prog);
+void program_define(const struct Program *prog);
+int run_program(const struct Program *prog, int *vars, int *result);
+void wide_vars_clear(void);
+struct Number number_parse(const char *digits, size_t n);
+char *number_text(const struct Number *n);
+void number_free(struct Number *n);
+int jit_compile(struct Program *prog);
+void jit_free(struct Program *prog);
+struct Program *cache_compile(struct Cache *cache, const char *src);
+void cache_free(struct Cache *cache);
+void report_error(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int run_batch(const char *file, int threads);
+int run_columns(const char *line, int num_files, char **files);
+void run_benchmark(long count);
+
+int main(int argc, char *argv[]) {
     char input[256];
+    int dump = argc == 2 && strcmp(argv[1], "-d") == 0;
+
+    if (argc == 3 && strcmp(argv[1], "-B") == 0) {
+        run_benchmark(atol(argv[2]));
+        return 0;
+    }
+    if ((argc == 3 || (argc == 5 && strcmp(argv[3], "-j") == 0)) &&
+        strcmp(argv[1], "--batch") == 0) {
+        return run_batch(argv[2], argc == 5 ? atoi(argv[4]) : 0);
+    }
+    if (argc >= 4 && strcmp(argv[1], "--columns") == 0) {
+        return run_columns(argv[2], argc - 3, argv + 3);
+    }
+    if (argc != 1 + dump) {
+        fprintf(stderr,
+                "Usage: %s [-d] | -B count | --batch file [-j threads]\n"
+                "       | --columns line file.csv | --columns line name=file...\n",
+                argv[0]);
+        return 1;
+    }
 
     printf("========================================\n");
     printf("     Basic Arithmetic Interpreter       \n");
     printf("========================================\n");
     printf("Enter mathematical expressions (e.g., 3 + 4 * (2 - 1)).\n");
-    printf("Type 'exit' to quit.\n\n");
+    printf("Assign with 'x = 5' and separate statements with ';'.\n");
+    printf("Type 'cache' for cache statistics and 'exit' to quit.\n\n");
+
+    struct Cache *cache = calloc(1, sizeof(struct Cache));
 
     while (1) {
         printf("> ");
@@ -40,22 +345,30 @@ int main() {
 
         if (strcmp(input, "exit") == 0) break;
         if (strlen(input) == 0) continue;
+        if (strcmp(input, "cache") == 0) {
+            printf("Cache: %d entries, %ld hits, %ld misses\n", cache->used, cache->hits,
+                   cache->misses);
+            continue;
+        }
 
-        // Point the global pointer to the start of the user's input
-        expression = input;
-        
-        // Start the recursive parsing chain
-        int result = parse_expression();
-        
-        // Only print result if we consumed the whole string (simple error check)
-        skip_whitespace();
-        if (*expression == '\0') {
-            printf("Result: %d\n", result);
-        } else {
-            printf("Error: Unexpected character '%c' at end of expression.\n", *expression);
+        // Compile the input (unless it was seen before), then run it
+        struct Program *prog = cache_compile(cache, input);
+        int result;
+        if (prog) {
+            if (dump) program_dump(prog);
+            int status = run_program(prog, variables, &result);
+            if (status >= 0) program_define(prog);
+            if (status == 0) {
+                printf("Result: %d\n", result);
+            } else if (status == 1) {
+                char *text = number_text(&wide_result);
+                printf("Result: %s\n", text);
+                free(text);
+            }
         }
     }
 
+    cache_free(cache);
     return 0;
 }
 
@@ -140,3 +453,2508 @@ int parse_factor() {
     
     return result;
 }
+
+// --- Bytecode compiler ---
+// A line is parsed into a syntax tree with the same grammar as the parser
+// above, plus variables and statements:
+//   Line      = Statement { ';' Statement }
+//   Statement = Name '=' Expression | Expression
+//   Factor    = Number | Name | (Expression)
+// The tree is then optimized and turned into instructions.
+
+// Reports an error in the line being compiled or run
+void report_error(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (error_chunk == NULL) {
+        printf("Error: ");
+        vprintf(fmt, ap);
+        printf("\n");
+    } else {
+        char msg[256];
+        vsnprintf(msg, sizeof(msg), fmt, ap);
+        struct Buffer *b = &error_chunk->errors;
+        size_t n = strlen(msg) + 24;
+        if (b->len + n > b->cap) {
+            b->cap = (b->len + n) * 2;
+            b->data = realloc(b->data, b->cap);
+        }
+        b->len += (size_t)sprintf(b->data + b->len, "%ld %s\n", error_line, msg);
+    }
+    va_end(ap);
+}
+
+static int find_variable(const char *name, size_t len) {
+    for (int i = 0; i < num_vars; i++) {
+        if (strlen(var_names[i]) == len && memcmp(var_names[i], name, len) == 0) return i;
+    }
+    return -1;
+}
+
+static int add_variable(const char *name, size_t len) {
+    int slot = find_variable(name, len);
+    if (slot >= 0 || num_vars == MAX_VARS) return slot;
+    var_names[num_vars] = strndup(name, len);
+    return num_vars++;
+}
+
+// Forgets this thread's variable names, so the next line starts with none
+static void vars_forget(void) {
+    while (num_vars > 0) free(var_names[--num_vars]);
+}
+
+// Reads a name at 'expression', or returns 0 if there is none
+static size_t scan_name(void) {
+    size_t len = 0;
+    if (!isalpha((unsigned char)*expression) && *expression != '_') return 0;
+    while (isalnum((unsigned char)expression[len]) || expression[len] == '_') len++;
+    return len;
+}
+
+static struct Node *node_new(struct Compiler *c, enum NodeKind kind, int value,
+                             struct Node *left, struct Node *right) {
+    if (c->block_used == BLOCK_NODES) {
+        if (c->block->next == NULL) c->block->next = calloc(1, sizeof(struct NodeBlock));
+        c->block = c->block->next;
+        c->block_used = 0;
+    }
+    struct Node *n = &c->block->nodes[c->block_used++];
+    *n = (struct Node){ .kind = kind, .value = value, .left = left, .right = right, .temp = -1 };
+    if (left) {
+        // Overflow never fails (the value just gets wider), division by 0 does
+        int safe_divisor = right->kind == N_CONST || (right->kind == N_NUM && right->value != 0);
+        n->traps = left->traps || right->traps || (kind == N_DIV && !safe_divisor);
+    }
+    return n;
+}
+
+// Returns the node for (kind, value, left, right), reusing an identical one
+// if there is one. Children are already unique, so comparing their addresses
+// compares whole subtrees, and a subexpression written twice becomes one
+// node with two parents.
+static struct Node *node_unique(struct Compiler *c, enum NodeKind kind, int value,
+                                struct Node *left, struct Node *right) {
+    size_t h = (size_t)kind * 31 + (size_t)(unsigned)value;
+    h = (h * 31 + (size_t)left / sizeof(struct Node)) * 31 + (size_t)right / sizeof(struct Node);
+    struct Node **bucket = &c->buckets[h % NODE_BUCKETS];
+    for (struct Node *n = *bucket; n; n = n->chain) {
+        if (n->kind == kind && n->value == value && n->left == left && n->right == right) return n;
+    }
+    struct Node *n = node_new(c, kind, value, left, right);
+    n->chain = *bucket;
+    *bucket = n;
+    return n;
+}
+
+static struct Node *number(struct Compiler *c, int value) {
+    return node_unique(c, N_NUM, value, NULL, NULL);
+}
+
+// Works out 'a op b' into *out. Returns 0 if it fails or does not fit an
+// int: then it is left for run time, which has room for any result.
+static int fold(enum NodeKind kind, int a, int b, int *out) {
+    switch (kind) {
+    case N_ADD: return !__builtin_add_overflow(a, b, out);
+    case N_SUB: return !__builtin_sub_overflow(a, b, out);
+    case N_MUL: return !__builtin_mul_overflow(a, b, out);
+    default:
+        if (b == 0 || (b == -1 && a == INT_MIN)) return 0;
+        *out = a / b;
+        return 1;
+    }
+}
+
+// The n of a divisor or multiplier 2^n (n >= 1), or 0
+static int power_of_two(const struct Node *n) {
+    if (n->kind != N_NUM || n->value < 2 || (n->value & (n->value - 1)) != 0) return 0;
+    int shift = 0;
+    while ((1 << shift) != n->value) shift++;
+    return shift;
+}
+
+// Builds 'left op right' from optimized operands, simplifying as it goes
+static struct Node *simplify(struct Compiler *c, enum NodeKind kind, struct Node *l, struct Node *r) {
+    int folded;
+    if (l->kind == N_NUM && r->kind == N_NUM && fold(kind, l->value, r->value, &folded)) {
+        return number(c, folded);
+    }
+
+    // Constants go on the right: 2 * x is x * 2
+    if ((kind == N_ADD || kind == N_MUL) && l->kind == N_NUM) {
+        struct Node *t = l;
+        l = r;
+        r = t;
+    }
+
+    if (r->kind == N_NUM) {
+        int k = r->value;
+        switch (kind) {
+        case N_SUB:
+            // x - k is x + -k, so the rules for '+' apply
+            if (fold(N_SUB, 0, k, &folded)) return simplify(c, N_ADD, l, number(c, folded));
+            break;
+        case N_ADD:
+            if (k == 0) return l;
+            // (x + a) + k is x + (a + k)
+            if (l->kind == N_ADD && l->right->kind == N_NUM && fold(N_ADD, l->right->value, k, &folded)) {
+                return simplify(c, N_ADD, l->left, number(c, folded));
+            }
+            break;
+        case N_MUL:
+            // x * 0 is 0, unless x could fail first
+            if (k == 0 && !l->traps) return number(c, 0);
+            if (k == 1) return l;
+            // (x * a) * k is x * (a * k)
+            if (l->kind == N_MUL && l->right->kind == N_NUM && fold(N_MUL, l->right->value, k, &folded)) {
+                return simplify(c, N_MUL, l->left, number(c, folded));
+            }
+            break;
+        case N_DIV:
+            if (k == 1) return l;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (kind == N_SUB && l == r && !l->traps) return number(c, 0); // x - x
+    return node_unique(c, kind, 0, l, r);
+}
+
+// Rebuilds a statement's tree bottom-up through simplify(). A variable
+// assigned earlier on the line stands for the value it was given, so an
+// N_VAR node is always the value the variable had when the line started.
+struct Node *optimize_node(struct Compiler *c, struct Node *n) {
+    switch (n->kind) {
+    case N_NUM:
+        return number(c, n->value);
+    case N_VAR:
+        if (c->current[n->value]) return c->current[n->value];
+        return node_unique(c, N_VAR, n->value, NULL, NULL);
+    case N_CONST:
+        return node_unique(c, N_CONST, n->value, NULL, NULL);
+    default:
+        return simplify(c, n->kind, optimize_node(c, n->left), optimize_node(c, n->right));
+    }
+}
+
+// Level 1: Expression = Term + Term - Term ...
+struct Node *ast_expression(struct Compiler *c) {
+    struct Node *n = ast_term(c);
+    while (!c->prog->error) {
+        skip_whitespace();
+        if (*expression == '+' || *expression == '-') {
+            enum NodeKind kind = *expression == '+' ? N_ADD : N_SUB;
+            expression++;
+            n = node_new(c, kind, 0, n, ast_term(c));
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+// Level 2: Term = Factor * Factor / Factor ...
+struct Node *ast_term(struct Compiler *c) {
+    struct Node *n = ast_factor(c);
+    while (!c->prog->error) {
+        skip_whitespace();
+        if (*expression == '*' || *expression == '/') {
+            enum NodeKind kind = *expression == '*' ? N_MUL : N_DIV;
+            expression++;
+            n = node_new(c, kind, 0, n, ast_factor(c));
+        } else {
+            break;
+        }
+    }
+    return n;
+}
+
+// Level 3: Factor = Number | Name | (Expression)
+struct Node *ast_factor(struct Compiler *c) {
+    skip_whitespace();
+    size_t len;
+    if (*expression == '(') {
+        expression++;
+        struct Node *n = ast_expression(c);
+        skip_whitespace();
+        if (c->prog->error) return n;
+        if (*expression == ')') {
+            expression++;
+        } else {
+            report_error("Missing closing parenthesis.");
+            c->prog->error = 1;
+        }
+        return n;
+    } else if (isdigit(*expression)) {
+        int value = 0, overflow = 0;
+        const char *digits = expression;
+        while (isdigit(*expression)) {
+            overflow |= __builtin_mul_overflow(value, 10, &value);
+            overflow |= __builtin_add_overflow(value, *expression - '0', &value);
+            expression++;
+        }
+        if (!overflow) return node_new(c, N_NUM, value, NULL, NULL);
+
+        // Too large for an int: the program keeps it as a constant
+        struct Program *prog = c->prog;
+        if (prog->num_constants == MAX_CONSTANTS) {
+            report_error("Too many large numbers.");
+            prog->error = 1;
+            return node_new(c, N_NUM, 0, NULL, NULL);
+        }
+        prog->constants = realloc(prog->constants, (size_t)(prog->num_constants + 1) * sizeof(struct Number));
+        prog->constants[prog->num_constants] = number_parse(digits, (size_t)(expression - digits));
+        return node_new(c, N_CONST, prog->num_constants++, NULL, NULL);
+    } else if ((len = scan_name()) > 0) {
+        int slot = find_variable(expression, len);
+        if (slot < 0 || ((batch_mode || !var_defined[slot]) && !c->assigned[slot])) {
+            report_error("Undefined variable '%.*s'.", (int)len, expression);
+            c->prog->error = 1;
+        }
+        expression += len;
+        return node_new(c, N_VAR, slot, NULL, NULL);
+    } else {
+        if (*expression == '\0') report_error("Expected number or '(' at end of expression.");
+        else report_error("Expected number or '(', found '%c'", *expression);
+        c->prog->error = 1;
+        return node_new(c, N_NUM, 0, NULL, NULL);
+    }
+}
+
+// Statement = Name '=' Expression | Expression
+static void parse_statement(struct Compiler *c) {
+    struct Statement st = { -1, 0, NULL };
+    skip_whitespace();
+    size_t len = scan_name();
+    const char *after = expression + len;
+    while (isspace((unsigned char)*after)) after++;
+    if (len > 0 && *after == '=') {
+        st.slot = add_variable(expression, len);
+        if (st.slot < 0) {
+            report_error("Too many variables.");
+            c->prog->error = 1;
+            return;
+        }
+        expression = after + 1;
+    }
+    st.value = ast_expression(c);
+    if (c->prog->error) return;
+
+    // Optimize each statement as soon as it is read, so the next one knows
+    // which variables it has changed
+    if (optimize) st.value = optimize_node(c, st.value);
+    if (st.slot >= 0) {
+        st.store = 1;
+        c->assigned[st.slot] = 1;
+        if (optimize) c->current[st.slot] = st.value;
+    }
+    if (c->num_stmts == c->stmts_cap) {
+        c->stmts_cap = c->stmts_cap ? c->stmts_cap * 2 : 8;
+        c->stmts = realloc(c->stmts, (size_t)c->stmts_cap * sizeof(struct Statement));
+    }
+    c->stmts[c->num_stmts++] = st;
+}
+
+static void emit(struct Program *prog, const void *bytes, size_t n) {
+    if (prog->len + n > prog->cap) {
+        prog->cap = (prog->len + n) * 2;
+        prog->code = realloc(prog->code, prog->cap);
+    }
+    memcpy(prog->code + prog->len, bytes, n);
+    prog->len += n;
+}
+
+static void emit_op(struct Program *prog, enum Opcode op) {
+    unsigned char byte = (unsigned char)op;
+    emit(prog, &byte, 1);
+    switch (op) {
+    case OP_PUSH: case OP_LOAD: case OP_GET: case OP_CONST:
+        if (++prog->depth > prog->max_depth) prog->max_depth = prog->depth;
+        break;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: // Two operands in, one result out
+    case OP_STORE:
+        prog->depth--;
+        break;
+    default:
+        break;
+    }
+}
+
+static void emit_op_arg(struct Program *prog, enum Opcode op, int arg) {
+    unsigned char byte = (unsigned char)arg;
+    emit_op(prog, op);
+    emit(prog, &byte, 1);
+}
+
+static void emit_push(struct Program *prog, int value) {
+    emit_op(prog, OP_PUSH);
+    emit(prog, &value, sizeof(value));
+}
+
+static void count_uses(struct Node *n) {
+    if (n->uses++ == 0 && n->left) {
+        count_uses(n->left);
+        count_uses(n->right);
+    }
+}
+
+// Emits the instructions for a node. One with several parents is computed
+// the first time and saved in a temporary for the others.
+static void generate(struct Program *prog, struct Node *n) {
+    if (n->temp >= 0) {
+        emit_op_arg(prog, OP_GET, n->temp);
+        return;
+    }
+    static const enum Opcode ops[] = { [N_ADD] = OP_ADD, [N_SUB] = OP_SUB,
+                                       [N_MUL] = OP_MUL, [N_DIV] = OP_DIV };
+    if (n->kind == N_NUM) {
+        emit_push(prog, n->value);
+        return;
+    }
+    if (n->kind == N_VAR || n->kind == N_CONST) {
+        emit_op_arg(prog, n->kind == N_VAR ? OP_LOAD : OP_CONST, n->value);
+        return;
+    }
+
+    // Strength reduction: x * 8 is x << 3
+    int shift = optimize && (n->kind == N_MUL || n->kind == N_DIV) ? power_of_two(n->right) : 0;
+    generate(prog, n->left);
+    if (shift) {
+        emit_op_arg(prog, n->kind == N_MUL ? OP_SHL : OP_SHR, shift);
+    } else {
+        generate(prog, n->right);
+        emit_op(prog, ops[n->kind]);
+    }
+    if (n->uses > 1 && prog->num_temps < MAX_TEMPS) {
+        n->temp = prog->num_temps++;
+        emit_op_arg(prog, OP_TEE, n->temp);
+    }
+}
+
+// Compiles a whole line. Returns 0, or -1 after reporting a syntax error.
+int compile(const char *src, struct Program *prog) {
+    static _Thread_local struct Compiler *c;
+    if (c == NULL) {
+        c = calloc(1, sizeof(struct Compiler));
+        c->first_block = calloc(1, sizeof(struct NodeBlock));
+    }
+    c->block = c->first_block;
+    c->block_used = 0;
+    c->num_stmts = 0;
+    memset(c->buckets, 0, sizeof(c->buckets));
+    c->prog = prog;
+    jit_free(prog);
+    for (int i = 0; i < prog->num_constants; i++) number_free(&prog->constants[i]);
+    prog->num_constants = 0;
+    prog->len = 0;
+    prog->depth = prog->max_depth = prog->num_temps = prog->error = 0;
+
+    expression = src;
+    do {
+        parse_statement(c);
+        skip_whitespace();
+    } while (!prog->error && *expression == ';' && *++expression != '\0');
+    if (!prog->error && *expression != '\0') {
+        report_error("Unexpected character '%c' at end of expression.", *expression);
+        prog->error = 1;
+    }
+
+    if (!prog->error) {
+        int last = c->num_stmts - 1;
+        if (optimize) {
+            // Only the last statement's value and the last assignment to
+            // each variable have any effect (the others are already part of
+            // the values that use them).
+            char stored[MAX_VARS] = { 0 };
+            for (int i = last; i >= 0; i--) {
+                int slot = c->stmts[i].slot;
+                if (slot >= 0 && stored[slot]++) c->stmts[i].store = 0;
+            }
+            // Except that one which might fail must still be computed, for
+            // the error: it is left on the stack, under the result.
+            for (int i = 0; i < last; i++) {
+                if (!c->stmts[i].store && c->stmts[i].value->traps) count_uses(c->stmts[i].value);
+            }
+            // An N_VAR node is the value from before the line, so every load
+            // has to come before the first store: compute the result and
+            // the values to assign, then store them.
+            count_uses(c->stmts[last].value);
+            for (int i = 0; i <= last; i++) {
+                if (c->stmts[i].store) count_uses(c->stmts[i].value);
+            }
+            for (int i = 0; i < last; i++) {
+                if (!c->stmts[i].store && c->stmts[i].value->traps) generate(prog, c->stmts[i].value);
+            }
+            generate(prog, c->stmts[last].value);
+            for (int i = 0; i <= last; i++) {
+                if (c->stmts[i].store) generate(prog, c->stmts[i].value);
+            }
+            for (int i = last; i >= 0; i--) {
+                if (c->stmts[i].store) emit_op_arg(prog, OP_STORE, c->stmts[i].slot);
+            }
+        } else {
+            // Statement by statement, reading variables back after storing.
+            // A value that is not stored is left on the stack, if it is
+            // computed at all (only when it might fail).
+            for (int i = 0; i <= last; i++) {
+                struct Statement *st = &c->stmts[i];
+                if (st->slot < 0 && i != last && !st->value->traps) continue;
+                count_uses(st->value);
+                generate(prog, st->value);
+                if (st->slot >= 0) emit_op_arg(prog, OP_STORE, st->slot);
+                if (st->slot >= 0 && i == last) emit_op_arg(prog, OP_LOAD, st->slot);
+            }
+        }
+        emit_op(prog, OP_HALT);
+    }
+
+    // Only the variables this line assigned need clearing for the next one
+    for (int i = 0; i < c->num_stmts; i++) {
+        int slot = c->stmts[i].slot;
+        if (slot < 0) continue;
+        c->assigned[slot] = 0;
+        c->current[slot] = NULL;
+    }
+    return prog->error ? -1 : 0;
+}
+
+void program_free(struct Program *prog) {
+    jit_free(prog);
+    for (int i = 0; i < prog->num_constants; i++) number_free(&prog->constants[i]);
+    free(prog->constants);
+    prog->constants = NULL;
+    prog->num_constants = 0;
+    free(prog->code);
+    prog->code = NULL;
+    prog->cap = 0;
+}
+
+// Bytes taken by an instruction and its operand
+static size_t instruction_size(enum Opcode op) {
+    if (op == OP_PUSH) return 1 + sizeof(int);
+    if (op == OP_HALT || op <= OP_DIV) return 1;
+    return 2;
+}
+
+// Prints the instructions of a program, one per line
+void program_dump(const struct Program *prog) {
+    static const char *names[] = {
+        "push", "add", "sub", "mul", "div", "shl", "shr", "load", "store", "tee", "get", "const",
+        "halt",
+    };
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        enum Opcode op = (enum Opcode)prog->code[pc];
+        printf("  %-5s", names[op]);
+        if (op == OP_PUSH) {
+            int value;
+            memcpy(&value, prog->code + pc + 1, sizeof(value));
+            printf(" %d", value);
+        } else if (op == OP_LOAD || op == OP_STORE) {
+            printf(" %s", var_names[prog->code[pc + 1]]);
+        } else if (op == OP_CONST) {
+            char *text = number_text(&prog->constants[prog->code[pc + 1]]);
+            printf(" %s", text);
+            free(text);
+        } else if (instruction_size(op) == 2) {
+            printf(" %d", prog->code[pc + 1]);
+        }
+        printf("\n");
+    }
+}
+
+// Marks the variables a program assigns as defined, once it has run
+// without an error (a line that failed leaves them as they were)
+void program_define(const struct Program *prog) {
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        if (prog->code[pc] == OP_STORE) var_defined[prog->code[pc + 1]] = 1;
+    }
+}
+
+// --- Numbers of any size ---
+// The VM, the JIT and column mode work on ints and check every operation
+// for overflow. A line that overflows is finished by run_exact(), on
+// 64-bit integers that turn into arbitrary-precision ones when they
+// overflow in turn. Those keep their magnitude in 32-bit limbs, least
+// significant first, and multiply by Karatsuba's method once both are
+// KARATSUBA_THRESHOLD limbs or more.
+
+static size_t mag_trim(const uint32_t *a, size_t n) {
+    while (n > 0 && a[n - 1] == 0) n--;
+    return n;
+}
+
+// Compares two trimmed magnitudes
+static int mag_cmp(const uint32_t *a, size_t an, const uint32_t *b, size_t bn) {
+    if (an != bn) return an < bn ? -1 : 1;
+    for (size_t i = an; i-- > 0;) {
+        if (a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// r += b, where rn >= bn. Returns the carry out of r.
+static uint32_t mag_add_into(uint32_t *r, size_t rn, const uint32_t *b, size_t bn) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < bn; i++) {
+        carry += (uint64_t)r[i] + b[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    for (; carry && i < rn; i++) {
+        carry += r[i];
+        r[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    return (uint32_t)carry;
+}
+
+// r -= b, where r >= b and rn >= bn
+static void mag_sub_from(uint32_t *r, size_t rn, const uint32_t *b, size_t bn) {
+    uint32_t borrow = 0;
+    size_t i = 0;
+    for (; i < bn; i++) {
+        uint64_t d = (uint64_t)r[i] - b[i] - borrow;
+        r[i] = (uint32_t)d;
+        borrow = (uint32_t)(d >> 63);
+    }
+    for (; borrow && i < rn; i++) borrow = r[i]-- == 0;
+}
+
+// r = a * b the long way; r has an + bn limbs
+static void mag_mul_school(uint32_t *r, const uint32_t *a, size_t an, const uint32_t *b, size_t bn) {
+    memset(r, 0, (an + bn) * sizeof(uint32_t));
+    for (size_t i = 0; i < bn; i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < an; j++) {
+            carry += (uint64_t)a[j] * b[i] + r[i + j];
+            r[i + j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        r[i + an] = (uint32_t)carry;
+    }
+}
+
+// r = a * b; r has an + bn limbs. Splitting a = a1 B + a0 and b = b1 B + b0
+// takes three half-size products instead of four: a0 b0, a1 b1 and
+// (a0 + a1)(b0 + b1), whose difference from the other two is a1 b0 + a0 b1.
+static void mag_mul(uint32_t *r, const uint32_t *a, size_t an, const uint32_t *b, size_t bn) {
+    if (an < bn) {
+        const uint32_t *t = a;
+        a = b;
+        b = t;
+        size_t tn = an;
+        an = bn;
+        bn = tn;
+    }
+    if (bn < KARATSUBA_THRESHOLD) {
+        mag_mul_school(r, a, an, b, bn);
+        return;
+    }
+    if (2 * bn <= an) {
+        // Lopsided: multiply b by a piece of a its size at a time
+        uint32_t *t = malloc(2 * bn * sizeof(uint32_t));
+        memset(r, 0, (an + bn) * sizeof(uint32_t));
+        for (size_t i = 0; i < an; i += bn) {
+            size_t n = an - i < bn ? an - i : bn;
+            mag_mul(t, a + i, n, b, bn);
+            mag_add_into(r + i, an + bn - i, t, n + bn);
+        }
+        free(t);
+        return;
+    }
+
+    size_t k = an / 2; // Less than bn, so b1 is not empty
+    const uint32_t *a1 = a + k, *b1 = b + k;
+    size_t a1n = an - k, b1n = bn - k;
+    size_t san = a1n + 1, sbn = (b1n > k ? b1n : k) + 1;
+    uint32_t *sa = calloc(san + sbn + san + sbn, sizeof(uint32_t));
+    uint32_t *sb = sa + san, *z1 = sb + sbn;
+
+    memcpy(sa, a1, a1n * sizeof(uint32_t));
+    mag_add_into(sa, san, a, k);
+    if (b1n > k) {
+        memcpy(sb, b1, b1n * sizeof(uint32_t));
+        mag_add_into(sb, sbn, b, k);
+    } else {
+        memcpy(sb, b, k * sizeof(uint32_t));
+        mag_add_into(sb, sbn, b1, b1n);
+    }
+    size_t z1n = san + sbn; // Room for z1, which only needs its trimmed factors' limbs
+    mag_mul(z1, sa, mag_trim(sa, san), sb, mag_trim(sb, sbn));
+
+    mag_mul(r, a, k, b, k);                  // z0, in the low 2k limbs
+    mag_mul(r + 2 * k, a1, a1n, b1, b1n);    // z2, in the rest
+    mag_sub_from(z1, z1n, r, 2 * k);
+    mag_sub_from(z1, z1n, r + 2 * k, a1n + b1n);
+    mag_add_into(r + k, an + bn - k, z1, mag_trim(z1, z1n));
+    free(sa);
+}
+
+// q = a / b for trimmed magnitudes with an >= bn >= 1; q has an - bn + 1
+// limbs. Long division one limb of quotient at a time (Knuth's algorithm
+// D), estimating each from the top two limbs.
+static void mag_div(uint32_t *q, const uint32_t *a, size_t an, const uint32_t *b, size_t bn) {
+    if (bn == 1) {
+        uint64_t rem = 0;
+        for (size_t i = an; i-- > 0;) {
+            uint64_t cur = rem << 32 | a[i];
+            q[i] = (uint32_t)(cur / b[0]);
+            rem = cur % b[0];
+        }
+        return;
+    }
+
+    // Shift both so the divisor's top bit is set, which keeps the
+    // estimates within two of the right limb
+    int s = __builtin_clz(b[bn - 1]);
+    uint32_t *vn = malloc((bn + an + 1) * sizeof(uint32_t));
+    uint32_t *un = vn + bn;
+    for (size_t i = bn - 1; i > 0; i--) vn[i] = b[i] << s | (uint32_t)((uint64_t)b[i - 1] >> (32 - s));
+    vn[0] = b[0] << s;
+    un[an] = (uint32_t)((uint64_t)a[an - 1] >> (32 - s));
+    for (size_t i = an - 1; i > 0; i--) un[i] = a[i] << s | (uint32_t)((uint64_t)a[i - 1] >> (32 - s));
+    un[0] = a[0] << s;
+
+    for (size_t j = an - bn + 1; j-- > 0;) {
+        uint64_t num = (uint64_t)un[j + bn] << 32 | un[j + bn - 1];
+        uint64_t qhat = num / vn[bn - 1], rhat = num % vn[bn - 1];
+        while (qhat >> 32 || qhat * vn[bn - 2] > (rhat << 32 | un[j + bn - 2])) {
+            qhat--;
+            rhat += vn[bn - 1];
+            if (rhat >> 32) break;
+        }
+        // un -= qhat * vn, at limb j
+        int64_t borrow = 0, t;
+        for (size_t i = 0; i < bn; i++) {
+            uint64_t p = qhat * vn[i];
+            t = (int64_t)un[i + j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+            un[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)un[j + bn] - borrow;
+        un[j + bn] = (uint32_t)t;
+        q[j] = (uint32_t)qhat;
+        if (t < 0) {
+            // One too many: add the divisor back
+            q[j]--;
+            un[j + bn] += mag_add_into(un + j, bn, vn, bn);
+        }
+    }
+    free(vn);
+}
+
+// The magnitude of a number, with room for a small one's limbs
+struct MagView {
+    int negative;
+    const uint32_t *limbs;
+    size_t len;
+    uint32_t buf[2];
+};
+
+static void mag_view(const struct Number *n, struct MagView *v) {
+    if (n->limbs) {
+        v->negative = n->negative;
+        v->limbs = n->limbs;
+        v->len = n->len;
+        return;
+    }
+    uint64_t m = n->small < 0 ? 0 - (uint64_t)n->small : (uint64_t)n->small;
+    v->negative = n->small < 0;
+    v->buf[0] = (uint32_t)m;
+    v->buf[1] = (uint32_t)(m >> 32);
+    v->limbs = v->buf;
+    v->len = mag_trim(v->buf, 2);
+}
+
+// Makes a number of a malloc'd magnitude, as a small one if it fits
+static struct Number number_from_mag(int negative, uint32_t *limbs, size_t len) {
+    len = mag_trim(limbs, len);
+    if (len <= 2) {
+        uint64_t m = len == 0 ? 0 : len == 1 ? limbs[0] : (uint64_t)limbs[1] << 32 | limbs[0];
+        if (m <= (uint64_t)INT64_MAX || (negative && m == (uint64_t)INT64_MAX + 1)) {
+            free(limbs);
+            return (struct Number){ .small = negative ? (int64_t)(0 - m) : (int64_t)m };
+        }
+    }
+    return (struct Number){ .limbs = limbs, .len = len, .negative = negative };
+}
+
+void number_free(struct Number *n) {
+    free(n->limbs);
+    *n = (struct Number){ 0 };
+}
+
+static struct Number number_copy(const struct Number *n) {
+    struct Number c = *n;
+    if (n->limbs) {
+        c.limbs = malloc(n->len * sizeof(uint32_t));
+        memcpy(c.limbs, n->limbs, n->len * sizeof(uint32_t));
+    }
+    return c;
+}
+
+// Sets *out to its value if n fits an int
+static int number_int(const struct Number *n, int *out) {
+    if (n->limbs || n->small < INT_MIN || n->small > INT_MAX) return 0;
+    *out = (int)n->small;
+    return 1;
+}
+
+// a + b, or a - b when 'subtract'
+static struct Number number_add(const struct Number *a, const struct Number *b, int subtract) {
+    int64_t sum;
+    if (!a->limbs && !b->limbs &&
+        !(subtract ? __builtin_sub_overflow(a->small, b->small, &sum)
+                   : __builtin_add_overflow(a->small, b->small, &sum))) {
+        return (struct Number){ .small = sum };
+    }
+    struct MagView x, y;
+    mag_view(a, &x);
+    mag_view(b, &y);
+    y.negative ^= subtract;
+    if (x.negative == y.negative) {
+        const struct MagView *big = x.len >= y.len ? &x : &y, *little = x.len >= y.len ? &y : &x;
+        uint32_t *r = calloc(big->len + 1, sizeof(uint32_t));
+        memcpy(r, big->limbs, big->len * sizeof(uint32_t));
+        mag_add_into(r, big->len + 1, little->limbs, little->len);
+        return number_from_mag(x.negative, r, big->len + 1);
+    }
+    int cmp = mag_cmp(x.limbs, x.len, y.limbs, y.len);
+    if (cmp == 0) return (struct Number){ 0 };
+    const struct MagView *big = cmp > 0 ? &x : &y, *little = cmp > 0 ? &y : &x;
+    uint32_t *r = malloc(big->len * sizeof(uint32_t));
+    memcpy(r, big->limbs, big->len * sizeof(uint32_t));
+    mag_sub_from(r, big->len, little->limbs, little->len);
+    return number_from_mag(big->negative, r, big->len);
+}
+
+static struct Number number_mul(const struct Number *a, const struct Number *b) {
+    int64_t product;
+    if (!a->limbs && !b->limbs && !__builtin_mul_overflow(a->small, b->small, &product)) {
+        return (struct Number){ .small = product };
+    }
+    struct MagView x, y;
+    mag_view(a, &x);
+    mag_view(b, &y);
+    uint32_t *r = malloc((x.len + y.len + 1) * sizeof(uint32_t));
+    mag_mul(r, x.limbs, x.len, y.limbs, y.len);
+    return number_from_mag(x.negative != y.negative, r, x.len + y.len);
+}
+
+// a / b rounded towards zero. Returns -1 if b is zero.
+static int number_div(const struct Number *a, const struct Number *b, struct Number *out) {
+    if (!a->limbs && !b->limbs) {
+        if (b->small == 0) return -1;
+        if (!(a->small == INT64_MIN && b->small == -1)) {
+            *out = (struct Number){ .small = a->small / b->small };
+            return 0;
+        }
+    }
+    struct MagView x, y;
+    mag_view(a, &x);
+    mag_view(b, &y);
+    if (y.len == 0) return -1;
+    if (mag_cmp(x.limbs, x.len, y.limbs, y.len) < 0) {
+        *out = (struct Number){ 0 };
+        return 0;
+    }
+    uint32_t *q = malloc((x.len - y.len + 1) * sizeof(uint32_t));
+    mag_div(q, x.limbs, x.len, y.limbs, y.len);
+    *out = number_from_mag(x.negative != y.negative, q, x.len - y.len + 1);
+    return 0;
+}
+
+// Reads a run of decimal digits, nine at a time
+struct Number number_parse(const char *digits, size_t n) {
+    uint32_t *limbs = calloc(n / 9 + 2, sizeof(uint32_t));
+    size_t len = 0;
+    for (size_t i = 0; i < n;) {
+        size_t take = i == 0 && n % 9 ? n % 9 : 9;
+        uint32_t chunk = 0, scale = 1;
+        for (size_t j = 0; j < take; j++, i++) {
+            chunk = chunk * 10 + (uint32_t)(digits[i] - '0');
+            scale *= 10;
+        }
+        uint64_t carry = chunk;
+        for (size_t j = 0; j < len; j++) {
+            carry += (uint64_t)limbs[j] * scale;
+            limbs[j] = (uint32_t)carry;
+            carry >>= 32;
+        }
+        if (carry) limbs[len++] = (uint32_t)carry;
+    }
+    return number_from_mag(0, limbs, len);
+}
+
+// Returns n in decimal, in a malloc'd string
+char *number_text(const struct Number *n) {
+    if (!n->limbs) {
+        char *text = malloc(24);
+        snprintf(text, 24, "%lld", (long long)n->small);
+        return text;
+    }
+    // Nine digits at a time from the bottom, by dividing by 10^9
+    uint32_t *m = malloc(n->len * sizeof(uint32_t));
+    uint32_t *chunks = malloc((n->len * 10 / 9 + 2) * sizeof(uint32_t));
+    memcpy(m, n->limbs, n->len * sizeof(uint32_t));
+    size_t len = n->len, num_chunks = 0;
+    do {
+        uint64_t rem = 0;
+        for (size_t i = len; i-- > 0;) {
+            uint64_t cur = rem << 32 | m[i];
+            m[i] = (uint32_t)(cur / 1000000000);
+            rem = cur % 1000000000;
+        }
+        chunks[num_chunks++] = (uint32_t)rem;
+        len = mag_trim(m, len);
+    } while (len > 0);
+    char *text = malloc(num_chunks * 9 + 2);
+    char *p = text;
+    if (n->negative) *p++ = '-';
+    p += sprintf(p, "%u", chunks[num_chunks - 1]);
+    for (size_t i = num_chunks - 1; i-- > 0;) p += sprintf(p, "%09u", chunks[i]);
+    free(m);
+    free(chunks);
+    return text;
+}
+
+// --- Virtual machine ---
+
+// A variable given a value that does not fit an int
+static void set_wide(int slot, struct Number *value) {
+    if (var_wide[slot]) {
+        number_free(&wide_vars[slot]);
+    } else {
+        var_wide[slot] = 1;
+        num_wide++;
+    }
+    wide_vars[slot] = *value;
+}
+
+static void clear_wide(int slot) {
+    if (!var_wide[slot]) return;
+    number_free(&wide_vars[slot]);
+    var_wide[slot] = 0;
+    num_wide--;
+}
+
+// Forgets every wide value, so vars alone hold the variables
+void wide_vars_clear(void) {
+    for (int i = 0; num_wide > 0 && i < MAX_VARS; i++) clear_wide(i);
+}
+
+// Whether prog reads a variable that only run_exact() can see. Only needs
+// asking when some variable is wide.
+static int loads_wide(const struct Program *prog) {
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        if (prog->code[pc] == OP_LOAD && var_wide[prog->code[pc + 1]]) return 1;
+    }
+    return 0;
+}
+
+// After an int run: the variables it stored hold ints again
+static void stored_narrow(const struct Program *prog) {
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        if (prog->code[pc] == OP_STORE) clear_wide(prog->code[pc + 1]);
+    }
+}
+
+// Runs prog from the instruction at 'start' in as many bits as the numbers
+// need, taking over the stack and temporaries of the int run that stopped
+// there (none when start is 0). Returns as run_program() does.
+static int run_exact(const struct Program *prog, size_t start, const int *stack, int depth,
+                     const int *temps, int *vars, int *result) {
+    struct Number s[prog->max_depth + 1];
+    struct Number t[prog->num_temps + 1];
+    for (int i = 0; i < depth; i++) s[i] = (struct Number){ .small = stack[i] };
+    for (int i = 0; i < prog->num_temps; i++) t[i] = (struct Number){ .small = temps ? temps[i] : 0 };
+    int sp = depth, status;
+
+    for (const unsigned char *pc = prog->code + start;; pc += instruction_size((enum Opcode)*pc)) {
+        int arg = *pc == OP_HALT ? 0 : pc[1];
+        struct Number value, shift = { .small = (int64_t)1 << (arg & 31) };
+        switch ((enum Opcode)*pc) {
+        case OP_PUSH: {
+            int n;
+            memcpy(&n, pc + 1, sizeof(n));
+            s[sp++] = (struct Number){ .small = n };
+            continue;
+        }
+        case OP_CONST:
+            s[sp++] = number_copy(&prog->constants[arg]);
+            continue;
+        case OP_LOAD:
+            s[sp++] = var_wide[arg] ? number_copy(&wide_vars[arg]) : (struct Number){ .small = vars[arg] };
+            continue;
+        case OP_STORE:
+            sp--;
+            if (number_int(&s[sp], &vars[arg])) clear_wide(arg);
+            else set_wide(arg, &s[sp]);
+            continue;
+        case OP_TEE:
+            number_free(&t[arg]);
+            t[arg] = number_copy(&s[sp - 1]);
+            continue;
+        case OP_GET:
+            s[sp++] = number_copy(&t[arg]);
+            continue;
+        case OP_ADD:
+        case OP_SUB:
+            value = number_add(&s[sp - 2], &s[sp - 1], *pc == OP_SUB);
+            break;
+        case OP_MUL:
+            value = number_mul(&s[sp - 2], &s[sp - 1]);
+            break;
+        case OP_DIV:
+            if (number_div(&s[sp - 2], &s[sp - 1], &value) != 0) {
+                report_error("Division by zero!");
+                status = -1;
+                goto done;
+            }
+            break;
+        case OP_SHL:
+            value = number_mul(&s[sp - 1], &shift);
+            number_free(&s[sp - 1]);
+            s[sp - 1] = value;
+            continue;
+        case OP_SHR:
+            number_div(&s[sp - 1], &shift, &value);
+            number_free(&s[sp - 1]);
+            s[sp - 1] = value;
+            continue;
+        case OP_HALT:
+            sp--;
+            if (number_int(&s[sp], result)) {
+                status = 0;
+                number_free(&s[sp]);
+            } else {
+                number_free(&wide_result);
+                wide_result = s[sp];
+                status = 1;
+            }
+            goto done;
+        }
+        // A binary operation: replace its operands with the value
+        number_free(&s[sp - 2]);
+        number_free(&s[sp - 1]);
+        s[sp - 2] = value;
+        sp--;
+    }
+done:
+    for (int i = 0; i < sp; i++) number_free(&s[i]);
+    for (int i = 0; i < prog->num_temps; i++) number_free(&t[i]);
+    return status;
+}
+
+
+// Runs a compiled program with the given variable values. Returns 0 and sets
+// *result, 1 if the result does not fit an int (it is left in wide_result),
+// or -1 after reporting a division by zero.
+int run_program(const struct Program *prog, int *vars, int *result) {
+    if (num_wide > 0 && loads_wide(prog)) return run_exact(prog, 0, NULL, 0, NULL, vars, result);
+#if JIT_SUPPORTED
+    if (prog->native) {
+        int64_t value = prog->native(vars);
+        if (value == JIT_ERROR) {
+            report_error("Division by zero!");
+            return -1;
+        }
+        // Nothing is stored before the last overflow check, so start again
+        if (value == JIT_OVERFLOW) return run_exact(prog, 0, NULL, 0, NULL, vars, result);
+        if (num_wide > 0) stored_narrow(prog);
+        *result = (int)value;
+        return 0;
+    }
+#endif
+    int stack[prog->max_depth + 1];
+    int temps[prog->num_temps + 1];
+    int *sp = stack;                // Next free slot
+    const unsigned char *pc = prog->code;
+    int value;
+
+#if USE_COMPUTED_GOTO
+    static const void *targets[] = {
+        [OP_PUSH] = &&L_OP_PUSH, [OP_ADD] = &&L_OP_ADD, [OP_SUB] = &&L_OP_SUB,
+        [OP_MUL] = &&L_OP_MUL, [OP_DIV] = &&L_OP_DIV, [OP_SHL] = &&L_OP_SHL,
+        [OP_SHR] = &&L_OP_SHR, [OP_LOAD] = &&L_OP_LOAD, [OP_STORE] = &&L_OP_STORE,
+        [OP_TEE] = &&L_OP_TEE, [OP_GET] = &&L_OP_GET, [OP_CONST] = &&L_OP_CONST,
+        [OP_HALT] = &&L_OP_HALT,
+    };
+#define DISPATCH() goto *targets[*pc++]
+#define CASE(op) L_##op
+    DISPATCH();
+#else
+#define DISPATCH() goto dispatch
+#define CASE(op) case op
+dispatch:
+    switch ((enum Opcode)*pc++) {
+#endif
+
+    CASE(OP_PUSH):
+        memcpy(&value, pc, sizeof(value));
+        pc += sizeof(value);
+        *sp++ = value;
+        DISPATCH();
+    CASE(OP_ADD):
+        if (__builtin_add_overflow(sp[-2], sp[-1], &value)) goto overflow;
+        sp--;
+        sp[-1] = value;
+        DISPATCH();
+    CASE(OP_SUB):
+        if (__builtin_sub_overflow(sp[-2], sp[-1], &value)) goto overflow;
+        sp--;
+        sp[-1] = value;
+        DISPATCH();
+    CASE(OP_MUL):
+        if (__builtin_mul_overflow(sp[-2], sp[-1], &value)) goto overflow;
+        sp--;
+        sp[-1] = value;
+        DISPATCH();
+    CASE(OP_DIV):
+        if (sp[-1] == 0) {
+            report_error("Division by zero!");
+            return -1;
+        }
+        if (sp[-1] == -1 && sp[-2] == INT_MIN) goto overflow;
+        sp--;
+        sp[-1] /= sp[0];
+        DISPATCH();
+    CASE(OP_SHL):
+        // It overflowed if shifting back does not give the same number
+        value = (int)((unsigned)sp[-1] << *pc);
+        if (value >> *pc != sp[-1]) goto overflow;
+        sp[-1] = value;
+        pc++;
+        DISPATCH();
+    CASE(OP_SHR):
+        // Add 2^n - 1 first to negative numbers, so they round up as '/' does
+        value = sp[-1];
+        sp[-1] = (value + (int)((unsigned)(value >> 31) >> (32 - *pc))) >> *pc;
+        pc++;
+        DISPATCH();
+    CASE(OP_LOAD):
+        *sp++ = vars[*pc++];
+        DISPATCH();
+    CASE(OP_STORE):
+        vars[*pc++] = *--sp;
+        DISPATCH();
+    CASE(OP_TEE):
+        temps[*pc++] = sp[-1];
+        DISPATCH();
+    CASE(OP_GET):
+        *sp++ = temps[*pc++];
+        DISPATCH();
+    CASE(OP_CONST):
+        goto overflow; // Only run_exact() has room for it
+    CASE(OP_HALT):
+        if (num_wide > 0) stored_narrow(prog);
+        *result = sp[-1];
+        return 0;
+
+#if !USE_COMPUTED_GOTO
+    }
+    return -1;
+#endif
+overflow:
+    // Carry on from this instruction (the one just dispatched) in more bits
+    return run_exact(prog, (size_t)(pc - 1 - prog->code), stack, (int)(sp - stack), temps, vars, result);
+#undef DISPATCH
+#undef CASE
+}
+
+// --- JIT compiler (x86-64) ---
+// Translates a program's bytecode into machine code, so a formula that is
+// evaluated over and over runs without any dispatch at all. The bytecode
+// stack becomes registers, spilling into the red zone below the stack
+// pointer (the code calls nothing, so nothing else uses it), and the most
+// used variables are kept in registers from the start of the function to
+// the end. Anything it cannot handle stays with the VM.
+
+#if JIT_SUPPORTED
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define JIT_STACK_REGS 6   // Bytecode stack slots kept in registers
+#define JIT_VAR_REGS 6     // Variables kept in registers
+#define JIT_RED_ZONE 32    // 4-byte slots below the stack pointer
+
+// Caller-saved, so free to use; RAX and RDX are left for division
+static const int stack_regs[JIT_STACK_REGS] = { RCX, RSI, R8, R9, R10, R11 };
+// Callee-saved, so pushed on entry and popped on return
+static const int var_regs[JIT_VAR_REGS] = { RBX, RBP, R12, R13, R14, R15 };
+
+// A register (reg >= 0), or memory at [base + disp]
+struct Loc {
+    int reg;
+    int base;
+    int disp;
+};
+
+struct Jit {
+    unsigned char *code;
+    size_t len;
+    size_t *error_jumps;       // rel32 fields to point at the error exit
+    int num_error_jumps;
+    size_t *overflow_jumps;    // ...and at the overflow exit
+    int num_overflow_jumps;
+    int var_reg[MAX_VARS];     // Register holding each variable, or -1
+    int stored[MAX_VARS];      // Written by the program
+    int num_temps;
+};
+
+#define OP(s) (const unsigned char *)(s), sizeof(s) - 1
+
+static struct Loc in_reg(int reg) {
+    return (struct Loc){ reg, 0, 0 };
+}
+
+static struct Loc red_zone(int slot) {
+    return (struct Loc){ -1, RSP, -4 * (slot + 1) };
+}
+
+// Where bytecode stack slot i lives
+static struct Loc stack_loc(struct Jit *j, int i) {
+    return i < JIT_STACK_REGS ? in_reg(stack_regs[i]) : red_zone(j->num_temps + i - JIT_STACK_REGS);
+}
+
+static struct Loc var_loc(struct Jit *j, int slot) {
+    if (j->var_reg[slot] >= 0) return in_reg(j->var_reg[slot]);
+    return (struct Loc){ -1, RDI, 4 * slot };
+}
+
+static void jit_byte(struct Jit *j, int b) {
+    j->code[j->len++] = (unsigned char)b;
+}
+
+static void jit_int(struct Jit *j, int32_t v) {
+    memcpy(j->code + j->len, &v, sizeof(v));
+    j->len += sizeof(v);
+}
+
+// Emits an instruction with a ModRM operand: 'reg' goes in the reg field
+// (a register, or an opcode extension) and 'rm' is a register or memory.
+// Operands are 32-bit unless 'wide'.
+static void jit_modrm(struct Jit *j, int wide, const unsigned char *op, size_t op_len,
+                      int reg, struct Loc rm) {
+    int rm_reg = rm.reg >= 0 ? rm.reg : rm.base;
+    int rex = (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm_reg & 8 ? 1 : 0);
+    if (rex) jit_byte(j, 0x40 | rex);
+    for (size_t i = 0; i < op_len; i++) jit_byte(j, op[i]);
+    if (rm.reg >= 0) {
+        jit_byte(j, 0xC0 | (reg & 7) << 3 | (rm.reg & 7));
+        return;
+    }
+    int small = rm.disp >= -128 && rm.disp <= 127;
+    jit_byte(j, (small ? 0x40 : 0x80) | (reg & 7) << 3 | (rm.base & 7));
+    if ((rm.base & 7) == RSP) jit_byte(j, 0x24); // SIB byte: no index
+    if (small) jit_byte(j, rm.disp);
+    else jit_int(j, rm.disp);
+}
+
+// mov dst, src for any mix of registers and memory
+static void jit_mov(struct Jit *j, struct Loc dst, struct Loc src) {
+    if (dst.reg >= 0) {
+        if (src.reg != dst.reg) jit_modrm(j, 0, OP("\x8b"), dst.reg, src);
+    } else if (src.reg >= 0) {
+        jit_modrm(j, 0, OP("\x89"), src.reg, dst);
+    } else {
+        jit_modrm(j, 0, OP("\x8b"), RAX, src);
+        jit_modrm(j, 0, OP("\x89"), RAX, dst);
+    }
+}
+
+static void jit_mov_imm(struct Jit *j, struct Loc dst, int32_t value) {
+    if (dst.reg >= 0) {
+        if (dst.reg & 8) jit_byte(j, 0x41);
+        jit_byte(j, 0xB8 + (dst.reg & 7));
+    } else {
+        jit_modrm(j, 0, OP("\xc7"), 0, dst);
+    }
+    jit_int(j, value);
+}
+
+// Jumps to the error exit if the flags say 'equal'
+static void jit_jz_error(struct Jit *j) {
+    jit_byte(j, 0x0F);
+    jit_byte(j, 0x84);
+    j->error_jumps[j->num_error_jumps++] = j->len;
+    jit_int(j, 0);
+}
+
+// Jumps to the overflow exit if the last operation overflowed
+static void jit_jo_overflow(struct Jit *j) {
+    jit_byte(j, 0x0F);
+    jit_byte(j, 0x80);
+    j->overflow_jumps[j->num_overflow_jumps++] = j->len;
+    jit_int(j, 0);
+}
+
+// Largest machine code one bytecode instruction turns into
+#define JIT_MAX_INSN 64
+
+// Compiles prog to machine code and attaches it. Returns 0, or -1 if the
+// program has to stay with the VM.
+int jit_compile(struct Program *prog) {
+    if (prog->error || prog->num_temps + prog->max_depth - JIT_STACK_REGS > JIT_RED_ZONE) return -1;
+
+    // Give registers to the variables used most. On overflow the VM starts
+    // the line again, so nothing may be stored before the last arithmetic
+    // (true of optimized code), and large constants are for the VM anyway.
+    int uses[MAX_VARS] = { 0 };
+    size_t num_insns = 0;
+    int stored = 0;
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        enum Opcode op = (enum Opcode)prog->code[pc];
+        if (op == OP_LOAD || op == OP_STORE) uses[prog->code[pc + 1]]++;
+        if (op == OP_CONST || (stored && op >= OP_ADD && op <= OP_SHR)) return -1;
+        stored |= op == OP_STORE;
+        num_insns++;
+    }
+    struct Jit j = { .num_temps = prog->num_temps };
+    int num_var_regs = 0;
+    for (int i = 0; i < MAX_VARS; i++) j.var_reg[i] = -1;
+    while (num_var_regs < JIT_VAR_REGS) {
+        int best = -1;
+        for (int i = 0; i < MAX_VARS; i++) {
+            if (uses[i] > 0 && j.var_reg[i] < 0 && (best < 0 || uses[i] > uses[best])) best = i;
+        }
+        if (best < 0) break;
+        j.var_reg[best] = var_regs[num_var_regs++];
+    }
+
+    size_t size = (num_insns + 2 * JIT_VAR_REGS + 8) * JIT_MAX_INSN;
+    size = (size + 4095) & ~(size_t)4095;
+    j.code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j.code == MAP_FAILED) return -1;
+    j.error_jumps = malloc((num_insns + 1) * sizeof(size_t));
+    j.overflow_jumps = malloc((num_insns + 1) * sizeof(size_t));
+
+    // Prologue: save the registers we take, load the variables into them
+    for (int i = 0; i < num_var_regs; i++) {
+        if (var_regs[i] & 8) jit_byte(&j, 0x41);
+        jit_byte(&j, 0x50 + (var_regs[i] & 7)); // push
+    }
+    for (int i = 0; i < MAX_VARS; i++) {
+        if (j.var_reg[i] >= 0) jit_mov(&j, in_reg(j.var_reg[i]), (struct Loc){ -1, RDI, 4 * i });
+    }
+
+    int depth = 0;
+    int32_t value;
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) {
+        enum Opcode op = (enum Opcode)prog->code[pc];
+        int arg = op == OP_HALT ? 0 : prog->code[pc + 1];
+        // The top two stack slots (unused when the stack is shallower)
+        struct Loc a = stack_loc(&j, depth >= 2 ? depth - 2 : 0);
+        struct Loc b = stack_loc(&j, depth >= 1 ? depth - 1 : 0);
+        switch (op) {
+        case OP_PUSH:
+            memcpy(&value, prog->code + pc + 1, sizeof(value));
+            jit_mov_imm(&j, stack_loc(&j, depth++), value);
+            break;
+        case OP_LOAD:
+            jit_mov(&j, stack_loc(&j, depth++), var_loc(&j, arg));
+            break;
+        case OP_STORE:
+            jit_mov(&j, var_loc(&j, arg), stack_loc(&j, --depth));
+            j.stored[arg] = 1;
+            break;
+        case OP_TEE:
+            jit_mov(&j, red_zone(arg), b);
+            break;
+        case OP_GET:
+            jit_mov(&j, stack_loc(&j, depth++), red_zone(arg));
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL: {
+            static const char *ops[] = { [OP_ADD] = "\x03", [OP_SUB] = "\x2b", [OP_MUL] = "\x0f\xaf" };
+            size_t len = op == OP_MUL ? 2 : 1;
+            int r = a.reg >= 0 ? a.reg : RAX;
+            jit_mov(&j, in_reg(r), a);
+            jit_modrm(&j, 0, (const unsigned char *)ops[op], len, r, b);
+            jit_jo_overflow(&j);
+            jit_mov(&j, a, in_reg(r));
+            depth--;
+            break;
+        }
+        case OP_DIV: {
+            // Zero fails; x / -1 is a negation (idiv would trap on INT_MIN,
+            // and neg overflows)
+            if (b.reg >= 0) {
+                jit_modrm(&j, 0, OP("\x85"), b.reg, b);              // test b, b
+            } else {
+                jit_modrm(&j, 0, OP("\x83"), 7, b);                  // cmp b, 0
+                jit_byte(&j, 0);
+            }
+            jit_jz_error(&j);
+            jit_mov(&j, in_reg(RAX), a);
+            jit_modrm(&j, 0, OP("\x83"), 7, b);                      // cmp b, -1
+            jit_byte(&j, -1);
+            jit_byte(&j, 0x75);                                      // jne divide
+            jit_byte(&j, 10);
+            jit_modrm(&j, 0, OP("\xf7"), 3, in_reg(RAX));            // neg eax (2 bytes)
+            jit_jo_overflow(&j);                                     // (6 bytes)
+            jit_byte(&j, 0xEB);                                      // jmp done
+            size_t skip = j.len;
+            jit_byte(&j, 0);
+            jit_byte(&j, 0x99);                                      // divide: cdq
+            jit_modrm(&j, 0, OP("\xf7"), 7, b);                      // idiv b
+            j.code[skip] = (unsigned char)(j.len - skip - 1);
+            jit_mov(&j, a, in_reg(RAX));                             // done:
+            depth--;
+            break;
+        }
+        case OP_SHL: {
+            // imul by 2^n rather than shl, for the overflow flag
+            int r = b.reg >= 0 ? b.reg : RAX;
+            jit_modrm(&j, 0, OP("\x69"), r, b);
+            jit_int(&j, (int32_t)(1u << arg));
+            jit_jo_overflow(&j);
+            jit_mov(&j, b, in_reg(r));
+            break;
+        }
+        case OP_CONST:
+            break; // Turned away above
+        case OP_SHR: {
+            // x + (2^n - 1 if x < 0), then an arithmetic shift
+            int r = b.reg >= 0 ? b.reg : RAX;
+            jit_mov(&j, in_reg(r), b);
+            jit_mov(&j, in_reg(RDX), in_reg(r));
+            jit_modrm(&j, 0, OP("\xc1"), 7, in_reg(RDX)); // sar edx, 31
+            jit_byte(&j, 31);
+            jit_modrm(&j, 0, OP("\xc1"), 5, in_reg(RDX)); // shr edx, 32 - n
+            jit_byte(&j, 32 - arg);
+            jit_modrm(&j, 0, OP("\x03"), r, in_reg(RDX)); // add r, edx
+            jit_modrm(&j, 0, OP("\xc1"), 7, in_reg(r));   // sar r, n
+            jit_byte(&j, arg);
+            jit_mov(&j, b, in_reg(r));
+            break;
+        }
+        case OP_HALT:
+            jit_mov(&j, in_reg(RAX), b);
+            jit_modrm(&j, 1, OP("\x63"), RAX, in_reg(RAX)); // movsxd rax, eax
+            break;
+        }
+    }
+
+    // Epilogue: write back the variables that changed, restore, return
+    size_t epilogue = j.len;
+    for (int i = 0; i < MAX_VARS; i++) {
+        if (j.var_reg[i] >= 0 && j.stored[i]) jit_mov(&j, (struct Loc){ -1, RDI, 4 * i }, in_reg(j.var_reg[i]));
+    }
+    for (int i = num_var_regs - 1; i >= 0; i--) {
+        if (var_regs[i] & 8) jit_byte(&j, 0x41);
+        jit_byte(&j, 0x58 + (var_regs[i] & 7)); // pop
+    }
+    jit_byte(&j, 0xC3);
+
+    // Error and overflow exits: return JIT_ERROR or JIT_OVERFLOW through
+    // the epilogue. Nothing has been stored yet, so writing back the
+    // variables changes nothing.
+    for (int exit = 0; exit < 2; exit++) {
+        size_t target = j.len;
+        int64_t code = exit == 0 ? JIT_ERROR : JIT_OVERFLOW;
+        jit_byte(&j, 0x48);
+        jit_byte(&j, 0xB8); // mov rax, imm64
+        memcpy(j.code + j.len, &code, sizeof(code));
+        j.len += sizeof(code);
+        jit_byte(&j, 0xE9); // jmp epilogue
+        jit_int(&j, (int32_t)(epilogue - (j.len + 4)));
+        size_t *jumps = exit == 0 ? j.error_jumps : j.overflow_jumps;
+        int num_jumps = exit == 0 ? j.num_error_jumps : j.num_overflow_jumps;
+        for (int i = 0; i < num_jumps; i++) {
+            int32_t rel = (int32_t)(target - (jumps[i] + 4));
+            memcpy(j.code + jumps[i], &rel, sizeof(rel));
+        }
+    }
+    free(j.error_jumps);
+    free(j.overflow_jumps);
+
+    if (mprotect(j.code, size, PROT_READ | PROT_EXEC) == -1) {
+        munmap(j.code, size);
+        return -1;
+    }
+    prog->native = (int64_t (*)(int *))(void *)j.code;
+    prog->native_size = size;
+    return 0;
+}
+
+void jit_free(struct Program *prog) {
+    if (prog->native) munmap((void *)prog->native, prog->native_size);
+    prog->native = NULL;
+}
+
+#else
+
+// No JIT for this processor: every program runs on the VM
+int jit_compile(struct Program *prog) {
+    (void)prog;
+    return -1;
+}
+
+void jit_free(struct Program *prog) {
+    prog->native = NULL;
+}
+
+#endif
+
+// --- Compiled expression cache ---
+// Input tends to repeat the same lines, so compiled programs are kept by
+// their source text, with the spacing taken out. A hit skips lexing,
+// parsing and code generation, and a line that keeps coming back is
+// compiled on to machine code.
+
+// Copies src to the cache's scratch buffer without its spaces, except a
+// single one where two names or numbers would otherwise run together.
+static size_t normalize(struct Cache *cache, const char *src) {
+    size_t n = strlen(src);
+    if (n + 1 > cache->scratch_cap) {
+        cache->scratch_cap = (n + 1) * 2;
+        cache->scratch = realloc(cache->scratch, cache->scratch_cap);
+    }
+    char *out = cache->scratch;
+    size_t len = 0;
+    int space = 0;
+    for (const char *p = src; *p; p++) {
+        if (isspace((unsigned char)*p)) {
+            space = 1;
+            continue;
+        }
+        if (space && len > 0 && (isalnum((unsigned char)out[len - 1]) || out[len - 1] == '_') &&
+            (isalnum((unsigned char)*p) || *p == '_')) {
+            out[len++] = ' ';
+        }
+        space = 0;
+        out[len++] = *p;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// FNV-1a
+static uint64_t hash_text(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static void lru_unlink(struct Cache *cache, struct CacheEntry *e) {
+    if (e->newer) e->newer->older = e->older;
+    else cache->newest = e->older;
+    if (e->older) e->older->newer = e->newer;
+    else cache->oldest = e->newer;
+}
+
+static void lru_push(struct Cache *cache, struct CacheEntry *e) {
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest) cache->newest->newer = e;
+    else cache->oldest = e;
+    cache->newest = e;
+}
+
+// Returns the compiled program for src, compiling it on a miss, or NULL if
+// it does not compile (errors are reported, and not cached). The program
+// belongs to the cache and stays valid until the next call.
+struct Program *cache_compile(struct Cache *cache, const char *src) {
+    size_t len = normalize(cache, src);
+    uint64_t hash = hash_text(cache->scratch, len);
+    struct CacheEntry **bucket = &cache->buckets[hash & (CACHE_BUCKETS - 1)];
+
+    for (struct CacheEntry *e = *bucket; e; e = e->chain) {
+        if (e->hash == hash && e->text_len == len && e->optimized == optimize &&
+            memcmp(e->text, cache->scratch, len) == 0) {
+            cache->hits++;
+            if (cache->newest != e) {
+                lru_unlink(cache, e);
+                lru_push(cache, e);
+            }
+            if (++e->runs == CACHE_HOT) jit_compile(&e->prog);
+            return &e->prog;
+        }
+    }
+
+    cache->misses++;
+    if (compile(cache->scratch, &cache->spare) != 0) return NULL;
+
+    // Take a free entry, or the least recently used one
+    struct CacheEntry *e;
+    if (cache->used < CACHE_ENTRIES) {
+        e = &cache->entries[cache->used++];
+    } else {
+        e = cache->oldest;
+        lru_unlink(cache, e);
+        struct CacheEntry **p = &cache->buckets[e->hash & (CACHE_BUCKETS - 1)];
+        while (*p != e) p = &(*p)->chain;
+        *p = e->chain;
+        jit_free(&e->prog);
+    }
+    // Its old program's memory becomes the spare to compile into next time
+    struct Program old = e->prog;
+    e->prog = cache->spare;
+    cache->spare = old;
+
+    e->hash = hash;
+    e->text = realloc(e->text, len + 1);
+    memcpy(e->text, cache->scratch, len + 1);
+    e->text_len = len;
+    e->optimized = optimize;
+    e->runs = 0;
+    e->chain = *bucket;
+    *bucket = e;
+    lru_push(cache, e);
+    return &e->prog;
+}
+
+void cache_free(struct Cache *cache) {
+    for (int i = 0; i < cache->used; i++) {
+        program_free(&cache->entries[i].prog);
+        free(cache->entries[i].text);
+    }
+    program_free(&cache->spare);
+    free(cache->scratch);
+    free(cache);
+}
+
+// --- Batch mode (--batch) ---
+
+static void buffer_reserve(struct Buffer *b, size_t n) {
+    if (b->len + n > b->cap) {
+        b->cap = (b->len + n) * 2;
+        b->data = realloc(b->data, b->cap);
+    }
+}
+
+// Appends a number and a newline; faster than printf for millions of them
+static void buffer_int_line(struct Buffer *b, int value) {
+    char digits[16];
+    int n = 0;
+    unsigned v = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+    do {
+        digits[n++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    buffer_reserve(b, (size_t)n + 2);
+    if (value < 0) b->data[b->len++] = '-';
+    while (n > 0) b->data[b->len++] = digits[--n];
+    b->data[b->len++] = '\n';
+}
+
+static void buffer_text_line(struct Buffer *b, const char *text) {
+    size_t n = strlen(text);
+    buffer_reserve(b, n + 1);
+    memcpy(b->data + b->len, text, n);
+    b->len += n;
+    b->data[b->len++] = '\n';
+}
+
+// Appends the result of run_program(): the int, the wide result or 'error'
+static void buffer_result_line(struct Buffer *b, int status, int value) {
+    if (status == 0) {
+        buffer_int_line(b, value);
+    } else if (status == 1) {
+        char *text = number_text(&wide_result);
+        buffer_text_line(b, text);
+        free(text);
+    } else {
+        buffer_text_line(b, "error");
+    }
+}
+
+// Evaluates every line of a chunk. An empty line gives an empty line and a
+// failing one gives "error", so output line N always belongs to input line N.
+static void run_chunk(struct Chunk *ch) {
+    char *line = NULL;
+    size_t cap = 0;
+    int vars[MAX_VARS] = { 0 };
+    static _Thread_local struct Cache *cache;
+    if (cache == NULL) cache = calloc(1, sizeof(struct Cache));
+    error_chunk = ch;
+    buffer_reserve(&ch->out, (size_t)(ch->end - ch->start) / 2 + 64);
+
+    for (const char *p = ch->start; p < ch->end;) {
+        const char *nl = memchr(p, '\n', (size_t)(ch->end - p));
+        const char *stop = nl ? nl : ch->end;
+        size_t len = (size_t)(stop - p);
+        if (len > 0 && stop[-1] == '\r') len--;
+        error_line = ++ch->lines;
+
+        // The compiler wants a terminated string
+        if (len + 1 > cap) {
+            cap = (len + 1) * 2;
+            line = realloc(line, cap);
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p = stop + 1;
+
+        size_t skip = strspn(line, " \t");
+        if (line[skip] == '\0') {
+            buffer_reserve(&ch->out, 1);
+            ch->out.data[ch->out.len++] = '\n';
+            continue;
+        }
+        // Slots are numbered afresh, in order of appearance, for every line,
+        // so the same text always compiles the same way
+        vars_forget();
+        int result = 0;
+        struct Program *prog = cache_compile(cache, line);
+        int status = prog ? run_program(prog, vars, &result) : -1;
+        buffer_result_line(&ch->out, status, result);
+    }
+    vars_forget();
+    error_chunk = NULL;
+    free(line);
+}
+
+static void *batch_worker(void *arg) {
+    struct Batch *b = arg;
+    pthread_mutex_lock(&b->lock);
+    while (b->next < b->num_chunks) {
+        // Do not run too far ahead of the writer, or finished output piles up
+        if (b->next >= b->written + b->ahead) {
+            pthread_cond_wait(&b->taken, &b->lock);
+            continue;
+        }
+        struct Chunk *ch = &b->chunks[b->next++];
+        pthread_mutex_unlock(&b->lock);
+        run_chunk(ch);
+        pthread_mutex_lock(&b->lock);
+        ch->done = 1;
+        pthread_cond_broadcast(&b->finished);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Evaluates a file of expressions, one per line, on 'threads' threads (all
+// processors if 0). Returns the exit status: 0, or 1 if any line failed.
+int run_batch(const char *file, int threads) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        if (fd != -1) close(fd);
+        return 2;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return 2;
+    }
+    if (size) madvise((void *)data, size, MADV_SEQUENTIAL);
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    batch_mode = 1;
+
+    // Cut the input into chunks that end just after a newline
+    struct Batch b = { .file = file, .ahead = (size_t)threads * BATCH_AHEAD };
+    size_t max_chunks = size / BATCH_CHUNK + 1;
+    b.chunks = calloc(max_chunks, sizeof(struct Chunk));
+    for (const char *p = data, *end = data + size; p < end;) {
+        const char *cut = (size_t)(end - p) > BATCH_CHUNK ? p + BATCH_CHUNK : end;
+        const char *nl = cut < end ? memchr(cut, '\n', (size_t)(end - cut)) : NULL;
+        cut = nl ? nl + 1 : end;
+        b.chunks[b.num_chunks].start = p;
+        b.chunks[b.num_chunks].end = cut;
+        b.num_chunks++;
+        p = cut;
+    }
+
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.taken, NULL);
+    pthread_cond_init(&b.finished, NULL);
+    pthread_t *pool = malloc((size_t)threads * sizeof(pthread_t));
+    int started = 0;
+    while (started < threads && pthread_create(&pool[started], NULL, batch_worker, &b) == 0) started++;
+    if (started == 0) {
+        // No threads to be had: do it all here, before the writer loop runs
+        b.ahead = b.num_chunks;
+        batch_worker(&b);
+    }
+
+    // Write each chunk's results in order as soon as it is done
+    int status = 0;
+    long line_base = 0;
+    for (size_t i = 0; i < b.num_chunks; i++) {
+        struct Chunk *ch = &b.chunks[i];
+        pthread_mutex_lock(&b.lock);
+        while (!ch->done) pthread_cond_wait(&b.finished, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+
+        if (status != 2 && write_all(STDOUT_FILENO, ch->out.data, ch->out.len) == -1) {
+            fprintf(stderr, "%s: write error: %s\n", file, strerror(errno));
+            status = 2; // Keep going so the workers can finish, but stop writing
+        }
+        for (char *e = ch->errors.data, *end = e + ch->errors.len; e < end;) {
+            char *msg;
+            long line = strtol(e, &msg, 10);
+            char *nl = memchr(msg, '\n', (size_t)(end - msg));
+            fprintf(stderr, "%s:%ld:%.*s\n", file, line_base + line, (int)(nl - msg), msg);
+            e = nl + 1;
+            if (status == 0) status = 1;
+        }
+        line_base += ch->lines;
+        free(ch->out.data);
+        free(ch->errors.data);
+
+        pthread_mutex_lock(&b.lock);
+        b.written++;
+        pthread_cond_broadcast(&b.taken);
+        pthread_mutex_unlock(&b.lock);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(pool[i], NULL);
+    free(pool);
+    free(b.chunks);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.taken);
+    pthread_cond_destroy(&b.finished);
+    if (size) munmap((void *)data, size);
+    return status;
+}
+
+// --- Column mode (--columns) ---
+// Evaluates one line over every row of a table. The bytecode is walked
+// once per block of COLUMN_BLOCK rows rather than once per row, and each
+// instruction is a loop over the block, using AVX2 where the processor has
+// it. A row whose division fails gives 'error' and the others carry on.
+
+// Element-wise operations on n values; d may be the same array as a or b.
+// Those that can overflow return non-zero if any of them did.
+struct Kernels {
+    const char *name;
+    int (*add)(int *d, const int *a, const int *b, int n);
+    int (*sub)(int *d, const int *a, const int *b, int n);
+    int (*mul)(int *d, const int *a, const int *b, int n);
+    int (*shl)(int *d, const int *a, int shift, int n);
+    void (*shr)(int *d, const int *a, int shift, int n);
+};
+
+static int scalar_add(int *d, const int *a, const int *b, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) overflow |= __builtin_add_overflow(a[i], b[i], &d[i]);
+    return overflow;
+}
+
+static int scalar_sub(int *d, const int *a, const int *b, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) overflow |= __builtin_sub_overflow(a[i], b[i], &d[i]);
+    return overflow;
+}
+
+static int scalar_mul(int *d, const int *a, const int *b, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) overflow |= __builtin_mul_overflow(a[i], b[i], &d[i]);
+    return overflow;
+}
+
+static int scalar_shl(int *d, const int *a, int shift, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) {
+        int x = a[i];
+        d[i] = (int)((unsigned)x << shift);
+        overflow |= d[i] >> shift != x;
+    }
+    return overflow;
+}
+
+static void scalar_shr(int *d, const int *a, int shift, int n) {
+    for (int i = 0; i < n; i++) d[i] = (a[i] + (int)((unsigned)(a[i] >> 31) >> (32 - shift))) >> shift;
+}
+
+static const struct Kernels scalar_kernels = {
+    "scalar", scalar_add, scalar_sub, scalar_mul, scalar_shl, scalar_shr,
+};
+
+#if COLUMNS_AVX2
+// Eight rows at a time, gathering overflows in the sign bits (add, sub)
+// or in any bits (mul, shl) of 'bad'; then the rest through the scalar
+// kernel
+#define AVX2_LOOP(body, rest)                                                 \
+    __m256i bad = _mm256_setzero_si256();                                     \
+    int i = 0;                                                                \
+    for (; i + 8 <= n; i += 8) {                                              \
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));             \
+        body                                                                  \
+    }                                                                         \
+    int overflow = rest;
+
+__attribute__((target("avx2")))
+static int avx2_add(int *d, const int *a, const int *b, int n) {
+    AVX2_LOOP(__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+              __m256i r = _mm256_add_epi32(x, y);
+              // Both operands differ in sign from the sum
+              bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_xor_si256(x, r), _mm256_xor_si256(y, r)));
+              _mm256_storeu_si256((__m256i *)(d + i), r);,
+              scalar_add(d + i, a + i, b + i, n - i))
+    return overflow | _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+}
+
+__attribute__((target("avx2")))
+static int avx2_sub(int *d, const int *a, const int *b, int n) {
+    AVX2_LOOP(__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+              __m256i r = _mm256_sub_epi32(x, y);
+              // The operands differ in sign, and the difference from x
+              bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_xor_si256(x, y), _mm256_xor_si256(x, r)));
+              _mm256_storeu_si256((__m256i *)(d + i), r);,
+              scalar_sub(d + i, a + i, b + i, n - i))
+    return overflow | _mm256_movemask_ps(_mm256_castsi256_ps(bad));
+}
+
+__attribute__((target("avx2")))
+static int avx2_mul(int *d, const int *a, const int *b, int n) {
+    const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+    AVX2_LOOP(__m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+              _mm256_storeu_si256((__m256i *)(d + i), _mm256_mullo_epi32(x, y));
+              // Full 64-bit products of the even and the odd lanes: each
+              // fits if its top half is the sign of its bottom half
+              __m256i even = _mm256_mul_epi32(x, y);
+              __m256i odd = _mm256_mul_epi32(_mm256_srli_epi64(x, 32), _mm256_srli_epi64(y, 32));
+              __m256i even_bad = _mm256_xor_si256(_mm256_srai_epi32(even, 31), _mm256_srli_epi64(even, 32));
+              __m256i odd_bad = _mm256_xor_si256(_mm256_srai_epi32(odd, 31), _mm256_srli_epi64(odd, 32));
+              bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_or_si256(even_bad, odd_bad), low));,
+              scalar_mul(d + i, a + i, b + i, n - i))
+    return overflow | !_mm256_testz_si256(bad, bad);
+}
+
+__attribute__((target("avx2")))
+static int avx2_shl(int *d, const int *a, int shift, int n) {
+    __m128i count = _mm_cvtsi32_si128(shift);
+    AVX2_LOOP(__m256i r = _mm256_sll_epi32(x, count);
+              bad = _mm256_or_si256(bad, _mm256_xor_si256(x, _mm256_sra_epi32(r, count)));
+              _mm256_storeu_si256((__m256i *)(d + i), r);,
+              scalar_shl(d + i, a + i, shift, n - i))
+    return overflow | !_mm256_testz_si256(bad, bad);
+}
+
+__attribute__((target("avx2")))
+static void avx2_shr(int *d, const int *a, int shift, int n) {
+    __m128i count = _mm_cvtsi32_si128(shift);
+    __m128i round = _mm_cvtsi32_si128(32 - shift);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i r = _mm256_add_epi32(x, _mm256_srl_epi32(_mm256_srai_epi32(x, 31), round));
+        _mm256_storeu_si256((__m256i *)(d + i), _mm256_sra_epi32(r, count));
+    }
+    scalar_shr(d + i, a + i, shift, n - i);
+}
+
+static const struct Kernels avx2_kernels = {
+    "avx2", avx2_add, avx2_sub, avx2_mul, avx2_shl, avx2_shr,
+};
+#endif
+
+// The fastest kernels this processor can run
+static const struct Kernels *best_kernels(void) {
+#if COLUMNS_AVX2
+    if (__builtin_cpu_supports("avx2")) return &avx2_kernels;
+#endif
+    return &scalar_kernels;
+}
+
+// Division can fail, and has no vector instruction: row by row. Returns
+// non-zero if INT_MIN / -1 overflowed.
+static int column_div(int *d, const int *a, const int *b, int n, unsigned char *failed) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) {
+        if (b[i] == 0) {
+            failed[i] = 1;
+            d[i] = 0;
+        } else if (b[i] == -1) {
+            overflow |= __builtin_sub_overflow(0, a[i], &d[i]);
+        } else {
+            d[i] = a[i] / b[i];
+        }
+    }
+    return overflow;
+}
+
+// The columns of a table, one per variable that has one
+struct Table {
+    long rows;
+    int *data[MAX_VARS];
+    size_t mapped[MAX_VARS];   // Bytes mapped from a binary file, or 0 if malloc'd
+};
+
+// Blocks of rows being worked on, for a program needing 'depth' stack slots
+struct ColumnState {
+    int (*stack)[COLUMN_BLOCK];
+    int (*temps)[COLUMN_BLOCK];
+    int (*assigned)[COLUMN_BLOCK]; // Values variables are given on the line
+};
+
+// Runs prog over rows first to first + n - 1 of t, writing the results to
+// out and setting failed[i] for rows where it failed. Returns non-zero,
+// with the results unfinished, if some row needs more than an int.
+static int eval_columns(const struct Program *prog, const struct Kernels *k, const struct Table *t,
+                         struct ColumnState *s, long first, int n, int *out, unsigned char *failed) {
+    const int *vars[MAX_VARS];
+    const int *stack[prog->max_depth + 1];
+    int sp = 0, overflow = 0;
+    for (int i = 0; i < MAX_VARS; i++) vars[i] = t->data[i] ? t->data[i] + first : NULL;
+    memset(failed, 0, (size_t)n);
+
+    for (const unsigned char *pc = prog->code;; pc += instruction_size((enum Opcode)*pc)) {
+        int arg = *pc == OP_HALT ? 0 : pc[1];
+        int *top = s->stack[sp - 1 >= 0 ? sp - 1 : 0];
+        int *next = s->stack[sp - 2 >= 0 ? sp - 2 : 0];
+        switch ((enum Opcode)*pc) {
+        case OP_PUSH: {
+            int value;
+            memcpy(&value, pc + 1, sizeof(value));
+            for (int i = 0; i < n; i++) s->stack[sp][i] = value;
+            stack[sp] = s->stack[sp];
+            sp++;
+            break;
+        }
+        case OP_LOAD:
+            stack[sp++] = vars[arg];
+            break;
+        case OP_STORE:
+            memcpy(s->assigned[arg], stack[--sp], (size_t)n * sizeof(int));
+            vars[arg] = s->assigned[arg];
+            break;
+        case OP_TEE:
+            memcpy(s->temps[arg], stack[sp - 1], (size_t)n * sizeof(int));
+            break;
+        case OP_GET:
+            stack[sp++] = s->temps[arg];
+            break;
+        case OP_CONST:
+            return 1;
+        case OP_ADD:
+            overflow |= k->add(next, stack[sp - 2], stack[sp - 1], n);
+            stack[sp-- - 2] = next;
+            break;
+        case OP_SUB:
+            overflow |= k->sub(next, stack[sp - 2], stack[sp - 1], n);
+            stack[sp-- - 2] = next;
+            break;
+        case OP_MUL:
+            overflow |= k->mul(next, stack[sp - 2], stack[sp - 1], n);
+            stack[sp-- - 2] = next;
+            break;
+        case OP_DIV:
+            overflow |= column_div(next, stack[sp - 2], stack[sp - 1], n, failed);
+            stack[sp-- - 2] = next;
+            break;
+        case OP_SHL:
+            overflow |= k->shl(top, stack[sp - 1], arg, n);
+            stack[sp - 1] = top;
+            break;
+        case OP_SHR:
+            k->shr(top, stack[sp - 1], arg, n);
+            stack[sp - 1] = top;
+            break;
+        case OP_HALT:
+            memcpy(out, stack[sp - 1], (size_t)n * sizeof(int));
+            return overflow;
+        }
+    }
+}
+
+static void column_state_init(struct ColumnState *s, const struct Program *prog) {
+    s->stack = malloc((size_t)(prog->max_depth + 1) * sizeof(*s->stack));
+    s->temps = malloc((size_t)(prog->num_temps + 1) * sizeof(*s->temps));
+    s->assigned = malloc(MAX_VARS * sizeof(*s->assigned));
+}
+
+static void column_state_free(struct ColumnState *s) {
+    free(s->stack);
+    free(s->temps);
+    free(s->assigned);
+}
+
+static void table_free(struct Table *t) {
+    for (int i = 0; i < MAX_VARS; i++) {
+        if (t->mapped[i]) munmap(t->data[i], t->mapped[i]);
+        else free(t->data[i]);
+    }
+}
+
+// Makes a variable of a column name; the line may then use it
+static int column_slot(const char *file, const char *name, size_t len) {
+    int slot = add_variable(name, len);
+    if (slot < 0) {
+        fprintf(stderr, "%s: too many columns\n", file);
+        return -1;
+    }
+    var_defined[slot] = 1;
+    return slot;
+}
+
+// Reads a CSV file: a header line naming the columns, then one line of
+// integers per row. A number that does not fit an int is an error.
+static int load_csv(const char *file, struct Table *t) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    char *data = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    const char *p = data, *end = data + size;
+
+    int slots[MAX_VARS];
+    int num_cols = 0;
+    while (p < end && *p != '\n') {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        const char *name = p;
+        while (p < end && (isalnum((unsigned char)*p) || *p == '_')) p++;
+        size_t len = (size_t)(p - name);
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        if (len == 0 || isdigit((unsigned char)*name) || (p < end && *p != ',' && *p != '\n')) {
+            fprintf(stderr, "%s:1: expected column names\n", file);
+            goto fail;
+        }
+        if ((slots[num_cols] = column_slot(file, name, len)) < 0) goto fail;
+        for (int c = 0; c < num_cols; c++) {
+            if (slots[c] != slots[num_cols]) continue;
+            fprintf(stderr, "%s:1: column '%.*s' given twice\n", file, (int)len, name);
+            goto fail;
+        }
+        num_cols++;
+        if (p < end && *p == ',') p++;
+    }
+    if (num_cols == 0) {
+        fprintf(stderr, "%s:1: expected column names\n", file);
+        goto fail;
+    }
+    p++;
+
+    long cap = 1024;
+    for (int c = 0; c < num_cols; c++) t->data[slots[c]] = malloc((size_t)cap * sizeof(int));
+    for (long line = 2; p < end; line++) {
+        const char *eol = memchr(p, '\n', (size_t)(end - p));
+        if (eol == NULL) eol = end;
+        if (eol == p || (eol == p + 1 && *p == '\r')) { // Blank line
+            p = eol + 1;
+            continue;
+        }
+        if (t->rows == cap) {
+            cap *= 2;
+            for (int c = 0; c < num_cols; c++) {
+                t->data[slots[c]] = realloc(t->data[slots[c]], (size_t)cap * sizeof(int));
+            }
+        }
+        for (int c = 0; c < num_cols; c++) {
+            while (p < eol && (*p == ' ' || *p == '\t')) p++;
+            int negative = p < eol && *p == '-';
+            p += negative;
+            if (p == eol || !isdigit((unsigned char)*p)) {
+                fprintf(stderr, "%s:%ld: expected %d numbers\n", file, line, num_cols);
+                goto fail;
+            }
+            // Stops growing past INT_MAX + 1, so it cannot wrap
+            unsigned long long value = 0;
+            while (p < eol && isdigit((unsigned char)*p)) {
+                value = value * 10 + (unsigned)(*p++ - '0');
+                if (value > (unsigned long long)INT_MAX + 1) value = (unsigned long long)INT_MAX + 2;
+            }
+            if (value > (unsigned long long)INT_MAX + (unsigned)negative) {
+                fprintf(stderr, "%s:%ld: number out of range\n", file, line);
+                goto fail;
+            }
+            t->data[slots[c]][t->rows] = (int)(negative ? -(long long)value : (long long)value);
+            while (p < eol && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+            if (c + 1 < num_cols ? p < eol && *p == ',' : p == eol) {
+                p++;
+            } else {
+                fprintf(stderr, "%s:%ld: expected %d numbers\n", file, line, num_cols);
+                goto fail;
+            }
+        }
+        t->rows++;
+    }
+    if (size) munmap(data, size);
+    return 0;
+
+fail:
+    if (size) munmap(data, size);
+    return -1;
+}
+
+// Maps 'name=file', where the file holds the column as native 4-byte ints
+static int load_binary(const char *arg, struct Table *t) {
+    const char *eq = strchr(arg, '=');
+    const char *file = eq + 1;
+    size_t len = 0;
+    while (isalnum((unsigned char)arg[len]) || arg[len] == '_') len++;
+    if (len == 0 || arg + len != eq || isdigit((unsigned char)*arg)) {
+        fprintf(stderr, "%s: expected a column name before '='\n", arg);
+        return -1;
+    }
+    int slot = column_slot(arg, arg, len);
+    if (slot < 0) return -1;
+    if (t->data[slot]) {
+        fprintf(stderr, "%s: column given twice\n", arg);
+        return -1;
+    }
+
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    long rows = (long)(size / sizeof(int));
+    if (size % sizeof(int) != 0 || (t->rows >= 0 && rows != t->rows) || size == 0) {
+        fprintf(stderr, "%s: %zu bytes, not %ld rows of 4-byte numbers\n", file, size,
+                t->rows >= 0 ? t->rows : rows);
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    madvise(data, size, MADV_SEQUENTIAL);
+    t->data[slot] = data;
+    t->mapped[slot] = size;
+    t->rows = rows;
+    return 0;
+}
+
+// Prints the errors report_error() collected in 'errors' to stderr, each
+// after its row (or on its own for line 0, the line being compiled), and
+// frees them. Returns the number printed.
+static int print_column_errors(struct Chunk *errors) {
+    int count = 0;
+    for (char *e = errors->errors.data, *end = e + errors->errors.len; e < end; count++) {
+        char *msg;
+        long row = strtol(e, &msg, 10);
+        char *nl = memchr(msg, '\n', (size_t)(end - msg));
+        if (row > 0) fprintf(stderr, "row %ld:%.*s\n", row, (int)(nl - msg), msg);
+        else fprintf(stderr, "Error:%.*s\n", (int)(nl - msg), msg);
+        e = nl + 1;
+    }
+    free(errors->errors.data);
+    errors->errors = (struct Buffer){ 0 };
+    return count;
+}
+
+// '--columns line file.csv' or '--columns line name=file...'. Prints one
+// result per row. Returns 0, 1 if some rows failed, or 2 if it could not
+// start.
+int run_columns(const char *line, int num_files, char **files) {
+    struct Table t = { .rows = -1 };
+    int loaded = 0;
+    if (num_files == 1 && strchr(files[0], '=') == NULL) {
+        t.rows = 0;
+        loaded = load_csv(files[0], &t) == 0;
+    } else {
+        loaded = 1;
+        for (int i = 0; i < num_files && loaded; i++) {
+            if (strchr(files[i], '=') == NULL) {
+                fprintf(stderr, "%s: expected name=file, or a single CSV file\n", files[i]);
+                loaded = 0;
+            } else if (load_binary(files[i], &t) != 0) {
+                loaded = 0;
+            }
+        }
+    }
+    // Diagnostics go to stderr, keeping stdout for the results
+    struct Program prog = { 0 };
+    struct Chunk errors = { 0 };
+    error_chunk = &errors;
+    error_line = 0;
+    int compiled = loaded && compile(line, &prog) == 0;
+    error_chunk = NULL;
+    print_column_errors(&errors);
+    if (!compiled) {
+        program_free(&prog);
+        table_free(&t);
+        return 2;
+    }
+
+    const struct Kernels *k = best_kernels();
+    struct ColumnState s;
+    column_state_init(&s, &prog);
+    int out[COLUMN_BLOCK];
+    unsigned char failed[COLUMN_BLOCK];
+    int row[MAX_VARS] = { 0 };
+    struct Buffer text = { 0 };
+    int status = 0;
+    for (long first = 0; first < t.rows && status != 2; first += COLUMN_BLOCK) {
+        int n = t.rows - first < COLUMN_BLOCK ? (int)(t.rows - first) : COLUMN_BLOCK;
+        if (eval_columns(&prog, k, &t, &s, first, n, out, failed) == 0) {
+            for (int i = 0; i < n; i++) {
+                buffer_result_line(&text, failed[i] ? -1 : 0, out[i]);
+                if (!failed[i]) continue;
+                fprintf(stderr, "row %ld: Division by zero!\n", first + i + 1);
+                status = 1;
+            }
+        } else {
+            // Some row needs more than an int: the VM does the block a row
+            // at a time, collecting its errors
+            error_chunk = &errors;
+            for (int i = 0; i < n; i++) {
+                for (int v = 0; v < MAX_VARS; v++) {
+                    if (t.data[v]) row[v] = t.data[v][first + i];
+                }
+                error_line = first + i + 1;
+                wide_vars_clear();
+                int result = 0;
+                int ran = run_program(&prog, row, &result);
+                buffer_result_line(&text, ran, result);
+            }
+            error_chunk = NULL;
+            if (print_column_errors(&errors) > 0) status = 1;
+        }
+        if (text.len >= BATCH_CHUNK || first + n >= t.rows) {
+            if (write_all(STDOUT_FILENO, text.data, text.len) == -1) {
+                fprintf(stderr, "write error: %s\n", strerror(errno));
+                status = 2;
+            }
+            text.len = 0;
+        }
+    }
+
+    free(text.data);
+    column_state_free(&s);
+    program_free(&prog);
+    table_free(&t);
+    return status;
+}
+
+// --- Benchmark (-B) ---
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static int count_instructions(const struct Program *prog) {
+    int n = 0;
+    for (size_t pc = 0; pc < prog->len; pc += instruction_size((enum Opcode)prog->code[pc])) n++;
+    return n;
+}
+
+// Runs prog 'count' times, setting variables a and b (when >= 0) from the
+// loop counter first, small enough that nothing overflows. Returns the
+// seconds taken.
+static double time_program(const struct Program *prog, long count, int a, int b) {
+    volatile int sink = 0;
+    int result;
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        if (a >= 0) {
+            variables[a] = (int)(i & 1023);
+            variables[b] = (int)((i * 7) & 1023);
+        }
+        run_program(prog, variables, &result);
+        sink += result;
+    }
+    return now_seconds() - start;
+}
+
+// Evaluates a few expressions 'count' times each, by re-parsing the text
+// every time, by running its compiled bytecode and by running it as machine
+// code. Then runs formulas over changing variables, compiled with and
+// without the optimizer, and to machine code. Last, compiles and runs
+// lines that repeat, with and without the expression cache.
+void run_benchmark(long count) {
+    static const char *exprs[] = {
+        "3 + 4 * (2 - 1)",
+        "((7 * 6) - (5 + 4)) / 3 + 100 * (2 + 3 * (4 - 1))",
+        "1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9 + 10 + 11 + 12 + 13 + 14 + 15 + 16",
+    };
+    static const char *formulas[] = {
+        "(a * 3 + b / 2) * (a * 3 + b / 2) + 4 * 2 * a",
+        "a * 1 + b * 0 + (a + 0) * 8 + b / 4 + (2 + 3) * (4 - 1)",
+        "t = a + b; (a + b) * (a + b) - t / 2 + (a + b) * 16 + 1 + 2 + 3",
+    };
+    size_t num_exprs = sizeof(exprs) / sizeof(exprs[0]);
+    size_t num_formulas = sizeof(formulas) / sizeof(formulas[0]);
+    volatile int sink = 0; // Keeps the loops from being optimized away
+    struct Program prog = { 0 };
+    if (count <= 0) count = 1000000;
+    if (!JIT_SUPPORTED) printf("(no JIT on this platform: the jit columns run the VM)\n\n");
+
+    // Constant expressions would fold away to a single push
+    optimize = 0;
+    printf("%-8s %14s %14s %14s %8s %8s\n", "expr", "parse evals/s", "vm evals/s", "jit evals/s",
+           "vm x", "jit x");
+    for (size_t e = 0; e < num_exprs; e++) {
+        double start = now_seconds();
+        for (long i = 0; i < count; i++) {
+            expression = exprs[e];
+            sink += parse_expression();
+        }
+        double parse_time = now_seconds() - start;
+
+        compile(exprs[e], &prog);
+        double vm_time = time_program(&prog, count, -1, -1);
+        jit_compile(&prog);
+        double jit_time = time_program(&prog, count, -1, -1);
+        program_free(&prog);
+
+        printf("#%-7zu %14.0f %14.0f %14.0f %7.1fx %7.1fx\n", e + 1, count / parse_time,
+               count / vm_time, count / jit_time, parse_time / vm_time, parse_time / jit_time);
+    }
+
+    int zero;
+    compile("a = 0; b = 0", &prog);
+    run_program(&prog, variables, &zero);
+    program_define(&prog);
+    program_free(&prog);
+    int a = find_variable("a", 1), b = find_variable("b", 1);
+    printf("\n%-8s %7s %14s %10s %14s %14s %8s %8s\n", "formula", "instrs", "evals/s",
+           "opt instrs", "opt evals/s", "jit evals/s", "opt x", "jit x");
+    for (size_t f = 0; f < num_formulas; f++) {
+        double times[2];
+        int instrs[2];
+        for (optimize = 0; optimize <= 1; optimize++) {
+            compile(formulas[f], &prog);
+            instrs[optimize] = count_instructions(&prog);
+            times[optimize] = time_program(&prog, count, a, b);
+        }
+        jit_compile(&prog);
+        double jit_time = time_program(&prog, count, a, b);
+        program_free(&prog);
+        printf("f%-7zu %7d %14.0f %10d %14.0f %14.0f %7.1fx %7.1fx\n", f + 1, instrs[0],
+               count / times[0], instrs[1], count / times[1], count / jit_time,
+               times[0] / times[1], times[0] / jit_time);
+    }
+    optimize = 1;
+
+    // The formulas again, over columns of 'count' rows
+    struct Table t = { .rows = count };
+    t.data[a] = malloc((size_t)count * sizeof(int));
+    t.data[b] = malloc((size_t)count * sizeof(int));
+    for (long i = 0; i < count; i++) {
+        t.data[a][i] = (int)(i & 1023);
+        t.data[b][i] = (int)((i * 7) & 1023);
+    }
+    const struct Kernels *kernels[] = { &scalar_kernels, best_kernels() };
+    int out[COLUMN_BLOCK];
+    unsigned char failed[COLUMN_BLOCK];
+    printf("\n%-8s %14s %14s %14s %14s %8s\n", "formula", "vm rows/s", "jit rows/s",
+           "scalar rows/s", best_kernels() == &scalar_kernels ? "(no simd)" : "avx2 rows/s",
+           "speedup");
+    for (size_t f = 0; f < num_formulas; f++) {
+        compile(formulas[f], &prog);
+        double vm_time = time_program(&prog, count, a, b);
+        double column_times[2];
+        struct ColumnState s;
+        column_state_init(&s, &prog);
+        for (int k = 0; k < 2; k++) {
+            double start = now_seconds();
+            for (long first = 0; first < count; first += COLUMN_BLOCK) {
+                int n = count - first < COLUMN_BLOCK ? (int)(count - first) : COLUMN_BLOCK;
+                eval_columns(&prog, kernels[k], &t, &s, first, n, out, failed);
+                sink += out[0];
+            }
+            column_times[k] = now_seconds() - start;
+        }
+        column_state_free(&s);
+        jit_compile(&prog);
+        double jit_time = time_program(&prog, count, a, b);
+        printf("f%-7zu %14.0f %14.0f %14.0f %14.0f %7.1fx\n", f + 1, count / vm_time,
+               count / jit_time, count / column_times[0], count / column_times[1],
+               vm_time / column_times[1]);
+    }
+    table_free(&t);
+
+    // The same lines over and over, spaced differently now and then
+    static const char *lines[] = {
+        "a * 3 + b / 2", "a*3 + b/2", "x = a + b; x * x - 1", "a * 3 + b / 2",
+        "(a + 1) * (b - 1)", "x = a + b;  x * x - 1", "b / 4 + a / 8",
+    };
+    size_t num_lines = sizeof(lines) / sizeof(lines[0]);
+    int result;
+    struct Cache *cache = calloc(1, sizeof(struct Cache));
+    double start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        compile(lines[i % num_lines], &prog);
+        run_program(&prog, variables, &result);
+        sink += result;
+    }
+    double compile_time = now_seconds() - start;
+    start = now_seconds();
+    for (long i = 0; i < count; i++) {
+        run_program(cache_compile(cache, lines[i % num_lines]), variables, &result);
+        sink += result;
+    }
+    double cache_time = now_seconds() - start;
+    printf("\n%-8s %14s %14s %8s %10s %10s\n", "lines", "compile/s", "cached/s", "speedup",
+           "hits", "misses");
+    printf("%-8zu %14.0f %14.0f %7.1fx %10ld %10ld\n", num_lines, count / compile_time,
+           count / cache_time, compile_time / cache_time, cache->hits, cache->misses);
+    cache_free(cache);
+    program_free(&prog);
+
+    // Multiplying large numbers the long way and by Karatsuba's method
+    printf("\n%-8s %8s %14s %14s %8s\n", "digits", "limbs", "long mul/s", "karatsuba/s", "speedup");
+    static const size_t sizes[] = { 1000, 10000, 100000 };
+    unsigned seed = 12345;
+    for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        size_t digits = sizes[z];
+        char *text = malloc(digits);
+        struct Number x, y;
+        for (int which = 0; which < 2; which++) {
+            for (size_t i = 0; i < digits; i++) {
+                seed = seed * 1103515245 + 12345;
+                text[i] = (char)('0' + (seed >> 16) % 10 + (i == 0 && (seed >> 16) % 10 == 0));
+            }
+            *(which ? &y : &x) = number_parse(text, digits);
+        }
+        size_t n = x.len + y.len;
+        uint32_t *slow = malloc(n * sizeof(uint32_t)), *fast = malloc(n * sizeof(uint32_t));
+        double times[2];
+        for (int k = 0; k < 2; k++) {
+            long reps = 0;
+            double start = now_seconds();
+            do {
+                if (k == 0) mag_mul_school(slow, x.limbs, x.len, y.limbs, y.len);
+                else mag_mul(fast, x.limbs, x.len, y.limbs, y.len);
+                reps++;
+            } while (now_seconds() - start < 0.2);
+            times[k] = (now_seconds() - start) / (double)reps;
+        }
+        printf("%-8zu %8zu %14.1f %14.1f %7.1fx%s\n", digits, x.len, 1 / times[0], 1 / times[1],
+               times[0] / times[1], memcmp(slow, fast, n * sizeof(uint32_t)) ? " (differ!)" : "");
+        number_free(&x);
+        number_free(&y);
+        free(slow);
+        free(fast);
+        free(text);
+    }
+
+    printf("\n");
+    for (size_t e = 0; e < num_exprs; e++) printf("#%zu: %s\n", e + 1, exprs[e]);
+    for (size_t f = 0; f < num_formulas; f++) printf("f%zu: %s\n", f + 1, formulas[f]);
+}
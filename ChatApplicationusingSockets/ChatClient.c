@@ -2,79 +2,869 @@
  * Chat Client in C (TCP/IP)
  * * Features:
  * - Connects to the server using connect().
- * - Sends input to server and waits for a reply.
+ * - Full duplex: watches the keyboard and the socket together with poll(),
+ *   so incoming messages show up while you type.
+ * - Pipelined: each typed (or piped) line is sent as a length-prefixed frame
+ *   (see ChatProtocol.h) right away, without waiting for the previous one.
+ *   The server acknowledges each by sequence number; rejected messages are
+ *   reported by number, and on exit the client waits for outstanding acks.
+ * - "/to <id> <text>" sends a private message to one client.
+ * - "/sub <topic>" and "/unsub <topic>" join and leave a room;
+ *   "/pub <topic> <text>" sends to everyone in it (no need to be a member).
+ * - "/history [offset]" replays the server's broadcast history from an
+ *   offset, by default from just after the last message we saw, so a client
+ *   that reconnects can catch up. Copies seen twice are dropped by offset.
+ * - Same-host mode (-u): connects to the server's Unix socket instead of TCP
+ *   and exchanges frames through the shared-memory rings it hands over
+ *   (see ChatShm.h), skipping the network stack entirely.
+ * - Decodes every frame that arrives in a read, so coalesced messages are
+ *   all shown and long messages arrive intact.
+ * - Headless load generator (-B): N connections spread over worker threads
+ *   send timestamped private messages to themselves, either at a fixed total
+ *   rate or in closed loop, and the round trips are collected in an
+ *   HDR-style histogram. Reports throughput and p50/p99/p99.9 latency.
+ *
+ * Usage: ChatClient [-h host] [-p port] [-u path]
+ *        ChatClient -B [-h host] [-p port] [-c conns] [-s bytes] [-r rate]
+ *                   [-w window] [-d seconds] [-T threads]
+ *   -u path     Connect through the server's same-host socket (ChatServer -u).
+ *   -c conns    Connections to open (default 100).
+ *   -s bytes    Payload size per message, at least 8 (default 64).
+ *   -r rate     Total messages/s across all connections; 0 = closed loop
+ *               (default 0).
+ *   -w window   Closed loop: messages in flight per connection (default 1).
+ *   -d seconds  Measured duration, after a 1 s warm-up (default 10).
+ *   -T threads  Worker threads (default 1).
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "ChatProtocol.h"
+#include "Histogram.h"
+#include "ChatShm.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define READ_CHUNK 65536
+#define MAX_EVENTS 256
+#define WARMUP_NS 1000000000ull
+#define MAX_IN_FLIGHT 4096       // Unacknowledged messages before we stop reading stdin
+#define MAX_UNSENT (1 << 20)     // Bytes queued for the socket before we stop reading stdin
+#define SEEN_WINDOW 65536        // Recent history offsets remembered to drop live duplicates
 
-int main() {
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    char buffer[BUFFER_SIZE] = {0};
-    char message[BUFFER_SIZE];
+// Received bytes not yet decoded into frames (also used for unsent bytes)
+struct InBuffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
 
-    printf("========================================\n");
-    printf("           Chat Client                  \n");
-    printf("========================================\n");
+// A sent message still waiting for its ACK
+struct Pending {
+    uint32_t seq;
+    uint64_t sent_ns;
+};
 
-    // 1. Create Socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        printf("\n Socket creation error \n");
-        return -1;
+// Interactive session state
+struct Chat {
+    int sock;
+    int tty;                    // stdin is a terminal: show a prompt
+    int stdin_open;             // 0 after EOF or 'exit'
+    int bye_sent;
+    uint32_t seq;
+    struct Pending pending[MAX_IN_FLIGHT];  // Ring, oldest first
+    int head;
+    int count;
+    uint64_t acked;
+    uint64_t rtt_sum_ns;
+    uint64_t seen_upto;         // History offset after the newest logged message shown
+    uint64_t seen[SEEN_WINDOW / 64];  // Bit per offset in [seen_upto - SEEN_WINDOW, seen_upto)
+    int replaying;              // HISTORY requests not yet finished
+    struct InBuffer in;         // Socket bytes not yet decoded
+    struct InBuffer out;        // Encoded frames not yet written
+    struct InBuffer line;       // Partial stdin line
+    struct ShmLink *shm;        // Same-host mode: frames go through shared rings
+};
+
+// One load-generator connection
+struct BenchConn {
+    int fd;
+    uint32_t id;            // Our client id; messages are addressed to ourselves
+    int want_write;         // EPOLLOUT registered because out is backed up
+    uint32_t seq;
+    struct InBuffer in;
+    struct InBuffer out;
+};
+
+// One load-generator thread and the connections it owns
+struct BenchWorker {
+    int index;
+    int num_conns;
+    struct BenchConn *conns;
+    double rate;            // Messages/s for this worker; 0 = closed loop
+    int epoll_fd;
+    pthread_t thread;
+    struct Histogram hist;
+    uint64_t sent;
+    uint64_t received;      // Replies that arrived inside the measured window
+    uint64_t errors;        // ERROR frames (e.g. messages dropped by backpressure)
+    int failed;
+};
+
+struct BenchConfig {
+    const char *host;
+    int port;
+    int conns;
+    int size;
+    double rate;
+    int window;
+    int seconds;
+    int threads;
+    pthread_barrier_t ready;    // Everyone connected; start the clock
+};
+
+struct BenchConfig bench = {
+    .host = "127.0.0.1", .port = PORT, .conns = 100, .size = 64, .window = 1, .seconds = 10, .threads = 1
+};
+
+// Function Prototypes
+int connect_to(const char *host, int port);
+int run_chat(struct Chat *chat);
+void chat_send(struct Chat *chat, int type, uint64_t seq, uint32_t peer, const char *payload, size_t len);
+int chat_flush(struct Chat *chat);
+ssize_t chat_transmit(struct Chat *chat, const char *data, size_t len);
+ssize_t chat_receive(struct Chat *chat, char *buf, size_t cap);
+int chat_read_socket(struct Chat *chat);
+void chat_read_stdin(struct Chat *chat);
+void chat_handle_line(struct Chat *chat, char *line);
+void chat_ack(struct Chat *chat, const struct FrameHeader *h, const char *payload);
+void print_frame(struct Chat *chat, const struct FrameHeader *h, const char *payload);
+int run_benchmark();
+void *bench_thread(void *arg);
+int bench_connect(struct BenchWorker *w);
+int bench_send(struct BenchWorker *w, struct BenchConn *c, uint64_t stamp);
+int bench_flush(struct BenchWorker *w, struct BenchConn *c);
+int bench_read(struct BenchWorker *w, struct BenchConn *c, uint64_t measure_from, uint64_t end);
+int in_reserve(struct InBuffer *b, size_t extra);
+uint64_t now_ns();
+
+int main(int argc, char *argv[]) {
+    static struct Chat chat;
+    static struct ShmLink link;
+    const char *local_path = NULL;
+    int benchmark = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Bh:p:u:c:s:r:w:d:T:")) != -1) {
+        switch (opt) {
+            case 'B': benchmark = 1; break;
+            case 'h': bench.host = optarg; break;
+            case 'p': bench.port = atoi(optarg); break;
+            case 'u': local_path = optarg; break;
+            case 'c': bench.conns = atoi(optarg); break;
+            case 's': bench.size = atoi(optarg); break;
+            case 'r': bench.rate = atof(optarg); break;
+            case 'w': bench.window = atoi(optarg); break;
+            case 'd': bench.seconds = atoi(optarg); break;
+            case 'T': bench.threads = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-h host] [-p port] [-u path]\n"
+                                "       %s -B [-h host] [-p port] [-c conns] [-s bytes] [-r rate]\n"
+                                "             [-w window] [-d seconds] [-T threads]\n", argv[0], argv[0]);
+                return 1;
+        }
     }
+    if (benchmark) return run_benchmark();
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+    chat.tty = isatty(STDIN_FILENO);
+    if (chat.tty) {
+        printf("========================================\n");
+        printf("           Chat Client                  \n");
+        printf("========================================\n");
+    }
 
-    // Convert IPv4 and IPv6 addresses from text to binary form
-    // 127.0.0.1 is "localhost" (your own computer)
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        printf("\nInvalid address/ Address not supported \n");
+    // 1-2. Create the socket and connect to the server
+    if (local_path != NULL) {
+        chat.sock = shm_connect(local_path, &link);
+        chat.shm = &link;
+    } else {
+        chat.sock = connect_to(bench.host, bench.port);
+    }
+    if (chat.sock < 0) {
+        printf("\nConnection Failed. Is the server running?\n");
         return -1;
     }
+    if (chat.tty) printf("Connected to server! Type 'exit' to quit, '/to <id> <text>' to whisper,\n"
+                           "'/history [offset]' to catch up on what you missed.\n\n");
 
-    // 2. Connect to the Server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        printf("\nConnection Failed. Is the server running?\n");
+    // 3-4. Send and receive at the same time until we leave
+    int rc = run_chat(&chat);
+
+    if (chat.acked > 0) {
+        printf("%llu message(s) acknowledged, mean round trip %.1f us.\n", (unsigned long long)chat.acked,
+               chat.rtt_sum_ns / 1e3 / chat.acked);
+    }
+    free(chat.in.data);
+    free(chat.out.data);
+    free(chat.line.data);
+    if (chat.shm != NULL) shm_link_close(chat.shm);
+    close(chat.sock);
+    return rc;
+}
+
+// Resolves host (name or IPv4/IPv6 address) and returns a connected socket
+int connect_to(const char *host, int port) {
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    int sock = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) return -1;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0) continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    return sock;
+}
+
+// Event loop: one poll() over stdin and the socket (plus the wake-up
+// eventfd in same-host mode). Stdin is only watched while the in-flight
+// window and the unsent backlog have room.
+int run_chat(struct Chat *chat) {
+    int stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+    int rc = -1;
+
+    fcntl(chat->sock, F_SETFL, fcntl(chat->sock, F_GETFL) | O_NONBLOCK);
+    // The terminal is shared with the shell, so this is undone on return
+    fcntl(STDIN_FILENO, F_SETFL, stdin_flags | O_NONBLOCK);
+    chat->stdin_open = 1;
+
+    while (1) {
+        // Leaving: once everything we sent is acknowledged, say goodbye
+        if (!chat->stdin_open && chat->count == 0 && !chat->bye_sent) {
+            chat_send(chat, FRAME_BYE, ++chat->seq, 0, NULL, 0);
+            chat->bye_sent = 1;
+        }
+        if (chat->bye_sent && chat->out.len == 0) {
+            if (chat->tty) printf("Exiting chat...\n");
+            rc = 0;
+            break;
+        }
+
+        struct pollfd fds[3];
+        int room = chat->count < MAX_IN_FLIGHT && chat->out.len < MAX_UNSENT;
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = (chat->stdin_open && room) ? POLLIN : 0;
+        fds[1].fd = chat->sock;
+        fds[1].events = POLLIN | (chat->out.len > 0 && chat->shm == NULL ? POLLOUT : 0);
+        fds[2].fd = chat->shm ? chat->shm->wake_fd : -1;
+        fds[2].events = POLLIN;
+
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+        int woken = (fds[2].revents & POLLIN) != 0;
+        if (woken) shm_link_rearm(chat->shm);
+        if ((fds[1].revents & (POLLIN | POLLHUP | POLLERR)) || woken) {
+            // In same-host mode the server never writes to the socket, so
+            // activity there means it has gone
+            if (chat_read_socket(chat) < 0 || (chat->shm != NULL && fds[1].revents != 0)) {
+                printf("%sServer disconnected.\n", chat->tty ? "\r\033[K" : "");
+                break;
+            }
+        }
+        // Acks may have reopened the window for lines we already buffered
+        if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) || (chat->stdin_open && chat->line.len > 0)) {
+            chat_read_stdin(chat);
+        }
+        if (chat->out.len > 0 && chat_flush(chat) < 0) {
+            printf("Server disconnected.\n");
+            break;
+        }
+    }
+    fcntl(STDIN_FILENO, F_SETFL, stdin_flags);
+    return rc < 0 ? 1 : 0;
+}
+
+// Encodes a frame onto the outgoing buffer; everything but HISTORY and BYE
+// asks for an ACK
+void chat_send(struct Chat *chat, int type, uint64_t seq, uint32_t peer, const char *payload, size_t len) {
+    int wants_ack = (type != FRAME_HISTORY && type != FRAME_BYE);
+    struct FrameHeader h = { (uint32_t)len, (uint8_t)type, wants_ack ? FRAME_FLAG_ACK : 0, seq, peer };
+
+    if (in_reserve(&chat->out, FRAME_HEADER_SIZE + len) < 0) return;
+    frame_encode_header(chat->out.data + chat->out.len, &h);
+    if (len > 0) memcpy(chat->out.data + chat->out.len + FRAME_HEADER_SIZE, payload, len);
+    chat->out.len += FRAME_HEADER_SIZE + len;
+
+    if (wants_ack) {
+        struct Pending *p = &chat->pending[(chat->head + chat->count) % MAX_IN_FLIGHT];
+        p->seq = (uint32_t)seq;
+        p->sent_ns = now_ns();
+        chat->count++;
+    }
+}
+
+// Writes as much of the outgoing buffer as the socket accepts
+int chat_flush(struct Chat *chat) {
+    size_t pos = 0;
+
+    while (pos < chat->out.len) {
+        ssize_t n = chat_transmit(chat, chat->out.data + pos, chat->out.len - pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return -1;
+        pos += n;
+    }
+    memmove(chat->out.data, chat->out.data + pos, chat->out.len - pos);
+    chat->out.len -= pos;
+    return 0;
+}
+
+// send() on the socket, or a write into the shared ring that wakes the server
+ssize_t chat_transmit(struct Chat *chat, const char *data, size_t len) {
+    if (chat->shm == NULL) return send(chat->sock, data, len, MSG_NOSIGNAL);
+
+    size_t n = shm_ring_write(&chat->shm->out, data, len);
+    if (n == 0) {
+        errno = EAGAIN; // The server wakes us when it has made room
         return -1;
     }
+    shm_link_notify(chat->shm);
+    return (ssize_t)n;
+}
+
+// read() from the socket, or a copy out of the shared ring
+ssize_t chat_receive(struct Chat *chat, char *buf, size_t cap) {
+    if (chat->shm == NULL) return read(chat->sock, buf, cap);
 
-    printf("Connected to server! Type 'exit' to quit.\n\n");
+    const char *data;
+    size_t n = shm_ring_peek(&chat->shm->in, &data);
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (n > cap) n = cap;
+    memcpy(buf, data, n);
+    if (shm_ring_consume(&chat->shm->in, n)) shm_wake(chat->shm->peer_fd);
+    return (ssize_t)n;
+}
 
-    // Chat Loop
+// Reads whatever has arrived and handles every complete frame.
+// Returns -1 when the server is gone.
+int chat_read_socket(struct Chat *chat) {
     while (1) {
-        // 3. Send Message
-        printf("You: ");
-        fgets(message, BUFFER_SIZE, stdin);
-        send(sock, message, strlen(message), 0);
+        size_t needed = frame_bytes_needed(chat->in.data, chat->in.len);
+        size_t extra = needed > chat->in.len ? needed - chat->in.len : 0;
+        if (in_reserve(&chat->in, extra > BUFFER_SIZE ? extra : BUFFER_SIZE) < 0) return -1;
+
+        ssize_t n = chat_receive(chat, chat->in.data + chat->in.len, chat->in.cap - chat->in.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        if (n <= 0) return -1;
+        chat->in.len += n;
+
+        // Decode everything this read completed
+        size_t pos = 0;
+        struct FrameHeader h;
+        const char *payload;
+        long used;
+        while ((used = frame_decode(chat->in.data + pos, chat->in.len - pos, &h, &payload)) > 0) {
+            pos += used;
+            if (h.type == FRAME_ACK || (h.type == FRAME_ERROR && h.seq != 0)) {
+                chat_ack(chat, &h, payload);
+            } else {
+                print_frame(chat, &h, payload);
+                if (h.type == FRAME_BYE) return -1;
+            }
+        }
+        if (used < 0) {
+            printf("Server sent a malformed frame.\n");
+            return -1;
+        }
+        memmove(chat->in.data, chat->in.data + pos, chat->in.len - pos);
+        chat->in.len -= pos;
+    }
+}
 
-        if (strncmp(message, "exit", 4) == 0) {
-            printf("Exiting chat...\n");
+// Handles the complete lines already buffered, then reads more of stdin,
+// for as long as the in-flight window has room. EOF (Ctrl+D, or the end of
+// a pipe) behaves like 'exit'.
+void chat_read_stdin(struct Chat *chat) {
+    int handled = 0;
+    int eof = 0;
+
+    while (chat->stdin_open && chat->count < MAX_IN_FLIGHT && chat->out.len < MAX_UNSENT) {
+        char *nl = chat->line.len > 0 ? memchr(chat->line.data, '\n', chat->line.len) : NULL;
+        if (nl != NULL) {
+            *nl = 0;
+            chat_handle_line(chat, chat->line.data);
+            handled++;
+            chat->line.len -= nl + 1 - chat->line.data;
+            memmove(chat->line.data, nl + 1, chat->line.len);
+            continue;
+        }
+        if (eof) {
+            if (chat->line.len > 0) {
+                chat->line.data[chat->line.len] = 0; // The read below left room
+                chat_handle_line(chat, chat->line.data);
+                chat->line.len = 0;
+            }
+            chat->stdin_open = 0;
             break;
         }
 
-        // 4. Receive Reply
-        memset(buffer, 0, BUFFER_SIZE);
-        int valread = read(sock, buffer, BUFFER_SIZE);
-        if (valread <= 0) {
-            printf("Server disconnected.\n");
+        if (in_reserve(&chat->line, BUFFER_SIZE) < 0) return;
+        ssize_t n = read(STDIN_FILENO, chat->line.data + chat->line.len, chat->line.cap - chat->line.len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) eof = 1;
+        else chat->line.len += n;
+    }
+    if (chat->tty && chat->stdin_open && handled > 0) {
+        printf("You: ");
+        fflush(stdout);
+    }
+}
+
+void chat_handle_line(struct Chat *chat, char *line) {
+    size_t len = strlen(line);
+
+    if (len > 0 && line[len - 1] == '\r') line[--len] = 0;
+    if (strncmp(line, "exit", 4) == 0) {
+        chat->stdin_open = 0;
+        return;
+    }
+    if (len == 0) return;
+
+    if (strncmp(line, "/history", 8) == 0) {
+        char *end;
+        unsigned long long from = strtoull(line + 8, &end, 10);
+        if (end == line + 8) from = chat->seen_upto;
+        // The request carries the offset in place of a sequence number
+        chat_send(chat, FRAME_HISTORY, from, 0, NULL, 0);
+        chat->replaying++;
+    } else if (strncmp(line, "/to ", 4) == 0) {
+        char *text;
+        unsigned long to = strtoul(line + 4, &text, 10);
+        while (*text == ' ') text++;
+        chat_send(chat, FRAME_DIRECT, ++chat->seq, (uint32_t)to, text, strlen(text));
+    } else if (strncmp(line, "/sub ", 5) == 0 || strncmp(line, "/unsub ", 7) == 0) {
+        int type = line[1] == 's' ? FRAME_SUB : FRAME_UNSUB;
+        char *topic = strchr(line, ' ') + 1;
+        chat_send(chat, type, ++chat->seq, 0, topic, strcspn(topic, " "));
+    } else if (strncmp(line, "/pub ", 5) == 0) {
+        // Payload: topic length, topic, text
+        char *topic = line + 5;
+        size_t topic_len = strcspn(topic, " ");
+        char *text = topic + topic_len;
+        while (*text == ' ') text++;
+        if (topic_len == 0 || topic_len > TOPIC_MAX) {
+            printf("Topic names are 1-%d bytes.\n", TOPIC_MAX);
+            return;
+        }
+        char *payload = malloc(1 + topic_len + strlen(text));
+        if (payload == NULL) return;
+        payload[0] = (char)topic_len;
+        memcpy(payload + 1, topic, topic_len);
+        memcpy(payload + 1 + topic_len, text, strlen(text));
+        chat_send(chat, FRAME_PUB, ++chat->seq, 0, payload, 1 + topic_len + strlen(text));
+        free(payload);
+    } else {
+        chat_send(chat, FRAME_MSG, ++chat->seq, 0, line, len);
+    }
+}
+
+// Retires in-flight messages up to an ACK, or reports a rejected one.
+// The server answers each connection in order, so acks arrive oldest first.
+void chat_ack(struct Chat *chat, const struct FrameHeader *h, const char *payload) {
+    uint64_t now = now_ns();
+
+    while (chat->count > 0) {
+        struct Pending *p = &chat->pending[chat->head];
+        // Serial-number comparison: survives seq wrapping around
+        if ((int32_t)(p->seq - h->seq) > 0) break;
+        if (p->seq == h->seq) {
+            if (h->type == FRAME_ACK) {
+                chat->acked++;
+                chat->rtt_sum_ns += now - p->sent_ns;
+            } else {
+                printf("%sMessage #%u was rejected: %.*s\n", chat->tty ? "\r\033[K" : "", (unsigned)h->seq,
+                       (int)h->length, payload);
+            }
+        }
+        chat->head = (chat->head + 1) % MAX_IN_FLIGHT;
+        chat->count--;
+    }
+}
+
+// Whether the logged message at 'offset' was already shown. Offsets older
+// than the window count as unseen.
+int chat_seen(const struct Chat *chat, uint64_t offset) {
+    if (offset >= chat->seen_upto || chat->seen_upto - offset > SEEN_WINDOW) return 0;
+    return (chat->seen[offset % SEEN_WINDOW / 64] >> (offset % 64)) & 1;
+}
+
+// Records that the logged message at 'offset' was shown, sliding the
+// window forward (and forgetting what falls out of it) when it is new.
+void chat_mark_seen(struct Chat *chat, uint64_t offset) {
+    if (offset + SEEN_WINDOW < chat->seen_upto) return;
+    if (offset >= chat->seen_upto) {
+        if (offset - chat->seen_upto >= SEEN_WINDOW) {
+            memset(chat->seen, 0, sizeof(chat->seen));
+        } else {
+            for (uint64_t o = chat->seen_upto; o <= offset; o++) {
+                chat->seen[o % SEEN_WINDOW / 64] &= ~(1ull << (o % 64));
+            }
+        }
+        chat->seen_upto = offset + 1;
+    }
+    chat->seen[offset % SEEN_WINDOW / 64] |= 1ull << (offset % 64);
+}
+
+// Prints one incoming frame above the prompt
+void print_frame(struct Chat *chat, const struct FrameHeader *h, const char *payload) {
+    if (h->flags & FRAME_FLAG_LOGGED) {
+        // Shards deliver live broadcasts out of offset order, so a live frame
+        // is only a duplicate if this very offset was shown already (by a
+        // replay). Everything a replay asked for is shown.
+        if (!chat->replaying && chat_seen(chat, h->seq)) return;
+        chat_mark_seen(chat, h->seq);
+    }
+
+    if (chat->tty) printf("\r\033[K");
+    if (chat->replaying && (h->flags & FRAME_FLAG_LOGGED)) printf("[#%llu] ", (unsigned long long)h->seq);
+    switch (h->type) {
+        case FRAME_HELLO:
+            printf("You are client %u.\n", h->peer);
+            break;
+        case FRAME_MSG:
+            if (h->peer == 0) printf("Server: %.*s\n", (int)h->length, payload);
+            else printf("Client %u: %.*s\n", h->peer, (int)h->length, payload);
+            break;
+        case FRAME_DIRECT:
+            printf("Client %u (private): %.*s\n", h->peer, (int)h->length, payload);
+            break;
+        case FRAME_PUB: {
+            const char *topic, *text;
+            size_t topic_len, text_len;
+            if (frame_split_topic(payload, h->length, &topic, &topic_len, &text, &text_len) == 0) {
+                printf("[%.*s] Client %u: %.*s\n", (int)topic_len, topic, h->peer, (int)text_len, text);
+            }
             break;
         }
-        printf("Server: %s", buffer);
-        
-        if (strncmp(buffer, "exit", 4) == 0) {
+        case FRAME_ERROR:
+            printf("Server error: %.*s\n", (int)h->length, payload);
+            break;
+        case FRAME_BYE:
             printf("Server ended the chat.\n");
             break;
+        case FRAME_HISTORY:
+            printf("End of history; the next message will be #%llu.\n", (unsigned long long)h->seq);
+            if (chat->replaying > 0) chat->replaying--;
+            break;
+    }
+    if (chat->tty && chat->stdin_open && h->type != FRAME_BYE) printf("You: ");
+    fflush(stdout);
+}
+
+// -B: drives the server with the configured load and prints a report
+int run_benchmark() {
+    struct BenchWorker *workers;
+    struct Histogram total;
+    struct rlimit rl;
+    uint64_t sent = 0, received = 0, errors = 0;
+    int failed = 0;
+
+    if (bench.conns < 1) bench.conns = 1;
+    if (bench.threads < 1) bench.threads = 1;
+    if (bench.threads > bench.conns) bench.threads = bench.conns;
+    if (bench.size < (int)sizeof(uint64_t)) bench.size = sizeof(uint64_t); // Room for the timestamp
+    if (bench.window < 1) bench.window = 1;
+    if (bench.seconds < 1) bench.seconds = 1;
+
+    // Thousands of connections need thousands of descriptors
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    printf("Benchmarking %s:%d: %d connection(s) on %d thread(s), %d-byte messages, ", bench.host,
+           bench.port, bench.conns, bench.threads, bench.size);
+    if (bench.rate > 0) printf("%.0f msgs/s fixed rate", bench.rate);
+    else printf("closed loop with %d in flight per connection", bench.window);
+    printf(", %d s\n", bench.seconds);
+
+    workers = calloc(bench.threads, sizeof(*workers));
+    if (workers == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_barrier_init(&bench.ready, NULL, bench.threads + 1);
+    for (int i = 0; i < bench.threads; i++) {
+        struct BenchWorker *w = &workers[i];
+        w->index = i;
+        w->num_conns = bench.conns / bench.threads + (i < bench.conns % bench.threads);
+        w->rate = bench.rate / bench.threads;
+        hist_init(&w->hist);
+        if (pthread_create(&w->thread, NULL, bench_thread, w) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Every worker has connected (or failed); start everyone at once
+    pthread_barrier_wait(&bench.ready);
+
+    hist_init(&total);
+    for (int i = 0; i < bench.threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        hist_merge(&total, &workers[i].hist);
+        sent += workers[i].sent;
+        received += workers[i].received;
+        errors += workers[i].errors;
+        failed |= workers[i].failed;
+    }
+    pthread_barrier_destroy(&bench.ready);
+    free(workers);
+
+    if (failed) {
+        printf("Benchmark failed: could not connect or the server went away.\n");
+        return 1;
+    }
+    double secs = bench.seconds;
+    printf("\nSent %llu, received %llu in the measured window, %llu error frame(s)\n",
+           (unsigned long long)sent, (unsigned long long)received, (unsigned long long)errors);
+    printf("Throughput: %.0f msgs/s, %.2f MB/s of payload\n", received / secs,
+           received * (double)bench.size / secs / 1e6);
+    if (total.total == 0) return 0;
+    printf("Latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  mean %.1f\n",
+           total.min / 1e3, hist_percentile(&total, 50) / 1e3, hist_percentile(&total, 90) / 1e3,
+           hist_percentile(&total, 99) / 1e3, hist_percentile(&total, 99.9) / 1e3, total.max / 1e3,
+           (double)total.sum / total.total / 1e3);
+    return 0;
+}
+
+void *bench_thread(void *arg) {
+    struct BenchWorker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int ok = bench_connect(w) == 0;
+
+    pthread_barrier_wait(&bench.ready);
+    if (!ok) goto fail;
+
+    uint64_t start = now_ns();
+    uint64_t measure_from = start + WARMUP_NS;
+    uint64_t end = measure_from + (uint64_t)bench.seconds * 1000000000ull;
+    uint64_t interval = w->rate > 0 ? (uint64_t)(1e9 / w->rate) : 0;
+    uint64_t next_send = start;
+    int next_conn = 0;
+
+    // Closed loop: fill every window up front; replies keep it full
+    if (interval == 0) {
+        for (int i = 0; i < w->num_conns; i++) {
+            for (int k = 0; k < bench.window; k++) {
+                if (bench_send(w, &w->conns[i], now_ns()) < 0) goto fail;
+            }
+            if (bench_flush(w, &w->conns[i]) < 0) goto fail;
+        }
+    }
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end) break;
+
+        int timeout = 100;
+        if (interval > 0) {
+            // Fixed rate: stamp each message with the time it was due, not
+            // the time it went out, so a stalled sender still shows up as
+            // latency (no coordinated omission).
+            while (next_send <= now) {
+                struct BenchConn *c = &w->conns[next_conn];
+                next_conn = (next_conn + 1) % w->num_conns;
+                if (bench_send(w, c, next_send) < 0 || bench_flush(w, c) < 0) goto fail;
+                next_send += interval;
+            }
+            // Sleep until the next send is due; spin when it is under 1 ms away
+            timeout = (int)((next_send - now) / 1000000);
+        }
+
+        int n = epoll_wait(w->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0 && errno != EINTR) goto fail;
+        for (int i = 0; i < n; i++) {
+            struct BenchConn *c = &w->conns[events[i].data.u32];
+            if ((events[i].events & EPOLLOUT) && bench_flush(w, c) < 0) goto fail;
+            if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+                bench_read(w, c, measure_from, end) < 0) goto fail;
+        }
+    }
+    goto done;
+
+fail:
+    w->failed = 1;
+done:
+    for (int i = 0; w->conns != NULL && i < w->num_conns; i++) {
+        if (w->conns[i].fd > 0) close(w->conns[i].fd);
+        free(w->conns[i].in.data);
+        free(w->conns[i].out.data);
+    }
+    free(w->conns);
+    close(w->epoll_fd);
+    return NULL;
+}
+
+// Opens this worker's connections and learns each one's client id
+int bench_connect(struct BenchWorker *w) {
+    w->conns = calloc(w->num_conns, sizeof(*w->conns));
+    w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->conns == NULL || w->epoll_fd < 0) return -1;
+
+    for (int i = 0; i < w->num_conns; i++) {
+        struct BenchConn *c = &w->conns[i];
+        char hello[FRAME_HEADER_SIZE];
+        struct FrameHeader h;
+        int one = 1;
+
+        if ((c->fd = connect_to(bench.host, bench.port)) < 0) return -1;
+        if (recv(c->fd, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) return -1;
+        frame_decode_header(hello, &h);
+        if (h.type != FRAME_HELLO) return -1;
+        c->id = h.peer;
+
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+        if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0) return -1;
+    }
+    return 0;
+}
+
+// Appends one timestamped DIRECT frame addressed to ourselves to c->out
+int bench_send(struct BenchWorker *w, struct BenchConn *c, uint64_t stamp) {
+    struct FrameHeader h = { (uint32_t)bench.size, FRAME_DIRECT, 0, ++c->seq, c->id };
+    size_t total = FRAME_HEADER_SIZE + bench.size;
+
+    if (in_reserve(&c->out, total) < 0) return -1;
+    char *p = c->out.data + c->out.len;
+    frame_encode_header(p, &h);
+    memcpy(p + FRAME_HEADER_SIZE, &stamp, sizeof(stamp));
+    memset(p + FRAME_HEADER_SIZE + sizeof(stamp), 'x', bench.size - sizeof(stamp));
+    c->out.len += total;
+    w->sent++;
+    return 0;
+}
+
+// Writes as much of c->out as the socket takes; waits for EPOLLOUT otherwise
+int bench_flush(struct BenchWorker *w, struct BenchConn *c) {
+    size_t pos = 0;
+
+    while (pos < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + pos, c->out.len - pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return -1;
+        pos += n;
+    }
+    memmove(c->out.data, c->out.data + pos, c->out.len - pos);
+    c->out.len -= pos;
+
+    int want = c->out.len > 0;
+    if (want != c->want_write) {
+        struct epoll_event ev = { .events = EPOLLIN | (want ? EPOLLOUT : 0), .data.u32 = (uint32_t)(c - w->conns) };
+        epoll_ctl(w->epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want;
+    }
+    return 0;
+}
+
+// Drains the socket, records a round trip per echoed frame and, in closed
+// loop, sends one new message per reply
+int bench_read(struct BenchWorker *w, struct BenchConn *c, uint64_t measure_from, uint64_t end) {
+    int replies = 0;
+
+    while (1) {
+        if (in_reserve(&c->in, READ_CHUNK) < 0) return -1;
+        size_t space = c->in.cap - c->in.len;
+        ssize_t n = recv(c->fd, c->in.data + c->in.len, space, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (n <= 0) return -1;
+        c->in.len += n;
+
+        size_t pos = 0;
+        struct FrameHeader h;
+        const char *payload;
+        long used;
+        uint64_t now = now_ns();
+        while ((used = frame_decode(c->in.data + pos, c->in.len - pos, &h, &payload)) > 0) {
+            pos += used;
+            if (h.type == FRAME_ERROR) {
+                w->errors++;
+            } else if (h.type == FRAME_DIRECT && h.length >= sizeof(uint64_t)) {
+                uint64_t stamp;
+                memcpy(&stamp, payload, sizeof(stamp));
+                if (stamp >= measure_from && now < end) {
+                    hist_record(&w->hist, now > stamp ? now - stamp : 0);
+                    w->received++;
+                }
+                replies++;
+            }
+        }
+        if (used < 0) return -1;
+        memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+        c->in.len -= pos;
+        if ((size_t)n < space) break; // Short read: socket drained
+    }
+
+    if (w->rate <= 0 && replies > 0) {
+        uint64_t now = now_ns();
+        while (replies-- > 0) {
+            if (bench_send(w, c, now) < 0) return -1;
         }
+        return bench_flush(w, c);
     }
+    return 0;
+}
 
-    close(sock);
+int in_reserve(struct InBuffer *b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : READ_CHUNK;
+    while (cap < b->len + extra) cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (grown == NULL) return -1;
+    b->data = grown;
+    b->cap = cap;
     return 0;
 }
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
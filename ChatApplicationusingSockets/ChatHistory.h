@@ -0,0 +1,343 @@
+/*
+ * Chat History Log (used by ChatServer.c)
+ * * Features:
+ * - Append-only log of broadcast messages, split into segment files named by
+ *   the offset of their first message (00000000000000000000.log, ...).
+ * - Each record is the exact wire frame (see ChatProtocol.h) with the
+ *   message's 48-bit offset as its seq, so a range of a segment can be
+ *   streamed to a client as-is, e.g. with sendfile().
+ * - Segments are memory-mapped: appends are a memcpy into the page cache and
+ *   nothing about the log lives on the heap.
+ * - A sparse index per segment (<base>.index, also mapped) holds one entry
+ *   per 4 KB of records; a lookup is a binary search plus a short scan.
+ * - The active segment rolls over when full. Whole segments are deleted
+ *   once the log exceeds its size limit or their last write is too old.
+ * - On startup existing segments are re-scanned, so a log cut short by a
+ *   crash resumes after its last complete record.
+ */
+
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ChatProtocol.h"
+
+#ifndef HISTORY_SEGMENT_SIZE
+#define HISTORY_SEGMENT_SIZE (64u * 1024 * 1024)  // Largest segment file
+#endif
+#define HISTORY_INDEX_INTERVAL 4096               // Record bytes per index entry
+#define HISTORY_INDEX_ENTRIES (HISTORY_SEGMENT_SIZE / HISTORY_INDEX_INTERVAL + 1)
+#define HISTORY_AGE_CHECK 1024                    // Appends between age checks
+
+// Position of one record, relative to the segment base
+struct IndexEntry {
+    uint32_t rel;
+    uint32_t pos;
+};
+
+struct Segment {
+    uint64_t base;              // Offset of the first record
+    uint64_t end;               // Offset after the last record
+    int fd;
+    char *map;                  // The segment file, mapped shared
+    size_t capacity;            // Mapped bytes
+    size_t size;                // Bytes of complete records
+    struct IndexEntry *index;   // The mapped .index file
+    uint32_t index_count;
+    size_t last_indexed;        // Record position of the newest index entry
+    time_t last_write;
+    atomic_int refs;            // One for the log, one per range being replayed
+    struct Segment *next;
+};
+
+struct History {
+    pthread_mutex_t lock;       // Appends come from every shard
+    char dir[PATH_MAX - 32];    // Leaves room for the segment file names
+    struct Segment *oldest;
+    struct Segment *active;     // The one being appended to (the newest)
+    size_t total_bytes;
+    size_t retain_bytes;        // 0 = no size limit
+    long retain_seconds;        // 0 = no age limit
+    unsigned appends;
+};
+
+// A byte range of one segment, holding a reference to it
+struct HistoryRange {
+    struct Segment *seg;
+    uint32_t pos;
+    uint32_t len;
+};
+
+static inline void history_path(const struct History *hist, uint64_t base, const char *ext, char *out) {
+    snprintf(out, PATH_MAX, "%s/%020llu.%s", hist->dir, (unsigned long long)base, ext);
+}
+
+static inline void history_index_add(struct Segment *seg, uint64_t offset, size_t pos) {
+    if (seg->index_count > 0 && pos - seg->last_indexed < HISTORY_INDEX_INTERVAL) return;
+    if (seg->index_count == HISTORY_INDEX_ENTRIES) return;
+    seg->index[seg->index_count].rel = (uint32_t)(offset - seg->base);
+    seg->index[seg->index_count].pos = (uint32_t)pos;
+    seg->index_count++;
+    seg->last_indexed = pos;
+}
+
+static inline void history_segment_release(struct Segment *seg) {
+    if (atomic_fetch_sub_explicit(&seg->refs, 1, memory_order_acq_rel) != 1) return;
+    munmap(seg->map, seg->capacity);
+    munmap(seg->index, HISTORY_INDEX_ENTRIES * sizeof(struct IndexEntry));
+    close(seg->fd);
+    free(seg);
+}
+
+// Maps segment `base`, creating it if needed, and rebuilds its index by
+// scanning the records. The active segment is grown to full size so appends
+// never remap.
+static inline struct Segment *history_segment_open(struct History *hist, uint64_t base, int active) {
+    char path[PATH_MAX];
+    struct stat st;
+    struct Segment *seg = calloc(1, sizeof(*seg));
+
+    if (seg == NULL) return NULL;
+    seg->base = seg->end = base;
+    atomic_init(&seg->refs, 1);
+
+    history_path(hist, base, "log", path);
+    seg->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (seg->fd < 0 || fstat(seg->fd, &st) < 0) goto fail;
+    seg->capacity = (size_t)st.st_size;
+    seg->last_write = st.st_mtime;
+    if (active && seg->capacity < HISTORY_SEGMENT_SIZE) {
+        if (ftruncate(seg->fd, HISTORY_SEGMENT_SIZE) < 0) goto fail;
+        seg->capacity = HISTORY_SEGMENT_SIZE;
+        if (st.st_size == 0) seg->last_write = time(NULL);
+    }
+    if (seg->capacity == 0) goto fail;
+    seg->map = mmap(NULL, seg->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if (seg->map == MAP_FAILED) goto fail;
+
+    history_path(hist, base, "index", path);
+    int index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (index_fd < 0) goto fail_map;
+    size_t index_bytes = HISTORY_INDEX_ENTRIES * sizeof(struct IndexEntry);
+    if (ftruncate(index_fd, index_bytes) < 0) {
+        close(index_fd);
+        goto fail_map;
+    }
+    seg->index = mmap(NULL, index_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+    close(index_fd);
+    if (seg->index == MAP_FAILED) goto fail_map;
+
+    // Walk the records; the first bytes that are not a valid frame (zeros
+    // in a fresh segment, or a torn write) end the segment.
+    struct FrameHeader h;
+    const char *payload;
+    long used;
+    while ((used = frame_decode(seg->map + seg->size, seg->capacity - seg->size, &h, &payload)) > 0) {
+        history_index_add(seg, h.seq, seg->size);
+        seg->end = h.seq + 1;
+        seg->size += used;
+    }
+    // Clear a torn header so it cannot be mistaken for a record later
+    if (active && seg->capacity - seg->size >= FRAME_HEADER_SIZE) {
+        memset(seg->map + seg->size, 0, FRAME_HEADER_SIZE);
+    }
+    return seg;
+
+fail_map:
+    munmap(seg->map, seg->capacity);
+fail:
+    if (seg->fd >= 0) close(seg->fd);
+    free(seg);
+    return NULL;
+}
+
+static inline int history_is_segment(const struct dirent *d) {
+    size_t len = strlen(d->d_name);
+    return len == 24 && strcmp(d->d_name + 20, ".log") == 0 && strspn(d->d_name, "0123456789") == 20;
+}
+
+// Opens (or creates) the log in dir. Returns -1 with errno set on failure.
+static inline int history_open(struct History *hist, const char *dir, size_t retain_bytes, long retain_seconds) {
+    struct dirent **names;
+    int n;
+
+    memset(hist, 0, sizeof(*hist));
+    pthread_mutex_init(&hist->lock, NULL);
+    snprintf(hist->dir, sizeof(hist->dir), "%s", dir);
+    hist->retain_bytes = retain_bytes;
+    hist->retain_seconds = retain_seconds;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+
+    // Zero-padded names sort in offset order
+    n = scandir(dir, &names, history_is_segment, alphasort);
+    if (n < 0) return -1;
+    struct Segment **tail = &hist->oldest;
+    for (int i = 0; i < n; i++) {
+        uint64_t base = strtoull(names[i]->d_name, NULL, 10);
+        struct Segment *seg = history_segment_open(hist, base, i == n - 1);
+        free(names[i]);
+        if (seg == NULL) continue; // Unreadable or empty: skip it
+        *tail = hist->active = seg;
+        tail = &seg->next;
+        hist->total_bytes += seg->size;
+    }
+    free(names);
+
+    if (hist->active == NULL) {
+        hist->oldest = hist->active = history_segment_open(hist, 0, 1);
+        if (hist->active == NULL) return -1;
+    }
+    return 0;
+}
+
+// Deletes the oldest segments while the log is over its limits. The active
+// segment is never deleted. Called with the lock held.
+static inline void history_enforce_retention(struct History *hist, time_t now) {
+    while (hist->oldest != hist->active) {
+        struct Segment *seg = hist->oldest;
+        int too_big = hist->retain_bytes > 0 && hist->total_bytes > hist->retain_bytes;
+        int too_old = hist->retain_seconds > 0 && now - seg->last_write > hist->retain_seconds;
+        if (!too_big && !too_old) break;
+
+        char path[PATH_MAX];
+        history_path(hist, seg->base, "log", path);
+        unlink(path);
+        history_path(hist, seg->base, "index", path);
+        unlink(path);
+        hist->total_bytes -= seg->size;
+        hist->oldest = seg->next;
+        history_segment_release(seg); // Replays in progress keep it mapped
+    }
+}
+
+// Seals the active segment and starts a new one. Called with the lock held.
+static inline int history_roll(struct History *hist) {
+    struct Segment *old = hist->active;
+    struct Segment *seg = history_segment_open(hist, old->end, 1);
+
+    if (seg == NULL) return -1;
+    // Give back the unused tail of the file; the mapping stays as it was
+    if (ftruncate(old->fd, old->size) < 0) perror("history: ftruncate");
+    old->last_write = time(NULL);
+    old->next = seg;
+    hist->active = seg;
+    history_enforce_retention(hist, time(NULL));
+    return 0;
+}
+
+// Appends a frame and stamps its header with the assigned offset (and
+// FRAME_FLAG_LOGGED), so the caller can send the very same bytes live.
+static inline int history_append(struct History *hist, struct FrameHeader *h, const char *payload) {
+    size_t size = FRAME_HEADER_SIZE + (size_t)h->length;
+    int rc = 0;
+
+    pthread_mutex_lock(&hist->lock);
+    struct Segment *seg = hist->active;
+    if (seg->size + size > seg->capacity && seg->size > 0) {
+        if (history_roll(hist) < 0) {
+            rc = -1;
+            goto out;
+        }
+        seg = hist->active;
+    }
+    if (seg->size + size > seg->capacity) {
+        rc = -1; // Larger than a whole segment
+        goto out;
+    }
+
+    h->seq = seg->end;
+    h->flags |= FRAME_FLAG_LOGGED;
+    history_index_add(seg, seg->end, seg->size);
+    frame_encode_header(seg->map + seg->size, h);
+    if (h->length > 0) memcpy(seg->map + seg->size + FRAME_HEADER_SIZE, payload, h->length);
+    seg->size += size;
+    seg->end++;
+    hist->total_bytes += size;
+
+    if (++hist->appends % HISTORY_AGE_CHECK == 0 || (hist->retain_bytes > 0 && hist->total_bytes > hist->retain_bytes)) {
+        seg->last_write = time(NULL);
+        history_enforce_retention(hist, seg->last_write);
+    }
+out:
+    pthread_mutex_unlock(&hist->lock);
+    return rc;
+}
+
+// Position of record `offset` in seg: binary search of the sparse index,
+// then a scan of at most one index interval.
+static inline size_t history_find(const struct Segment *seg, uint64_t offset) {
+    uint32_t rel = (uint32_t)(offset - seg->base);
+    uint32_t lo = 0, hi = seg->index_count;
+    size_t pos = 0;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (seg->index[mid].rel <= rel) {
+            pos = seg->index[mid].pos;
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    struct FrameHeader h;
+    const char *payload;
+    long used;
+    while (pos < seg->size && (used = frame_decode(seg->map + pos, seg->size - pos, &h, &payload)) > 0) {
+        if (h.seq >= offset) break;
+        pos += used;
+    }
+    return pos;
+}
+
+// Collects up to max ranges covering every record from `from` (or the
+// oldest retained one) to the current end of the log. Each range holds a
+// segment reference the caller must release. *next is the offset just past
+// the last record covered.
+static inline int history_read(struct History *hist, uint64_t from, struct HistoryRange *ranges, int max,
+                               uint64_t *next) {
+    int n = 0;
+
+    pthread_mutex_lock(&hist->lock);
+    *next = hist->active->end;
+    for (struct Segment *seg = hist->oldest; seg != NULL && n < max; seg = seg->next) {
+        if (from >= seg->end) continue;
+        size_t pos = from > seg->base ? history_find(seg, from) : 0;
+        if (pos >= seg->size) continue;
+        atomic_fetch_add_explicit(&seg->refs, 1, memory_order_relaxed);
+        ranges[n].seg = seg;
+        ranges[n].pos = (uint32_t)pos;
+        ranges[n].len = (uint32_t)(seg->size - pos);
+        n++;
+        *next = seg->end;
+    }
+    pthread_mutex_unlock(&hist->lock);
+    return n;
+}
+
+static inline void history_close(struct History *hist) {
+    if (hist->active != NULL && ftruncate(hist->active->fd, hist->active->size) < 0) {
+        perror("history: ftruncate");
+    }
+    while (hist->oldest != NULL) {
+        struct Segment *seg = hist->oldest;
+        hist->oldest = seg->next;
+        history_segment_release(seg);
+    }
+    hist->active = NULL;
+    pthread_mutex_destroy(&hist->lock);
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Chat Wire Protocol (shared by ChatServer.c and ChatClient.c)
+ * * Features:
+ * - Every message is a frame: a fixed 16-byte header followed by a payload.
+ * - The header carries the payload length, so message boundaries survive
+ *   TCP splitting and coalescing, and payloads are not limited to one buffer.
+ * - A streaming decoder pulls as many complete frames as are available out
+ *   of one large read, without copying payloads.
+ * - Senders may set FRAME_FLAG_ACK to have the server acknowledge a message
+ *   by its seq, so many messages can be in flight at once.
+ * - Broadcasts the server keeps in its history log carry their 48-bit log
+ *   offset instead of the sender's seq; a HISTORY request replays the log
+ *   from any offset, and clients can drop frames whose offset they have seen.
+ * - Rooms: SUB/UNSUB join and leave a named topic; a PUB frame goes to every
+ *   subscriber of the topic named at the start of its payload.
+ *
+ * Header layout (all fields in network byte order):
+ *   offset 0  u32 length    Payload bytes that follow the header
+ *   offset 4  u8  type      One of enum FrameType
+ *   offset 5  u8  flags     FRAME_FLAG_* bits
+ *   offset 6  u16 seq_hi    High 16 bits of a 48-bit seq (history offsets)
+ *   offset 8  u32 seq       Sender's sequence number, relayed unchanged; ACK
+ *                           and ERROR frames echo the seq they refer to.
+ *                           With FRAME_FLAG_LOGGED (and on HISTORY frames)
+ *                           seq_hi:seq is a history offset instead.
+ *   offset 12 u32 peer      Client -> server: recipient id of a DIRECT frame.
+ *                           Server -> client: sender id (0 = the server).
+ */
+
+#ifndef CHAT_PROTOCOL_H
+#define CHAT_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define FRAME_HEADER_SIZE 16
+#define MAX_FRAME_PAYLOAD (16 * 1024 * 1024) // Larger frames are a protocol error
+
+enum FrameType {
+    FRAME_HELLO = 1,   // Server -> client on connect; peer = your client id
+    FRAME_MSG = 2,     // Broadcast text to everyone else
+    FRAME_DIRECT = 3,  // Private text to the client named in peer
+    FRAME_ERROR = 4,   // Server -> client; payload is a human-readable reason
+    FRAME_BYE = 5,     // Either side is leaving the chat
+    FRAME_ACK = 6,     // Server -> client; the frame with this seq was accepted
+    FRAME_HISTORY = 7, // Client -> server: replay the log from this offset.
+                       // Server -> client: replay done; offset of the next message.
+    FRAME_SUB = 8,     // Client -> server: join the topic named by the payload
+    FRAME_UNSUB = 9,   // Client -> server: leave the topic named by the payload
+    FRAME_PUB = 10     // Text for one topic's subscribers. Payload: u8 topic
+                       // length, topic, text (see frame_split_topic).
+};
+
+#define TOPIC_MAX 255           // Longest topic name in bytes
+
+#define FRAME_FLAG_ACK 0x01     // On MSG/DIRECT/SUB/UNSUB/PUB: reply with a FRAME_ACK
+#define FRAME_FLAG_LOGGED 0x02  // Server -> client: seq is the message's history offset
+
+struct FrameHeader {
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint64_t seq;      // 48 bits on the wire
+    uint32_t peer;
+};
+
+// Serializes a header into exactly FRAME_HEADER_SIZE bytes at out
+static inline void frame_encode_header(char *out, const struct FrameHeader *h) {
+    uint32_t length = htonl(h->length);
+    uint16_t seq_hi = htons((uint16_t)(h->seq >> 32));
+    uint32_t seq = htonl((uint32_t)h->seq);
+    uint32_t peer = htonl(h->peer);
+
+    memcpy(out, &length, 4);
+    out[4] = (char)h->type;
+    out[5] = (char)h->flags;
+    memcpy(out + 6, &seq_hi, 2);
+    memcpy(out + 8, &seq, 4);
+    memcpy(out + 12, &peer, 4);
+}
+
+static inline void frame_decode_header(const char *in, struct FrameHeader *h) {
+    uint32_t v;
+    uint16_t hi;
+
+    memcpy(&v, in, 4);
+    h->length = ntohl(v);
+    h->type = (uint8_t)in[4];
+    h->flags = (uint8_t)in[5];
+    memcpy(&hi, in + 6, 2);
+    memcpy(&v, in + 8, 4);
+    h->seq = ((uint64_t)ntohs(hi) << 32) | ntohl(v);
+    memcpy(&v, in + 12, 4);
+    h->peer = ntohl(v);
+}
+
+// Streaming decoder step. Looks for one complete frame at the start of
+// buf[0..len). Returns the number of bytes the frame occupies (header +
+// payload) and fills *h and *payload (pointing into buf), 0 if more bytes are
+// needed, or -1 if the stream is corrupt. Callers loop until it returns 0,
+// advancing buf by the returned size each time.
+static inline long frame_decode(const char *buf, size_t len, struct FrameHeader *h, const char **payload) {
+    if (len < FRAME_HEADER_SIZE) return 0;
+    frame_decode_header(buf, h);
+    if (h->length > MAX_FRAME_PAYLOAD || h->type < FRAME_HELLO || h->type > FRAME_PUB) return -1;
+    if (len - FRAME_HEADER_SIZE < h->length) return 0;
+    *payload = buf + FRAME_HEADER_SIZE;
+    return FRAME_HEADER_SIZE + (long)h->length;
+}
+
+// Finds the topic and text in a PUB payload. Returns -1 if the topic is
+// empty or runs past the end of the payload.
+static inline int frame_split_topic(const char *payload, size_t len, const char **topic, size_t *topic_len,
+                                    const char **text, size_t *text_len) {
+    if (len < 1) return -1;
+    size_t n = (uint8_t)payload[0];
+    if (n == 0 || len - 1 < n) return -1;
+    *topic = payload + 1;
+    *topic_len = n;
+    *text = payload + 1 + n;
+    *text_len = len - 1 - n;
+    return 0;
+}
+
+// How many bytes of buf are needed before the frame that starts there is
+// complete. Lets readers size their buffer once for a large frame.
+static inline size_t frame_bytes_needed(const char *buf, size_t len) {
+    struct FrameHeader h;
+
+    if (len < FRAME_HEADER_SIZE) return FRAME_HEADER_SIZE;
+    frame_decode_header(buf, &h);
+    return FRAME_HEADER_SIZE + (size_t)h.length;
+}
+
+#endif
@@ -1,104 +1,2643 @@
 /*
  * Chat Server in C (TCP/IP)
  * * Features:
- * - Uses socket(), bind(), listen(), and accept() to set up a connection.
- * - Supports 1-on-1 chat with a client.
- * - Runs a "Ping-Pong" communication loop (Wait for message -> Reply).
+ * - Uses socket(), bind(), listen() and a non-blocking accept4() loop.
+ * - Serves thousands of concurrent clients from edge-triggered epoll reactors.
+ * - Thread-per-core mode: N shards, each with its own SO_REUSEPORT listener,
+ *   event loop and connection table. The kernel spreads new connections
+ *   across the shards.
+ * - Shards exchange messages through lock-free mailboxes, so a message for a
+ *   client owned by another shard never takes a lock.
+ * - Speaks the length-prefixed frame protocol from ChatProtocol.h: MSG frames
+ *   go to all other clients, DIRECT frames to the client named in the header.
+ * - Acknowledges every MSG/DIRECT frame sent with FRAME_FLAG_ACK by its seq,
+ *   so clients can pipeline messages instead of waiting for each reply. A
+ *   DIRECT frame to a client on the sender's own shard that is not there
+ *   gets an ERROR instead.
+ * - Drains each socket with readv() into the connection buffer plus a large
+ *   stack spill area, then decodes every complete frame from that one read.
+ * - Queues outgoing frames per connection and writes the whole queue with a
+ *   single writev(), resuming cleanly after partial writes.
+ * - Zero-copy fan-out: a message is encoded once into a pooled, refcounted
+ *   buffer; every recipient's send queue (on any shard) just holds a reference.
+ * - High-water-mark backpressure: a slow reader whose queue is full either
+ *   misses broadcasts (and is told how many) or is disconnected.
+ * - Optional io_uring backend: multishot accept, multishot receives into a
+ *   registered buffer ring, and linked sends, all batched into one
+ *   io_uring_enter() per loop iteration. Falls back to epoll when the kernel
+ *   lacks these features.
+ * - Built-in loopback benchmark comparing both backends (msgs/s and latency).
+ * - Optional persistent history (-H): every broadcast is appended to an
+ *   mmap'd, segmented log (see ChatHistory.h). A reconnecting client sends a
+ *   HISTORY frame with the last offset it saw and the server streams the rest
+ *   of the log to it with sendfile(), straight from the page cache. Old
+ *   segments are deleted by total size or age.
+ * - Rooms: clients SUB/UNSUB named topics and PUB to them. Each shard keeps a
+ *   hash table from topic to a packed array of its local subscribers, so a
+ *   publish costs O(subscribers) rather than a scan of every connection.
+ *   A connection remembers its topics and leaves them all when it closes.
+ * - Optional same-host transport (-u, epoll backend): local clients connect
+ *   to a Unix socket and receive a pair of shared-memory rings (see
+ *   ChatShm.h). Their frames are decoded straight out of the ring and their
+ *   output is copied into the other ring, bypassing the TCP/IP stack.
+ * - Optional live metrics (-s): every shard keeps its own counters and a
+ *   relay latency histogram, updated without locks or atomic read-modify-
+ *   writes. Connecting to the Unix socket returns a text snapshot (Prometheus
+ *   exposition format) summed over all shards, e.g. `nc -U /tmp/chat.stats`.
+ * - Lines typed on the server console are broadcast as frames from peer 0.
+ *
+ * Usage: ChatServer [-p port] [-t threads] [-b epoll|uring] [-w kbytes] [-k] [-q]
+ *                   [-H dir [-R mbytes] [-A seconds]] [-s path] [-u path]
+ *        ChatServer -B seconds [-p port] [-t threads]
+ *   -p port     Listen on this port (default 8080).
+ *   -t threads  Number of shards; 0 = one per online CPU (default 1).
+ *   -b backend  I/O backend: epoll (default) or uring.
+ *   -w kbytes   Per-connection send queue high-water mark (default 4096).
+ *   -k          Disconnect clients that hit the high-water mark instead of
+ *               dropping messages for them.
+ *   -q          Quiet: do not echo relayed messages to stdout (for benchmarks).
+ *   -H dir      Keep broadcast history in this directory (created if needed).
+ *   -R mbytes   Delete the oldest history once it exceeds this size (default
+ *               1024; 0 = never).
+ *   -A seconds  Delete history segments last written longer ago than this
+ *               (default 0 = never).
+ *   -s path     Serve live metrics on a Unix socket at this path.
+ *   -u path     Accept same-host clients on a Unix socket at this path and
+ *               talk to them through shared memory.
+ *   -B seconds  Benchmark: run a server with each backend and drive it over
+ *               loopback, then print msgs/s and p50/p99/p99.9 round trips;
+ *               then compare one-at-a-time round trips over loopback TCP
+ *               and the shared-memory transport.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "ChatProtocol.h"
+#include "ChatHistory.h"
+#include "Histogram.h"
+#include "ChatShm.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 1024
+#define LISTEN_BACKLOG 4096      // Kernel caps this at net.core.somaxconn
+#define MAX_EVENTS 512           // epoll_wait() batch size
+#define READ_CHUNK 65536         // Stack spill area behind each connection's buffer
+#define MAX_IOVECS 1024          // iovecs per writev() (Linux IOV_MAX)
+#define MAX_SHARDS 256
+#define DEFAULT_HWM_KB 4096      // Send queue high-water mark per connection
+#define POOL_CLASSES 4           // Message buffer size classes (see pool_class_size)
+#define POOL_MAX_FREE 1024       // Cached buffers per class per thread
+#define URING_ENTRIES 4096       // Submission queue size per shard
+#define RECV_BUF_COUNT 1024      // Provided receive buffers per shard (power of two)
+#define RECV_BUF_SIZE 16384
+#define MAX_LINKED_SENDS 64      // Longest chain of linked sends per connection
+#define BENCH_CONNS 64           // Connections opened by -B
+#define BENCH_WINDOW 4           // Messages in flight per benchmark connection
+#define BENCH_PAYLOAD 64         // Bytes per benchmark message
+#define DEFAULT_RETAIN_MB 1024   // History size limit
+#define MAX_REPLAY_RANGES 256    // Segments streamed per HISTORY request
+#define MAX_SUBSCRIPTIONS 1024   // Topics one connection may join
+#define BENCH_LOCAL_PATH "/tmp/chat-bench.sock"
 
-int main() {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
-    char buffer[BUFFER_SIZE] = {0};
-    char message[BUFFER_SIZE];
+// Growable byte buffer. Bytes in [start, len) are pending.
+struct Buffer {
+    char *data;
+    size_t start;
+    size_t len;
+    size_t cap;
+};
+
+// An encoded frame (header + payload), immutable once built and shared by
+// every connection it is queued on. Freed to a pool with the last reference.
+// A history replay entry instead refers to bytes of a log segment.
+struct MsgBuf {
+    atomic_int refs;
+    int size_class;      // Pool class, or -1 for oversized buffers
+    uint32_t size;       // Bytes used in data (or of the segment)
+    uint32_t pos;        // Replay: where the bytes start in seg
+    struct Segment *seg; // Replay: the segment holding the bytes, else NULL
+    uint64_t born;       // With -s: when the message was read, for relay latency
+    struct MsgBuf *next_free;
+    char data[];
+};
+
+// Per-thread cache of free message buffers, one list per size class
+struct BufPool {
+    struct MsgBuf *free_list[POOL_CLASSES];
+    int free_count[POOL_CLASSES];
+};
+
+// FIFO ring of references. The first `sent` bytes of bufs[head] are already out.
+struct SendQueue {
+    struct MsgBuf **bufs;
+    int head;
+    int count;
+    int cap;             // Power of two
+    size_t sent;
+    size_t bytes;        // Queued in-memory bytes, checked against the high-water mark
+};
+
+// One connected client
+struct Connection {
+    int fd;
+    int id;              // Client number; id % num_shards is the owning shard
+    int dirty;           // 1 = queued on the reactor's flush list
+    int closing;         // 1 = close once the send queue drains
+    unsigned dropped;    // Messages skipped by backpressure, not yet reported
+    struct Buffer in;    // Bytes received but not yet decoded into frames
+    struct SendQueue out;
+    // io_uring backend only
+    int pending_ops;     // Submitted requests that still reference this struct
+    int sends_inflight;  // The first sends_inflight queue entries are being sent
+    int dead;            // Closed; freed when pending_ops reaches 0
+    struct Topic **topics;  // Subscriptions, left on close
+    int num_topics;
+    int topics_cap;
+    struct ShmLink *shm; // Same-host client: frames travel through shared rings
+};
+
+// A topic and this shard's clients subscribed to it. Subscribers are packed
+// into one array, so a publish walks exactly its recipients.
+struct Topic {
+    uint32_t hash;
+    uint32_t len;
+    struct Connection **subs;
+    int num_subs;
+    int subs_cap;
+    char name[];
+};
+
+// A message handed from one shard to another
+enum MailKind { MAIL_BROADCAST, MAIL_DIRECT, MAIL_TOPIC };
+
+struct MailItem {
+    _Atomic(struct MailItem *) next;
+    int kind;
+    int to;              // Recipient's client id for MAIL_DIRECT
+    uint32_t from;       // Sender's client id (0 = server console)
+    struct MsgBuf *buf;  // One reference owned by the item
+};
+
+// Multi-producer single-consumer queue (Vyukov's intrusive design).
+// Producers only do one atomic exchange; the owning shard pops without locks.
+struct Mailbox {
+    _Atomic(struct MailItem *) head;  // Producers push here
+    struct MailItem *tail;            // Consumer pops here
+    struct MailItem stub;
+    atomic_int signaled;              // 1 = wake-up already written to event_fd
+    int event_fd;
+};
+
+// Open-addressing hash table from client id to connection
+struct IdMap {
+    struct Connection **slots;
+    int cap;                     // Power of two
+    int count;
+};
+
+// Live counters for one shard. Only the owning shard writes them (see
+// stat_add); the stats thread reads them at any time.
+struct ShardStats {
+    _Atomic uint64_t accepted;       // Connections accepted
+    _Atomic uint64_t closed;         // Connections closed
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t frames_in;
+    _Atomic uint64_t relayed;        // MSG/DIRECT frames routed (once each)
+    _Atomic uint64_t deliveries;     // Frames queued to recipients on this shard
+    _Atomic uint64_t stalls;         // Flushes cut short by a full socket buffer
+    _Atomic uint64_t dropped;        // Messages skipped by backpressure
+    _Atomic uint64_t kicked;         // Clients disconnected at the high-water mark
+    _Atomic uint64_t queued_bytes;   // Gauge: bytes waiting in send queues
+    _Atomic uint64_t loops;          // Event loop iterations
+    _Atomic uint64_t latency_sum;    // Relay latency in ns, read to written...
+    _Atomic uint64_t latency[HIST_BUCKETS]; // ...bucketed like struct Histogram
+};
+
+// Open-addressing hash table from topic name to its subscribers on one shard
+struct TopicMap {
+    struct Topic **slots;
+    int cap;                     // Power of two
+    int count;
+};
+
+// Minimal io_uring driver (raw system calls, no liburing)
+struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_local_tail;      // SQEs prepared by us
+    unsigned sq_submitted;       // SQEs handed to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_size;
+    size_t sqes_size;
+    struct io_uring_buf_ring *buf_ring;  // Receive buffers the kernel picks from
+    char *buf_base;
+    unsigned short buf_tail;
+};
+
+// user_data tags; connection requests carry the Connection pointer as well
+enum UringOp { OP_ACCEPT = 1, OP_RECV, OP_SEND, OP_MAILBOX, OP_CONSOLE, OP_CANCEL };
+#define OP_MASK 7
+
+// All state for one event loop
+struct Reactor {
+    int index;
+    int epoll_fd;
+    int listen_fd;
+    int next_seq;
+    int num_clients;
+    pthread_t thread;
+    struct Connection **conns;   // Indexed by file descriptor (a same-host
+                                 // client is also found by its wake-up fd)
+    int conns_cap;
+    struct IdMap by_id;
+    struct TopicMap topics;
+    struct Connection **dirty;   // Connections with unflushed output
+    int num_dirty;
+    int dirty_cap;
+    struct Mailbox mailbox;
+    struct Buffer console;       // Partial line typed on the server console
+    int console_open;
+    struct Uring *ring;          // NULL = epoll backend
+    uint64_t now;                // With -s: when the current batch started
+    struct ShardStats stats;
+};
+
+// Process-wide configuration shared by all shards
+struct Server {
+    int port;
+    int quiet;
+    int kick_slow;               // 1 = disconnect at the high-water mark
+    int use_uring;               // 1 = io_uring backend
+    size_t high_water;           // Send queue limit in bytes
+    struct History *history;     // NULL = no history log
+    const char *stats_path;      // Unix socket for live metrics, NULL = off
+    int stats_fd;
+    const char *local_path;      // Unix socket for same-host clients, NULL = off
+    int local_fd;                // Accepted by shard 0
+    uint64_t started;            // now_ns() at startup
+    int num_shards;
+    struct Reactor *shards;
+    atomic_int running;
+    atomic_int online;
+};
+
+struct Server server;
+static __thread struct BufPool pool;
+
+// Single-writer counter update: a relaxed load and store compile to plain
+// moves, without the cost of a locked read-modify-write.
+static inline void stat_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Function Prototypes
+void serve();
+int create_listener(int port);
+void raise_fd_limit();
+void setup_reactor(struct Reactor *r, int index);
+int create_unix_listener(const char *path, int nonblock);
+void *stats_thread(void *arg);
+void format_stats(struct Buffer *out);
+int buffer_printf(struct Buffer *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void *reactor_thread(void *arg);
+void run_reactor(struct Reactor *r);
+void flush_dirty(struct Reactor *r);
+void stop_server();
+void accept_clients(struct Reactor *r);
+int add_connection(struct Reactor *r, int fd);
+int reserve_conn_slot(struct Reactor *r, int fd);
+void accept_local_clients(struct Reactor *r);
+int receive_bytes(struct Reactor *r, struct Connection *c, const char *data, size_t len);
+void shm_receive(struct Reactor *r, struct Connection *c);
+int shm_flush(struct Reactor *r, struct Connection *c);
+void handle_readable(struct Reactor *r, struct Connection *c);
+void handle_console(struct Reactor *r);
+void handle_mailbox(struct Reactor *r);
+int process_frames(struct Reactor *r, struct Connection *c);
+long dispatch_frames(struct Reactor *r, struct Connection *c, const char *data, size_t len);
+int route_message(struct Reactor *r, struct Connection *from, int type, uint32_t seq, uint32_t to,
+                  const char *text, size_t len);
+void deliver(struct Reactor *r, int kind, int to, uint32_t from, struct MsgBuf *buf);
+int queue_buf(struct Reactor *r, struct Connection *c, struct MsgBuf *buf, int droppable);
+void queue_text(struct Reactor *r, struct Connection *c, int type, uint32_t seq, const char *text);
+void schedule_flush(struct Reactor *r, struct Connection *c);
+int flush_output(struct Reactor *r, struct Connection *c);
+void report_drops(struct Reactor *r, struct Connection *c);
+void retire_buf(struct Reactor *r, struct SendQueue *q, struct MsgBuf *b);
+void replay_history(struct Reactor *r, struct Connection *c, uint64_t from);
+void send_queue_truncate(struct SendQueue *q, int keep);
+void pool_drain(void);
+void send_queue_clear(struct SendQueue *q);
+struct MsgBuf *msgbuf_new(const struct FrameHeader *h, const char *payload);
+struct MsgBuf *msgbuf_segment(struct Segment *seg, uint32_t pos, uint32_t len);
+void msgbuf_release(struct MsgBuf *b);
+void close_connection(struct Reactor *r, struct Connection *c);
+void free_connection(struct Connection *c);
+int uring_supported();
+int uring_init(struct Uring *u, unsigned entries);
+void uring_exit(struct Uring *u);
+struct io_uring_sqe *uring_get_sqe(struct Uring *u);
+int uring_submit(struct Uring *u, unsigned wait_nr);
+void uring_recycle(struct Uring *u, unsigned bid);
+void setup_uring_reactor(struct Reactor *r);
+void run_uring_reactor(struct Reactor *r);
+void uring_handle_cqe(struct Reactor *r, struct io_uring_cqe *cqe);
+void uring_arm_accept(struct Reactor *r);
+void uring_arm_poll(struct Reactor *r, int fd, int op);
+int uring_arm_recv(struct Reactor *r, struct Connection *c);
+int uring_flush(struct Reactor *r, struct Connection *c);
+int run_benchmark(int seconds);
+int bench_backend(int seconds, double *msgs_per_sec, double pct[3]);
+int bench_round_trips(int local, int seconds, double *msgs_per_sec, double pct[3]);
+uint64_t now_ns();
+void mailbox_init(struct Mailbox *mb);
+void mailbox_push(struct Mailbox *mb, struct MailItem *item);
+struct MailItem *mailbox_pop(struct Mailbox *mb);
+struct Connection *id_map_get(struct IdMap *m, int id);
+int id_map_put(struct IdMap *m, struct Connection *c);
+void id_map_remove(struct IdMap *m, int id);
+int subscribe(struct Reactor *r, struct Connection *c, const char *name, size_t len);
+void unsubscribe(struct Reactor *r, struct Connection *c, const char *name, size_t len);
+void topic_leave(struct Reactor *r, struct Connection *c, int i);
+uint32_t topic_hash(const char *name, size_t len);
+struct Topic *topic_map_get(struct TopicMap *m, const char *name, size_t len, uint32_t hash);
+int topic_map_put(struct TopicMap *m, struct Topic *t);
+void topic_map_remove(struct TopicMap *m, struct Topic *t);
+int buffer_reserve(struct Buffer *b, size_t extra);
+int buffer_append(struct Buffer *b, const char *data, size_t len);
+void buffer_consume(struct Buffer *b, size_t n);
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    server.port = PORT;
+    server.num_shards = 1;
+    server.high_water = (size_t)DEFAULT_HWM_KB * 1024;
+    int bench_seconds = 0;
+    const char *history_dir = NULL;
+    size_t retain_mb = DEFAULT_RETAIN_MB;
+    long retain_seconds = 0;
+    while ((opt = getopt(argc, argv, "p:t:b:w:kqB:H:R:A:s:u:")) != -1) {
+        switch (opt) {
+            case 'p': server.port = atoi(optarg); break;
+            case 't': server.num_shards = atoi(optarg); break;
+            case 'b': server.use_uring = (strcmp(optarg, "uring") == 0); break;
+            case 'w': server.high_water = (size_t)atol(optarg) * 1024; break;
+            case 'k': server.kick_slow = 1; break;
+            case 'q': server.quiet = 1; break;
+            case 'B': bench_seconds = atoi(optarg); break;
+            case 'H': history_dir = optarg; break;
+            case 'R': retain_mb = (size_t)atol(optarg); break;
+            case 'A': retain_seconds = atol(optarg); break;
+            case 's': server.stats_path = optarg; break;
+            case 'u': server.local_path = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-t threads] [-b epoll|uring] [-w kbytes] [-k] [-q]\n"
+                                "                  [-H dir [-R mbytes] [-A seconds]] [-s path] [-u path]\n"
+                                "       %s -B seconds [-p port] [-t threads]\n", argv[0], argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (server.num_shards <= 0) server.num_shards = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (server.num_shards < 1) server.num_shards = 1;
+    if (server.num_shards > MAX_SHARDS) server.num_shards = MAX_SHARDS;
+
+    // writev() has no MSG_NOSIGNAL; a vanished peer must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    if (bench_seconds > 0) return run_benchmark(bench_seconds);
+
+    if (history_dir != NULL) {
+        server.history = malloc(sizeof(struct History));
+        if (server.history == NULL ||
+            history_open(server.history, history_dir, retain_mb * 1024 * 1024, retain_seconds) < 0) {
+            perror("Cannot open history");
+            exit(EXIT_FAILURE);
+        }
+    }
+    serve();
+    if (server.history != NULL) {
+        history_close(server.history);
+        free(server.history);
+    }
+    return 0;
+}
 
+// Starts every shard and runs until the console says 'exit'
+void serve() {
     printf("========================================\n");
     printf("        Chat Server (Listening)         \n");
     printf("========================================\n");
 
-    // 1. Create Socket File Descriptor
+    raise_fd_limit();
+
+    if (server.use_uring && !uring_supported()) {
+        printf("io_uring (multishot accept/recv, buffer rings) is unavailable; using epoll.\n");
+        server.use_uring = 0;
+    }
+    if (server.use_uring && server.local_path != NULL) {
+        printf("The same-host transport needs the epoll backend; ignoring -u.\n");
+        server.local_path = NULL;
+    }
+
+    // 1. Give every shard its own listener, event loop and mailbox
+    server.shards = calloc(server.num_shards, sizeof(struct Reactor));
+    if (server.shards == NULL) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < server.num_shards; i++) {
+        setup_reactor(&server.shards[i], i);
+    }
+
+    // 2. Shard 0 also owns the console.
+    // stdin may be a regular file or /dev/null, which epoll rejects; that just
+    // means there is no console to read from.
+    fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+    server.shards[0].console_open = 1;
+    if (!server.use_uring) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = STDIN_FILENO;
+        if (epoll_ctl(server.shards[0].epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &ev) < 0) {
+            server.shards[0].console_open = 0;
+        }
+    }
+    if (server.local_path != NULL) {
+        struct epoll_event ev;
+        server.local_fd = create_unix_listener(server.local_path, 1);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = server.local_fd;
+        if (epoll_ctl(server.shards[0].epoll_fd, EPOLL_CTL_ADD, server.local_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Server started on port %d with %d shard(s) using %s. Waiting for connections...\n",
+           server.port, server.num_shards, server.use_uring ? "io_uring" : "epoll");
+    if (server.local_path != NULL) printf("Same-host clients on unix:%s\n", server.local_path);
+    if (server.history != NULL) {
+        printf("History in %s: offsets %llu..%llu on disk.\n", server.history->dir,
+               (unsigned long long)server.history->oldest->base, (unsigned long long)server.history->active->end);
+    }
+    server.started = now_ns();
+    pthread_t stats;
+    if (server.stats_path != NULL) {
+        server.stats_fd = create_unix_listener(server.stats_path, 0);
+        if (pthread_create(&stats, NULL, stats_thread, NULL) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+        printf("Metrics on unix:%s\n", server.stats_path);
+    }
+    printf("Type a message to broadcast it, or 'exit' to stop the server.\n\n");
+
+    // 3. Run shards 1..N-1 on their own threads and shard 0 on this one
+    atomic_store(&server.running, 1);
+    for (int i = 1; i < server.num_shards; i++) {
+        if (pthread_create(&server.shards[i].thread, NULL, reactor_thread, &server.shards[i]) != 0) {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    reactor_thread(&server.shards[0]);
+    for (int i = 1; i < server.num_shards; i++) {
+        pthread_join(server.shards[i].thread, NULL);
+    }
+    if (server.stats_path != NULL) {
+        // Wakes the stats thread out of accept()
+        shutdown(server.stats_fd, SHUT_RDWR);
+        pthread_join(stats, NULL);
+        close(server.stats_fd);
+        unlink(server.stats_path);
+    }
+
+    // Close every socket
+    for (int i = 0; i < server.num_shards; i++) {
+        struct Reactor *r = &server.shards[i];
+        struct MailItem *item;
+
+        // Tearing down the ring first cancels its requests, so every
+        // connection can be freed right away.
+        if (r->ring != NULL) {
+            uring_exit(r->ring);
+            free(r->ring);
+            r->ring = NULL;
+        }
+        for (int fd = 0; fd < r->conns_cap; fd++) {
+            if (r->conns[fd] != NULL) close_connection(r, r->conns[fd]);
+        }
+        while ((item = mailbox_pop(&r->mailbox)) != NULL) {
+            msgbuf_release(item->buf);
+            free(item);
+        }
+        free(r->conns);
+        free(r->by_id.slots);
+        free(r->topics.slots); // Emptied as the connections closed
+        free(r->dirty);
+        free(r->console.data);
+        close(r->mailbox.event_fd);
+        if (r->epoll_fd >= 0) close(r->epoll_fd);
+        close(r->listen_fd);
+    }
+    free(server.shards);
+    pool_drain(); // Closing the connections refilled this thread's pool
+    if (server.local_path != NULL) {
+        close(server.local_fd);
+        unlink(server.local_path);
+    }
+}
+
+int create_listener(int port) {
+    struct sockaddr_in address;
+    int opt = 1;
+    int fd;
+
     // AF_INET = IPv4, SOCK_STREAM = TCP
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
 
-    // 2. Attach socket to the port 8080 (Optional: prevents "Address already in use" errors)
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
+    // Prevents "Address already in use" errors after a restart
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) {
         perror("setsockopt");
         exit(EXIT_FAILURE);
     }
+    // Lets every shard bind its own socket to the same port; the kernel
+    // load-balances incoming connections between them.
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(EXIT_FAILURE);
+    }
 
+    memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY; // Listen on any IP address of this machine
-    address.sin_port = htons(PORT);       // Host to Network Short (endianness conversion)
+    address.sin_port = htons(port);       // Host to Network Short (endianness conversion)
 
-    // 3. Bind the socket to the network address and port
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
         perror("Bind failed");
         exit(EXIT_FAILURE);
     }
 
-    // 4. Start Listening (Queue up to 3 connections)
-    if (listen(server_fd, 3) < 0) {
+    // A deep backlog lets connection bursts queue up instead of being refused
+    if (listen(fd, LISTEN_BACKLOG) < 0) {
         perror("Listen failed");
         exit(EXIT_FAILURE);
     }
+    return fd;
+}
+
+// Thousands of clients need thousands of descriptors; the default soft
+// limit is often 1024.
+void raise_fd_limit() {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void setup_reactor(struct Reactor *r, int index) {
+    struct epoll_event ev;
 
-    printf("Server started on port %d. Waiting for connections...\n", PORT);
+    r->index = index;
+    r->listen_fd = create_listener(server.port);
+    r->epoll_fd = -1;
+    mailbox_init(&r->mailbox);
 
-    // 5. Accept an incoming connection
-    // This blocks (waits) until a client tries to connect
-    if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen)) < 0) {
-        perror("Accept failed");
+    // io_uring shards build their ring on their own thread (see
+    // setup_uring_reactor), which IORING_SETUP_SINGLE_ISSUER requires.
+    if (server.use_uring) return;
+
+    if ((r->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = r->listen_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = r->mailbox.event_fd;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->mailbox.event_fd, &ev) < 0) {
+        perror("epoll_ctl");
         exit(EXIT_FAILURE);
     }
+}
 
-    printf("Connection established!\n\n");
+void *reactor_thread(void *arg) {
+    struct Reactor *r = arg;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    // Chat Loop
-    while (1) {
-        // Clean buffer
-        memset(buffer, 0, BUFFER_SIZE);
+    // Thread-per-core: pin each shard so its connections stay cache-warm
+    if (server.num_shards > 1 && cpus > 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(r->index % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (server.use_uring) {
+        setup_uring_reactor(r);
+        run_uring_reactor(r);
+    } else {
+        run_reactor(r);
+    }
+    pool_drain();
+    return NULL;
+}
 
-        // Receive message from client
-        int valread = read(new_socket, buffer, BUFFER_SIZE);
-        if (valread <= 0) {
-            printf("Client disconnected.\n");
+void run_reactor(struct Reactor *r) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (atomic_load_explicit(&server.running, memory_order_relaxed)) {
+        int n = epoll_wait(r->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
             break;
         }
+        stat_add(&r->stats.loops, 1);
+        if (server.stats_path != NULL) r->now = now_ns();
 
-        printf("Client: %s", buffer);
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
 
-        // Check for exit command
-        if (strncmp(buffer, "exit", 4) == 0) {
-            printf("Ending chat.\n");
-            break;
+            if (fd == r->listen_fd) {
+                accept_clients(r);
+                continue;
+            }
+            if (server.local_path != NULL && fd == server.local_fd) {
+                accept_local_clients(r);
+                continue;
+            }
+            if (fd == r->mailbox.event_fd) {
+                handle_mailbox(r);
+                continue;
+            }
+            if (fd == STDIN_FILENO) {
+                handle_console(r);
+                continue;
+            }
+
+            struct Connection *c = (fd < r->conns_cap) ? r->conns[fd] : NULL;
+            if (c == NULL) continue; // Closed earlier in this batch
+            if (c->shm != NULL && fd == c->shm->wake_fd) {
+                shm_receive(r, c);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handle_readable(r, c);
+            }
+            if (r->conns[fd] == c && (events[i].events & EPOLLOUT) && c->out.count > 0) {
+                // Socket drained: retry the pending tail of the send queue
+                schedule_flush(r, c);
+            }
         }
+        flush_dirty(r);
+    }
+}
 
-        // Send reply
-        printf("Server: ");
-        fgets(message, BUFFER_SIZE, stdin);
-        send(new_socket, message, strlen(message), 0);
-        
-        if (strncmp(message, "exit", 4) == 0) {
-            break;
+// Flushes everything queued during this batch. Frames produced by many
+// messages to the same client go out in a single writev() (epoll) or one
+// chain of linked sends (io_uring).
+void flush_dirty(struct Reactor *r) {
+    if (server.stats_path != NULL && r->num_dirty > 0) r->now = now_ns();
+    for (int i = 0; i < r->num_dirty; i++) {
+        struct Connection *c = r->dirty[i];
+        c->dirty = 0;
+        int rc = r->ring ? uring_flush(r, c) : flush_output(r, c);
+        if (rc < 0 || (c->closing && c->out.count == 0)) {
+            close_connection(r, c);
+        }
+    }
+    r->num_dirty = 0;
+}
+
+// Asks every shard to leave its event loop
+void stop_server() {
+    uint64_t one = 1;
+
+    atomic_store(&server.running, 0);
+    for (int i = 0; i < server.num_shards; i++) {
+        if (write(server.shards[i].mailbox.event_fd, &one, sizeof(one)) < 0) {
+            perror("write(eventfd)");
+        }
+    }
+}
+
+void accept_clients(struct Reactor *r) {
+    // Edge-triggered: keep accepting until the queue is empty
+    while (1) {
+        int fd = accept4(r->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+        add_connection(r, fd);
+    }
+}
+
+// Registers a freshly accepted socket with this shard. Closes fd on failure.
+int add_connection(struct Reactor *r, int fd) {
+    int one = 1;
+
+    // Chat frames are small and latency-sensitive: send them immediately
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct Connection *c = reserve_conn_slot(r, fd) < 0 ? NULL : calloc(1, sizeof(*c));
+    if (c == NULL) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    // Ids are unique across shards and encode the owner, so any shard can
+    // route to a client without a shared lookup table.
+    c->id = ++r->next_seq * server.num_shards + r->index;
+    if (id_map_put(&r->by_id, c) < 0) {
+        free(c);
+        close(fd);
+        return -1;
+    }
+
+    if (r->ring != NULL) {
+        if (uring_arm_recv(r, c) < 0) {
+            fprintf(stderr, "io_uring submission queue full; dropping a new client\n");
+            id_map_remove(&r->by_id, c->id);
+            free(c);
+            close(fd);
+            return -1;
+        }
+    } else {
+        // EPOLLOUT is registered once up front; in edge-triggered mode it only
+        // fires when a full socket buffer gains space again.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            id_map_remove(&r->by_id, c->id);
+            free(c);
+            close(fd);
+            return -1;
+        }
+    }
+    r->conns[fd] = c;
+    r->num_clients++;
+    stat_add(&r->stats.accepted, 1);
+    int online = atomic_fetch_add(&server.online, 1) + 1;
+    if (!server.quiet) printf("Client %d connected (%d online).\n", c->id, online);
+
+    // Tell the client its id so others can address DIRECT frames to it
+    struct FrameHeader hello = { 0, FRAME_HELLO, 0, 0, (uint32_t)c->id };
+    struct MsgBuf *buf = msgbuf_new(&hello, NULL);
+    if (buf != NULL) {
+        queue_buf(r, c, buf, 0);
+        msgbuf_release(buf);
+    }
+    return 0;
+}
+
+// Grows the descriptor-indexed connection table to cover fd
+int reserve_conn_slot(struct Reactor *r, int fd) {
+    if (fd < r->conns_cap) return 0;
+
+    int cap = r->conns_cap ? r->conns_cap : 1024;
+    while (cap <= fd) cap *= 2;
+    struct Connection **grown = realloc(r->conns, cap * sizeof(*grown));
+    if (grown == NULL) return -1;
+    memset(grown + r->conns_cap, 0, (cap - r->conns_cap) * sizeof(*grown));
+    r->conns = grown;
+    r->conns_cap = cap;
+    return 0;
+}
+
+// Same-host clients: hands each one its shared-memory link over the Unix
+// socket, then serves it like any other connection. The socket stays in the
+// epoll set so a vanished client is noticed.
+void accept_local_clients(struct Reactor *r) {
+    while (1) {
+        int fd = accept4(server.local_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("Accept failed");
+            return;
+        }
+
+        struct ShmLink *link = malloc(sizeof(*link));
+        int fds[SHM_LINK_FDS];
+        if (link == NULL || shm_link_create(link, SHM_RING_SIZE, fds) < 0) {
+            perror("Cannot set up shared memory");
+            free(link);
+            close(fd);
+            continue;
+        }
+        int sent = shm_send_fds(fd, fds);
+        close(fds[0]); // The mappings keep the memfds alive
+        close(fds[1]);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = link->wake_fd;
+        if (sent < 0 || reserve_conn_slot(r, link->wake_fd) < 0 ||
+            epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, link->wake_fd, &ev) < 0) {
+            shm_link_close(link);
+            free(link);
+            close(fd);
+            continue;
+        }
+        if (add_connection(r, fd) < 0) { // Closes fd
+            shm_link_close(link);
+            free(link);
+            continue;
         }
+        // The HELLO queued by add_connection goes out through the ring
+        struct Connection *c = r->conns[fd];
+        c->shm = link;
+        r->conns[link->wake_fd] = c;
     }
+}
+
+void handle_readable(struct Reactor *r, struct Connection *c) {
+    char spill[READ_CHUNK];
+    struct iovec iov[2];
+
+    // Edge-triggered: read until the kernel has nothing more for us
+    while (1) {
+        // Make room for the frame in progress, so a large message is read
+        // straight into place instead of through the spill area.
+        size_t have = c->in.len - c->in.start;
+        size_t needed = frame_bytes_needed(c->in.data + c->in.start, have);
+        if (buffer_reserve(&c->in, needed > have + BUFFER_SIZE ? needed - have : BUFFER_SIZE) < 0) {
+            close_connection(r, c);
+            return;
+        }
+
+        // One readv() fills the connection buffer and, if more is waiting,
+        // the stack spill area, so idle clients keep small buffers while busy
+        // ones still drain up to 64 KB per system call.
+        size_t room = c->in.cap - c->in.len;
+        iov[0].iov_base = c->in.data + c->in.len;
+        iov[0].iov_len = room;
+        iov[1].iov_base = spill;
+        iov[1].iov_len = sizeof(spill);
+
+        ssize_t n = readv(c->fd, iov, 2);
+        if (n > 0) {
+            stat_add(&r->stats.bytes_in, n);
+            if ((size_t)n <= room) {
+                c->in.len += n;
+            } else {
+                c->in.len += room;
+                if (buffer_append(&c->in, spill, n - room) < 0) {
+                    close_connection(r, c);
+                    return;
+                }
+            }
+            if (process_frames(r, c) < 0) return; // Closed while processing
+            // A short read means the socket is empty; the next arrival
+            // raises a new edge, so skip the read() that would return EAGAIN.
+            if ((size_t)n < room + sizeof(spill)) return;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+
+        // n == 0 (orderly shutdown) or a hard error
+        close_connection(r, c);
+        return;
+    }
+}
+
+// Decodes frames straight out of data[0..len), a buffer the caller reuses
+// afterwards (an io_uring receive buffer or a shared ring); only an
+// incomplete trailing frame is copied. Returns -1 if the connection was closed.
+int receive_bytes(struct Reactor *r, struct Connection *c, const char *data, size_t len) {
+    if (c->in.len == c->in.start) {
+        long used = dispatch_frames(r, c, data, len);
+        if (used < 0) return -1;
+        if ((size_t)used < len && !c->closing && buffer_append(&c->in, data + used, len - used) < 0) {
+            close_connection(r, c);
+            return -1;
+        }
+        return 0;
+    }
+    if (buffer_append(&c->in, data, len) < 0) {
+        close_connection(r, c);
+        return -1;
+    }
+    return process_frames(r, c);
+}
+
+// A same-host client woke us: it wrote frames, or made room for ours
+void shm_receive(struct Reactor *r, struct Connection *c) {
+    struct ShmLink *link = c->shm;
+
+    shm_link_rearm(link);
+    if (c->out.count > 0) schedule_flush(r, c);
+    while (!c->closing) {
+        const char *data;
+        size_t n = shm_ring_peek(&link->in, &data);
+        if (n == 0) return;
+        stat_add(&r->stats.bytes_in, n);
+        if (receive_bytes(r, c, data, n) < 0) return;
+        if (shm_ring_consume(&link->in, n)) shm_wake(link->peer_fd);
+    }
+}
+
+// Decodes every complete frame in the input buffer and acts on it.
+// Returns -1 if the connection was closed (and may already be freed).
+int process_frames(struct Reactor *r, struct Connection *c) {
+    long used = dispatch_frames(r, c, c->in.data + c->in.start, c->in.len - c->in.start);
+
+    if (used < 0) return -1;
+    c->in.start += used;
+    if (c->closing) c->in.start = c->in.len; // Ignore anything after BYE
+    buffer_consume(&c->in, 0);
+    return 0;
+}
+
+// Acts on every complete frame in data[0..len). Returns the bytes consumed,
+// or -1 if the connection was closed because of a malformed frame.
+long dispatch_frames(struct Reactor *r, struct Connection *c, const char *data, size_t len) {
+    struct FrameHeader h;
+    const char *payload;
+    size_t pos = 0;
+    uint64_t frames = 0;
+
+    while (!c->closing) {
+        long used = frame_decode(data + pos, len - pos, &h, &payload);
+        if (used == 0) break;
+        if (used < 0) {
+            fprintf(stderr, "Client %d sent a malformed frame; disconnecting.\n", c->id);
+            close_connection(r, c);
+            return -1;
+        }
+        pos += used;
+        frames++;
+
+        switch (h.type) {
+            case FRAME_MSG:
+            case FRAME_DIRECT:
+                if (!server.quiet) {
+                    printf("Client %d%s: %.*s\n", c->id, h.type == FRAME_DIRECT ? " (private)" : "",
+                           (int)h.length, payload);
+                }
+                if (route_message(r, c, h.type, h.seq, h.peer, payload, h.length) == 0 &&
+                    (h.flags & FRAME_FLAG_ACK)) {
+                    queue_text(r, c, FRAME_ACK, h.seq, "");
+                }
+                break;
+            case FRAME_SUB:
+            case FRAME_UNSUB: {
+                const char *error = NULL;
+                if (h.length == 0 || h.length > TOPIC_MAX) error = "topic names are 1-255 bytes";
+                else if (h.type == FRAME_UNSUB) unsubscribe(r, c, payload, h.length);
+                else if (subscribe(r, c, payload, h.length) < 0) error = "too many subscriptions";
+                if (error != NULL) queue_text(r, c, FRAME_ERROR, h.seq, error);
+                else if (h.flags & FRAME_FLAG_ACK) queue_text(r, c, FRAME_ACK, h.seq, "");
+                break;
+            }
+            case FRAME_PUB: {
+                const char *topic, *text;
+                size_t topic_len, text_len;
+                if (frame_split_topic(payload, h.length, &topic, &topic_len, &text, &text_len) < 0) {
+                    queue_text(r, c, FRAME_ERROR, h.seq, "PUB frame without a topic");
+                    break;
+                }
+                if (!server.quiet) {
+                    printf("Client %d in %.*s: %.*s\n", c->id, (int)topic_len, topic, (int)text_len, text);
+                }
+                if (route_message(r, c, h.type, h.seq, 0, payload, h.length) == 0 && (h.flags & FRAME_FLAG_ACK)) {
+                    queue_text(r, c, FRAME_ACK, h.seq, "");
+                }
+                break;
+            }
+            case FRAME_HISTORY:
+                if (server.history == NULL) queue_text(r, c, FRAME_ERROR, 0, "history is disabled");
+                else replay_history(r, c, h.seq);
+                break;
+            case FRAME_BYE:
+                if (!server.quiet) printf("Client %d left the chat.\n", c->id);
+                c->closing = 1;
+                schedule_flush(r, c);
+                break;
+            default:
+                queue_text(r, c, FRAME_ERROR, h.seq, "unexpected frame type");
+                break;
+        }
+    }
+    stat_add(&r->stats.frames_in, frames);
+    return (long)pos;
+}
+
+void handle_console(struct Reactor *r) {
+    while (1) {
+        if (buffer_reserve(&r->console, BUFFER_SIZE) < 0) return;
+        ssize_t n = read(STDIN_FILENO, r->console.data + r->console.len, r->console.cap - r->console.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n == 0) {
+            // Console closed (e.g. Ctrl+D): keep serving without it
+            r->console_open = 0;
+            if (r->ring != NULL) {
+                struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+                if (sqe != NULL) {
+                    sqe->opcode = IORING_OP_POLL_REMOVE;
+                    sqe->fd = -1;
+                    sqe->addr = OP_CONSOLE;
+                    sqe->user_data = OP_CANCEL;
+                }
+            } else {
+                epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            }
+            return;
+        }
+        if (n < 0) return;
+        r->console.len += n;
+
+        char *nl;
+        while ((nl = memchr(r->console.data + r->console.start, '\n',
+                            r->console.len - r->console.start)) != NULL) {
+            char *line = r->console.data + r->console.start;
+            size_t len = nl - line;
+
+            r->console.start += len + 1;
+            if (len >= 4 && strncmp(line, "exit", 4) == 0) {
+                printf("Ending chat.\n");
+                stop_server();
+                return;
+            }
+            route_message(r, NULL, FRAME_MSG, 0, 0, line, len);
+        }
+        buffer_consume(&r->console, 0);
+    }
+}
+
+// Drains messages other shards addressed to our clients
+void handle_mailbox(struct Reactor *r) {
+    uint64_t count;
+    struct MailItem *item;
+
+    if (read(r->mailbox.event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+    // Re-arm before draining: a push that races with the drain below will
+    // then write a fresh wake-up instead of being missed.
+    atomic_store(&r->mailbox.signaled, 0);
+    while ((item = mailbox_pop(&r->mailbox)) != NULL) {
+        deliver(r, item->kind, item->to, item->from, item->buf);
+        msgbuf_release(item->buf);
+        free(item);
+    }
+}
+
+// Encodes a message once and hands references to it to the local shard and
+// (if needed) to the other shards' mailboxes. No shard copies the payload.
+// A PUB goes to every shard, each of which knows only its own subscribers.
+// Returns -1 (after telling the sender why) if the message was rejected.
+int route_message(struct Reactor *r, struct Connection *from, int type, uint32_t seq, uint32_t to,
+                  const char *text, size_t len) {
+    int kind = (type == FRAME_DIRECT) ? MAIL_DIRECT : (type == FRAME_PUB) ? MAIL_TOPIC : MAIL_BROADCAST;
+    uint32_t from_id = from ? (uint32_t)from->id : 0;
+    struct FrameHeader h = { (uint32_t)len, (uint8_t)type, 0, seq, from_id };
+
+    if (kind == MAIL_DIRECT && to == 0) {
+        if (from) queue_text(r, from, FRAME_ERROR, seq, "DIRECT frame without a recipient");
+        return -1;
+    }
+    // A recipient on this shard can be looked up now, so the ACK means it was
+    // queued for them. (One on another shard is only known once its shard
+    // reads the mailbox, and ACKs must stay in order, so that one is routed
+    // on trust.)
+    if (kind == MAIL_DIRECT && (int)(to % server.num_shards) == r->index) {
+        struct Connection *c = id_map_get(&r->by_id, (int)to);
+        if (c == NULL || c->closing) {
+            if (from) queue_text(r, from, FRAME_ERROR, seq, "no such client");
+            return -1;
+        }
+    }
+
+    // Broadcasts are logged first: the log assigns the offset that every
+    // live copy carries, so replayed and live frames are byte-identical.
+    if (kind == MAIL_BROADCAST && server.history != NULL && history_append(server.history, &h, text) < 0) {
+        static atomic_int warned;
+        if (atomic_exchange(&warned, 1) == 0) perror("History append failed; messages are not being logged");
+    }
+
+    struct MsgBuf *buf = msgbuf_new(&h, text);
+    if (buf == NULL) {
+        if (from) queue_text(r, from, FRAME_ERROR, seq, "server out of memory");
+        return -1;
+    }
+    buf->born = r->now;
+    stat_add(&r->stats.relayed, 1);
+
+    for (int i = 0; i < server.num_shards; i++) {
+        struct Reactor *target = &server.shards[i];
+
+        if (kind == MAIL_DIRECT && i != (int)(to % server.num_shards)) continue;
+        if (target == r) {
+            deliver(r, kind, to, from_id, buf);
+            continue;
+        }
+
+        struct MailItem *item = malloc(sizeof(*item));
+        if (item == NULL) continue;
+        item->kind = kind;
+        item->to = to;
+        item->from = from_id;
+        item->buf = buf;
+        atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+        mailbox_push(&target->mailbox, item);
+    }
+    msgbuf_release(buf);
+    return 0;
+}
+
+// Queues a shared frame for the recipients that live on this shard
+void deliver(struct Reactor *r, int kind, int to, uint32_t from, struct MsgBuf *buf) {
+    if (kind == MAIL_DIRECT) {
+        struct Connection *c = id_map_get(&r->by_id, to);
+        if (c != NULL && !c->closing) queue_buf(r, c, buf, 1);
+        return;
+    }
+    if (kind == MAIL_TOPIC) {
+        const char *topic, *text;
+        size_t topic_len, text_len;
+        if (frame_split_topic(buf->data + FRAME_HEADER_SIZE, buf->size - FRAME_HEADER_SIZE, &topic, &topic_len,
+                              &text, &text_len) < 0) {
+            return;
+        }
+        struct Topic *t = topic_map_get(&r->topics, topic, topic_len, topic_hash(topic, topic_len));
+        if (t == NULL) return;
+        for (int i = 0; i < t->num_subs; i++) {
+            struct Connection *c = t->subs[i];
+            if ((uint32_t)c->id == from || c->closing) continue;
+            queue_buf(r, c, buf, 1);
+        }
+        return;
+    }
+    for (int fd = 0; fd < r->conns_cap; fd++) {
+        struct Connection *c = r->conns[fd];
+        if (c == NULL || c->fd != fd || (uint32_t)c->id == from || c->closing) continue;
+        queue_buf(r, c, buf, 1);
+    }
+}
+
+// Adds a reference to buf to the connection's send queue and schedules a
+// flush. A droppable message that would push a non-empty queue past the
+// high-water mark is skipped (or the client is kicked with -k); an empty
+// queue takes any frame, so messages larger than the mark still get through.
+// Returns 0 if queued.
+int queue_buf(struct Reactor *r, struct Connection *c, struct MsgBuf *buf, int droppable) {
+    struct SendQueue *q = &c->out;
+
+    if (droppable && q->bytes > 0 && q->bytes + buf->size > server.high_water) {
+        if (server.kick_slow) {
+            if (!server.quiet) printf("Client %d is too slow; disconnecting.\n", c->id);
+            size_t before = q->bytes;
+            send_queue_truncate(q, c->sends_inflight);
+            stat_add(&r->stats.queued_bytes, q->bytes - before);
+            stat_add(&r->stats.kicked, 1);
+            c->closing = 1;
+            schedule_flush(r, c);
+        } else {
+            // The notice goes out once the backlog drains, which takes a flush
+            c->dropped++;
+            stat_add(&r->stats.dropped, 1);
+            schedule_flush(r, c);
+        }
+        return -1;
+    }
+
+    if (q->count == q->cap) {
+        int cap = q->cap ? q->cap * 2 : 8;
+        struct MsgBuf **grown = malloc(cap * sizeof(*grown));
+        if (grown == NULL) {
+            c->closing = 1;
+            return -1;
+        }
+        // Unwrap the ring into the new array
+        for (int i = 0; i < q->count; i++) grown[i] = q->bufs[(q->head + i) & (q->cap - 1)];
+        free(q->bufs);
+        q->bufs = grown;
+        q->head = 0;
+        q->cap = cap;
+    }
+
+    atomic_fetch_add_explicit(&buf->refs, 1, memory_order_relaxed);
+    q->bufs[(q->head + q->count) & (q->cap - 1)] = buf;
+    q->count++;
+    if (buf->seg == NULL) {
+        q->bytes += buf->size; // Replays cost no memory
+        stat_add(&r->stats.queued_bytes, buf->size);
+    }
+    stat_add(&r->stats.deliveries, 1);
+    schedule_flush(r, c);
+    return 0;
+}
+
+// Sends a server-generated text frame (e.g. an ERROR notice)
+void queue_text(struct Reactor *r, struct Connection *c, int type, uint32_t seq, const char *text) {
+    struct FrameHeader h = { (uint32_t)strlen(text), (uint8_t)type, 0, seq, 0 };
+    struct MsgBuf *buf = msgbuf_new(&h, text);
+
+    if (buf == NULL) return;
+    queue_buf(r, c, buf, 0);
+    msgbuf_release(buf);
+}
+
+// Puts the connection on this batch's flush list
+void schedule_flush(struct Reactor *r, struct Connection *c) {
+    if (c->dirty) return;
+    if (r->num_dirty == r->dirty_cap) {
+        int cap = r->dirty_cap ? r->dirty_cap * 2 : 256;
+        struct Connection **grown = realloc(r->dirty, cap * sizeof(*grown));
+        if (grown == NULL) return; // Flushed later by EPOLLOUT or the next message
+        r->dirty = grown;
+        r->dirty_cap = cap;
+    }
+    r->dirty[r->num_dirty++] = c;
+    c->dirty = 1;
+}
+
+// Writes as much of the send queue as the socket accepts, many frames per
+// writev(). Returns 0 on success (including a partial write), -1 if the peer
+// is gone.
+int flush_output(struct Reactor *r, struct Connection *c) {
+    struct SendQueue *q = &c->out;
+    struct iovec iov[MAX_IOVECS];
+
+    if (c->shm != NULL) return shm_flush(r, c);
+
+    while (q->count > 0) {
+        struct MsgBuf *first = q->bufs[q->head];
+        ssize_t n;
+
+        if (first->seg != NULL) {
+            // History replay: straight from the page cache to the socket
+            off_t off = (off_t)first->pos + q->sent;
+            n = sendfile(c->fd, first->seg->fd, &off, first->size - q->sent);
+            if (n == 0) return -1; // Segment shorter than recorded
+        } else {
+            int niov = 0;
+
+            // One iovec per queued frame up to the next replay entry; the
+            // first skips what a previous partial write already sent.
+            for (int i = 0; i < q->count && niov < MAX_IOVECS; i++) {
+                struct MsgBuf *b = q->bufs[(q->head + i) & (q->cap - 1)];
+                if (b->seg != NULL) break;
+                size_t skip = (i == 0) ? q->sent : 0;
+                iov[niov].iov_base = b->data + skip;
+                iov[niov].iov_len = b->size - skip;
+                niov++;
+            }
+            n = writev(c->fd, iov, niov);
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // Socket buffer full: the rest goes out on the next EPOLLOUT edge
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                stat_add(&r->stats.stalls, 1);
+                return 0;
+            }
+            return -1;
+        }
+        stat_add(&r->stats.bytes_out, n);
+
+        // Drop our reference to every frame that went out completely
+        size_t written = q->sent + n;
+        while (q->count > 0) {
+            struct MsgBuf *b = q->bufs[q->head];
+            if (written < b->size) break;
+            written -= b->size;
+            retire_buf(r, q, b);
+            q->head = (q->head + 1) & (q->cap - 1);
+            q->count--;
+        }
+        q->sent = written;
+    }
+    q->head = 0;
+    q->sent = 0;
+    report_drops(r, c);
+    return 0;
+}
 
-    // Close socket
-    close(new_socket);
-    close(server_fd);
+// Copies the send queue into a same-host client's ring (replays straight
+// from the segment mapping) and wakes it once. If the ring fills up, the
+// client wakes us when it has made room.
+int shm_flush(struct Reactor *r, struct Connection *c) {
+    struct SendQueue *q = &c->out;
+    size_t total = 0;
+
+    while (q->count > 0) {
+        struct MsgBuf *b = q->bufs[q->head];
+        const char *src = (b->seg != NULL) ? b->seg->map + b->pos : b->data;
+        size_t n = shm_ring_write(&c->shm->out, src + q->sent, b->size - q->sent);
+        if (n == 0) {
+            stat_add(&r->stats.stalls, 1);
+            break;
+        }
+        total += n;
+        q->sent += n;
+        if (q->sent < b->size) continue;
+        q->sent = 0;
+        retire_buf(r, q, b);
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->count--;
+    }
+    if (total > 0) {
+        stat_add(&r->stats.bytes_out, total);
+        shm_link_notify(c->shm);
+    }
+    if (q->count == 0) {
+        q->head = 0;
+        report_drops(r, c);
+    }
     return 0;
 }
+
+// Streams the log from `from` (or the oldest message still kept) up to now,
+// then a HISTORY frame with the offset that follows. Live broadcasts queued
+// meanwhile keep their place, so the client may see a message twice; the
+// offsets let it drop duplicates.
+void replay_history(struct Reactor *r, struct Connection *c, uint64_t from) {
+    struct HistoryRange ranges[MAX_REPLAY_RANGES];
+    uint64_t next;
+    int n = history_read(server.history, from, ranges, MAX_REPLAY_RANGES, &next);
+
+    for (int i = 0; i < n; i++) {
+        struct MsgBuf *buf = msgbuf_segment(ranges[i].seg, ranges[i].pos, ranges[i].len);
+        if (buf == NULL) {
+            history_segment_release(ranges[i].seg);
+            continue;
+        }
+        queue_buf(r, c, buf, 0);
+        msgbuf_release(buf);
+    }
+
+    struct FrameHeader h = { 0, FRAME_HISTORY, 0, next, 0 };
+    struct MsgBuf *done = msgbuf_new(&h, NULL);
+    if (done != NULL) {
+        queue_buf(r, c, done, 0);
+        msgbuf_release(done);
+    }
+}
+
+// Accounts for a frame that has been written in full and drops the send
+// queue's reference to it. The caller advances the queue.
+void retire_buf(struct Reactor *r, struct SendQueue *q, struct MsgBuf *b) {
+    if (b->seg == NULL) {
+        q->bytes -= b->size;
+        stat_add(&r->stats.queued_bytes, -(uint64_t)b->size);
+    }
+    if (b->born != 0) {
+        uint64_t ns = r->now > b->born ? r->now - b->born : 0;
+        stat_add(&r->stats.latency[hist_index(ns)], 1);
+        stat_add(&r->stats.latency_sum, ns);
+    }
+    msgbuf_release(b);
+}
+
+// Once the backlog is gone, tells a slow reader what it missed
+void report_drops(struct Reactor *r, struct Connection *c) {
+    if (c->dropped > 0 && !c->closing) {
+        char note[64];
+        snprintf(note, sizeof(note), "%u message(s) dropped: you were reading too slowly", c->dropped);
+        c->dropped = 0;
+        queue_text(r, c, FRAME_ERROR, 0, note);
+    }
+}
+
+// Releases everything after the first `keep` entries (those may still be
+// owned by in-flight io_uring sends)
+void send_queue_truncate(struct SendQueue *q, int keep) {
+    while (q->count > keep) {
+        struct MsgBuf *b = q->bufs[(q->head + q->count - 1) & (q->cap - 1)];
+        if (b->seg == NULL) q->bytes -= b->size;
+        msgbuf_release(b);
+        q->count--;
+    }
+    if (keep == 0) q->bytes = 0; // Drop the partially sent head as well
+}
+
+void send_queue_clear(struct SendQueue *q) {
+    for (int i = 0; i < q->count; i++) msgbuf_release(q->bufs[(q->head + i) & (q->cap - 1)]);
+    free(q->bufs);
+    memset(q, 0, sizeof(*q));
+}
+
+// Usable bytes of each pool class; bigger frames bypass the pool
+static size_t pool_class_size(int cls) {
+    return (size_t)256 << (3 * cls); // 256 B, 2 KB, 16 KB, 128 KB
+}
+
+// Builds an encoded frame with one reference owned by the caller
+struct MsgBuf *msgbuf_new(const struct FrameHeader *h, const char *payload) {
+    size_t size = FRAME_HEADER_SIZE + (size_t)h->length;
+    struct MsgBuf *b = NULL;
+    int cls = 0;
+
+    while (cls < POOL_CLASSES && pool_class_size(cls) < size) cls++;
+    if (cls < POOL_CLASSES && pool.free_list[cls] != NULL) {
+        b = pool.free_list[cls];
+        pool.free_list[cls] = b->next_free;
+        pool.free_count[cls]--;
+    } else {
+        b = malloc(sizeof(*b) + (cls < POOL_CLASSES ? pool_class_size(cls) : size));
+        if (b == NULL) return NULL;
+        b->size_class = cls < POOL_CLASSES ? cls : -1;
+    }
+
+    atomic_store_explicit(&b->refs, 1, memory_order_relaxed);
+    b->size = (uint32_t)size;
+    b->seg = NULL;
+    b->born = 0;
+    frame_encode_header(b->data, h);
+    if (h->length > 0) memcpy(b->data + FRAME_HEADER_SIZE, payload, h->length);
+    return b;
+}
+
+// Frees this thread's pooled buffers, when it is done with them
+void pool_drain(void) {
+    for (int cls = 0; cls < POOL_CLASSES; cls++) {
+        while (pool.free_list[cls] != NULL) {
+            struct MsgBuf *b = pool.free_list[cls];
+            pool.free_list[cls] = b->next_free;
+            free(b);
+        }
+        pool.free_count[cls] = 0;
+    }
+}
+
+// A replay entry for len bytes of seg at pos. Takes over the caller's
+// segment reference.
+struct MsgBuf *msgbuf_segment(struct Segment *seg, uint32_t pos, uint32_t len) {
+    struct MsgBuf *b = malloc(sizeof(*b));
+
+    if (b == NULL) return NULL;
+    atomic_store_explicit(&b->refs, 1, memory_order_relaxed);
+    b->size_class = -1;
+    b->size = len;
+    b->pos = pos;
+    b->seg = seg;
+    b->born = 0;
+    return b;
+}
+
+// Drops one reference. The last holder (on whichever shard) returns the
+// buffer to its own thread's pool.
+void msgbuf_release(struct MsgBuf *b) {
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) != 1) return;
+
+    if (b->seg != NULL) {
+        history_segment_release(b->seg);
+        free(b);
+        return;
+    }
+
+    int cls = b->size_class;
+    if (cls >= 0 && pool.free_count[cls] < POOL_MAX_FREE) {
+        b->next_free = pool.free_list[cls];
+        pool.free_list[cls] = b;
+        pool.free_count[cls]++;
+    } else {
+        free(b);
+    }
+}
+
+void close_connection(struct Reactor *r, struct Connection *c) {
+    // Remove from the flush list so we never touch freed memory
+    if (c->dirty) {
+        for (int i = 0; i < r->num_dirty; i++) {
+            if (r->dirty[i] == c) {
+                r->dirty[i] = r->dirty[--r->num_dirty];
+                break;
+            }
+        }
+        c->dirty = 0;
+    }
+    r->conns[c->fd] = NULL;
+    if (c->shm != NULL) {
+        r->conns[c->shm->wake_fd] = NULL;
+        shm_link_close(c->shm); // Also takes the wake-up fd out of the epoll set
+        free(c->shm);
+        c->shm = NULL;
+    }
+    id_map_remove(&r->by_id, c->id);
+    while (c->num_topics > 0) topic_leave(r, c, c->num_topics - 1);
+    r->num_clients--;
+    stat_add(&r->stats.closed, 1);
+    stat_add(&r->stats.queued_bytes, -(uint64_t)c->out.bytes); // Never sent now
+    // io_uring requests hold their own reference to the socket; shutdown()
+    // makes them complete so the struct can be freed.
+    if (r->ring != NULL) shutdown(c->fd, SHUT_RDWR);
+    close(c->fd); // Also removes it from the epoll set
+    int online = atomic_fetch_sub(&server.online, 1) - 1;
+    if (!server.quiet) printf("Client %d disconnected (%d online).\n", c->id, online);
+
+    c->dead = 1;
+    if (c->pending_ops == 0) free_connection(c);
+}
+
+void free_connection(struct Connection *c) {
+    free(c->in.data);
+    free(c->topics);
+    send_queue_clear(&c->out);
+    free(c);
+}
+
+// Probes for everything the io_uring backend needs (kernel 6.0+): a ring
+// and a registered buffer ring; multishot accept/recv ship alongside them.
+int uring_supported() {
+    struct Uring u;
+
+    if (uring_init(&u, 8) < 0) return 0;
+    uring_exit(&u);
+    return 1;
+}
+
+int uring_init(struct Uring *u, unsigned entries) {
+    struct io_uring_params p;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    // Only this shard's thread submits, and completions are processed only
+    // when we ask for them: lets the kernel skip cross-thread wake-ups.
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = entries * 4; // Multishot requests post many completions each
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 4;
+        u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(u->fd);
+        return -1;
+    }
+
+    // Submission and completion rings share one mapping
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring_mem = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       u->fd, IORING_OFF_SQ_RING);
+    if (u->ring_mem == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring_mem, u->ring_size);
+        close(u->fd);
+        return -1;
+    }
+
+    char *base = u->ring_mem;
+    u->sq_entries = p.sq_entries;
+    u->sq_head = (unsigned *)(base + p.sq_off.head);
+    u->sq_tail = (unsigned *)(base + p.sq_off.tail);
+    u->sq_mask = (unsigned *)(base + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(base + p.sq_off.array);
+    u->sq_local_tail = u->sq_submitted = *u->sq_tail;
+    u->cq_head = (unsigned *)(base + p.cq_off.head);
+    u->cq_tail = (unsigned *)(base + p.cq_off.tail);
+    u->cq_mask = (unsigned *)(base + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(base + p.cq_off.cqes);
+
+    // Receive buffers: the kernel picks one per completion, so idle
+    // connections hold no receive memory at all.
+    size_t ring_bytes = RECV_BUF_COUNT * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, ring_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buf_base = malloc((size_t)RECV_BUF_COUNT * RECV_BUF_SIZE);
+    if (u->buf_ring == MAP_FAILED || u->buf_base == NULL) {
+        if (u->buf_ring != MAP_FAILED) munmap(u->buf_ring, ring_bytes);
+        u->buf_ring = NULL;
+        uring_exit(u);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = RECV_BUF_COUNT;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_exit(u);
+        return -1;
+    }
+    u->buf_tail = 0;
+    for (unsigned bid = 0; bid < RECV_BUF_COUNT; bid++) uring_recycle(u, bid);
+    return 0;
+}
+
+void uring_exit(struct Uring *u) {
+    close(u->fd); // Cancels everything still in flight
+    if (u->buf_ring != NULL) munmap(u->buf_ring, RECV_BUF_COUNT * sizeof(struct io_uring_buf));
+    free(u->buf_base);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring_mem, u->ring_size);
+}
+
+// Returns a zeroed SQE, submitting queued ones first if the ring is full
+struct io_uring_sqe *uring_get_sqe(struct Uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+
+    if (u->sq_local_tail - head >= u->sq_entries) {
+        uring_submit(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local_tail - head >= u->sq_entries) return NULL;
+    }
+    unsigned idx = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+// Publishes prepared SQEs and optionally waits for wait_nr completions, in
+// one system call.
+int uring_submit(struct Uring *u, unsigned wait_nr) {
+    unsigned to_submit = u->sq_local_tail - u->sq_submitted;
+
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    int ret = (int)syscall(__NR_io_uring_enter, u->fd, to_submit, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret > 0) u->sq_submitted += ret;
+    return ret;
+}
+
+// Hands receive buffer bid back to the kernel
+void uring_recycle(struct Uring *u, unsigned bid) {
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (RECV_BUF_COUNT - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->buf_base + (size_t)bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = (unsigned short)bid;
+    u->buf_tail++;
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+void setup_uring_reactor(struct Reactor *r) {
+    r->ring = calloc(1, sizeof(struct Uring));
+    if (r->ring == NULL || uring_init(r->ring, URING_ENTRIES) < 0) {
+        perror("io_uring setup");
+        exit(EXIT_FAILURE);
+    }
+    // io_uring parks blocking sockets on its own poll machinery; a
+    // non-blocking listener would just complete with -EAGAIN.
+    fcntl(r->listen_fd, F_SETFL, fcntl(r->listen_fd, F_GETFL) & ~O_NONBLOCK);
+
+    uring_arm_accept(r);
+    uring_arm_poll(r, r->mailbox.event_fd, OP_MAILBOX);
+    if (r->console_open) uring_arm_poll(r, STDIN_FILENO, OP_CONSOLE);
+}
+
+void run_uring_reactor(struct Reactor *r) {
+    struct Uring *u = r->ring;
+
+    while (atomic_load_explicit(&server.running, memory_order_relaxed)) {
+        // Submit everything queued by the last batch and wait for more work
+        if (uring_submit(u, 1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        stat_add(&r->stats.loops, 1);
+        if (server.stats_path != NULL) r->now = now_ns();
+
+        unsigned head = *u->cq_head;
+        while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            uring_handle_cqe(r, &u->cqes[head & *u->cq_mask]);
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+        }
+        flush_dirty(r);
+    }
+}
+
+void uring_handle_cqe(struct Reactor *r, struct io_uring_cqe *cqe) {
+    uintptr_t data = (uintptr_t)cqe->user_data;
+    struct Connection *c = (struct Connection *)(data & ~(uintptr_t)OP_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    int res = cqe->res;
+
+    switch (data & OP_MASK) {
+        case OP_ACCEPT:
+            if (res >= 0) add_connection(r, res);
+            else if (res != -EINTR && res != -ECONNABORTED) fprintf(stderr, "Accept failed: %s\n", strerror(-res));
+            if (!more) uring_arm_accept(r);
+            return;
+
+        case OP_MAILBOX:
+            handle_mailbox(r);
+            if (!more) uring_arm_poll(r, r->mailbox.event_fd, OP_MAILBOX);
+            return;
+
+        case OP_CONSOLE:
+            if (r->console_open) handle_console(r);
+            if (!more && r->console_open) uring_arm_poll(r, STDIN_FILENO, OP_CONSOLE);
+            return;
+
+        case OP_RECV:
+            if (res > 0) {
+                unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                stat_add(&r->stats.bytes_in, res);
+                const char *buf = r->ring->buf_base + (size_t)bid * RECV_BUF_SIZE;
+
+                if (!c->dead) receive_bytes(r, c, buf, res);
+                uring_recycle(r->ring, bid);
+            }
+            if (!more && !c->dead) {
+                // Out of buffers or terminated early: re-arm. EOF or error: close.
+                int rearm = res > 0 || res == -ENOBUFS;
+                if (!rearm || uring_arm_recv(r, c) < 0) close_connection(r, c);
+            }
+            if (!more) c->pending_ops--;
+            break;
+
+        case OP_SEND:
+            c->sends_inflight--;
+            if (!c->dead) {
+                if (res < 0) {
+                    close_connection(r, c);
+                } else {
+                    // MSG_WAITALL: a successful send always wrote the whole frame
+                    struct SendQueue *q = &c->out;
+                    stat_add(&r->stats.bytes_out, res);
+                    retire_buf(r, q, q->bufs[q->head]);
+                    q->head = (q->head + 1) & (q->cap - 1);
+                    q->count--;
+                    if (c->sends_inflight == 0) {
+                        if (q->count == 0) report_drops(r, c);
+                        if (q->count > 0 || c->closing) schedule_flush(r, c);
+                    }
+                }
+            }
+            c->pending_ops--;
+            break;
+
+        default:
+            return; // OP_CANCEL
+    }
+
+    if (c->dead && c->pending_ops == 0) free_connection(c);
+}
+
+void uring_arm_accept(struct Reactor *r) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = r->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT; // One request, a completion per client
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+}
+
+void uring_arm_poll(struct Reactor *r, int fd, int op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+
+    if (sqe == NULL) return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = op;
+}
+
+// One multishot receive per connection, fed from the shard's buffer ring.
+// Returns -1 if the ring has no room for it; the caller closes c.
+int uring_arm_recv(struct Reactor *r, struct Connection *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+
+    if (sqe == NULL) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (uintptr_t)c | OP_RECV;
+    c->pending_ops++;
+    return 0;
+}
+
+// Submits the send queue as a chain of linked sends, one per frame, straight
+// from the shared message buffers. Links keep the frames in order; the next
+// chain starts when this one has completed.
+int uring_flush(struct Reactor *r, struct Connection *c) {
+    struct SendQueue *q = &c->out;
+    int n = q->count < MAX_LINKED_SENDS ? q->count : MAX_LINKED_SENDS;
+
+    if (c->sends_inflight > 0 || n == 0) return 0;
+    for (int i = 0; i < n; i++) {
+        struct MsgBuf *b = q->bufs[(q->head + i) & (q->cap - 1)];
+        struct io_uring_sqe *sqe = uring_get_sqe(r->ring);
+        if (sqe == NULL) {
+            if (i == 0) return 0; // Retried by the next completion
+            // Close the chain early so what we already queued still runs
+            break;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = c->fd;
+        // Replays are sent from the segment mapping, i.e. the page cache
+        sqe->addr = (uintptr_t)(b->seg != NULL ? b->seg->map + b->pos : b->data);
+        sqe->len = b->size;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL; // Short sends retry in the kernel
+        sqe->flags = (i < n - 1) ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uintptr_t)c | OP_SEND;
+        c->sends_inflight++;
+        c->pending_ops++;
+    }
+    return 0;
+}
+
+// Listening Unix stream socket for -s and -u
+int create_unix_listener(const char *path, int nonblock) {
+    struct sockaddr_un addr;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0), 0)) < 0) {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    unlink(path); // Left behind by a server that did not shut down cleanly
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Runs beside the shards so a scrape never stalls an event loop
+void *stats_thread(void *arg) {
+    struct Buffer out = { 0 };
+
+    (void)arg;
+    while (1) {
+        int fd = accept4(server.stats_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break; // Shut down by serve()
+        }
+        out.start = out.len = 0;
+        format_stats(&out);
+        while (out.start < out.len) {
+            ssize_t n = send(fd, out.data + out.start, out.len - out.start, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            out.start += n;
+        }
+        close(fd);
+    }
+    free(out.data);
+    return NULL;
+}
+
+// Per-shard counters in Prometheus text format; rates (accepts/s, bytes/s)
+// are the difference between two scrapes divided by the uptime difference.
+void format_stats(struct Buffer *out) {
+    static const struct {
+        const char *name;
+        const char *help;
+        size_t offset;
+        int gauge;
+    } metrics[] = {
+        { "chat_accepted_total", "Connections accepted.", offsetof(struct ShardStats, accepted), 0 },
+        { "chat_closed_total", "Connections closed.", offsetof(struct ShardStats, closed), 0 },
+        { "chat_received_bytes_total", "Bytes read from clients.", offsetof(struct ShardStats, bytes_in), 0 },
+        { "chat_sent_bytes_total", "Bytes written to clients.", offsetof(struct ShardStats, bytes_out), 0 },
+        { "chat_frames_received_total", "Frames decoded.", offsetof(struct ShardStats, frames_in), 0 },
+        { "chat_relayed_total", "MSG and DIRECT frames routed.", offsetof(struct ShardStats, relayed), 0 },
+        { "chat_deliveries_total", "Frames queued to recipients.", offsetof(struct ShardStats, deliveries), 0 },
+        { "chat_send_stalls_total", "Flushes cut short by a full socket buffer.", offsetof(struct ShardStats, stalls), 0 },
+        { "chat_dropped_total", "Messages skipped by backpressure.", offsetof(struct ShardStats, dropped), 0 },
+        { "chat_kicked_total", "Clients disconnected at the high-water mark.", offsetof(struct ShardStats, kicked), 0 },
+        { "chat_loop_iterations_total", "Event loop iterations.", offsetof(struct ShardStats, loops), 0 },
+        { "chat_send_queue_bytes", "Bytes waiting in send queues.", offsetof(struct ShardStats, queued_bytes), 1 },
+    };
+    struct Histogram *latency = malloc(sizeof(*latency));
+
+    buffer_printf(out, "# HELP chat_uptime_seconds Seconds since the server started.\n"
+                       "# TYPE chat_uptime_seconds gauge\nchat_uptime_seconds %.3f\n",
+                  (now_ns() - server.started) / 1e9);
+    buffer_printf(out, "# HELP chat_clients Clients online.\n# TYPE chat_clients gauge\nchat_clients %d\n",
+                  atomic_load(&server.online));
+
+    for (size_t m = 0; m < sizeof(metrics) / sizeof(metrics[0]); m++) {
+        int gauge = metrics[m].gauge;
+        buffer_printf(out, "# HELP %s %s\n# TYPE %s %s\n", metrics[m].name, metrics[m].help,
+                      metrics[m].name, gauge ? "gauge" : "counter");
+        for (int i = 0; i < server.num_shards; i++) {
+            _Atomic uint64_t *v = (_Atomic uint64_t *)((char *)&server.shards[i].stats + metrics[m].offset);
+            uint64_t value = atomic_load_explicit(v, memory_order_relaxed);
+            // The queue gauge is adjusted with wrapping adds, so read it signed
+            if (gauge) buffer_printf(out, "%s{shard=\"%d\"} %lld\n", metrics[m].name, i, (long long)value);
+            else buffer_printf(out, "%s{shard=\"%d\"} %llu\n", metrics[m].name, i, (unsigned long long)value);
+        }
+    }
+
+    // Relay latency: the shards' histograms merged
+    if (latency == NULL) return;
+    hist_init(latency);
+    for (int i = 0; i < server.num_shards; i++) {
+        struct ShardStats *st = &server.shards[i].stats;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            uint64_t n = atomic_load_explicit(&st->latency[b], memory_order_relaxed);
+            if (n == 0) continue;
+            latency->counts[b] += n;
+            latency->total += n;
+            if (hist_bucket_high(b) > latency->max) latency->max = hist_bucket_high(b);
+        }
+        latency->sum += atomic_load_explicit(&st->latency_sum, memory_order_relaxed);
+    }
+    buffer_printf(out, "# HELP chat_relay_latency_seconds From reading a message to writing it to a recipient.\n"
+                       "# TYPE chat_relay_latency_seconds summary\n");
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        buffer_printf(out, "chat_relay_latency_seconds{quantile=\"%g\"} %.9f\n", quantiles[q] / 100,
+                      hist_percentile(latency, quantiles[q]) / 1e9);
+    }
+    buffer_printf(out, "chat_relay_latency_seconds_sum %.9f\nchat_relay_latency_seconds_count %llu\n",
+                  latency->sum / 1e9, (unsigned long long)latency->total);
+    free(latency);
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// -B: forks a quiet server for each backend and measures it over loopback
+int run_benchmark(int seconds) {
+    const char *names[2] = { "epoll", "io_uring" };
+
+    printf("Benchmark: %d connection(s) x %d in flight, %d-byte messages, %d s per backend, %d shard(s)\n\n",
+           BENCH_CONNS, BENCH_WINDOW, BENCH_PAYLOAD, seconds, server.num_shards);
+    printf("%-10s %14s %12s %12s %12s\n", "backend", "msgs/s", "p50 (us)", "p99 (us)", "p99.9 (us)");
+
+    for (int b = 0; b < 2; b++) {
+        if (b == 1 && !uring_supported()) {
+            printf("%-10s %14s\n", names[b], "unavailable");
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (pid == 0) {
+            // Child: a silent server with this backend
+            int devnull = open("/dev/null", O_RDWR);
+            dup2(devnull, STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            server.use_uring = b;
+            server.quiet = 1;
+            serve();
+            _exit(0);
+        }
+
+        double rate = 0, pct[3] = {0, 0, 0};
+        int ok = bench_backend(seconds, &rate, pct);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (ok < 0) {
+            printf("%-10s %14s\n", names[b], "failed");
+            continue;
+        }
+        printf("%-10s %14.0f %12.1f %12.1f %12.1f\n", names[b], rate, pct[0] / 1e3, pct[1] / 1e3, pct[2] / 1e3);
+    }
+
+    // Same-host transport: one message in flight, so the numbers are pure
+    // round-trip latency through the epoll server
+    printf("\nSame host, 1 connection x 1 in flight, %d-byte messages, %d s per transport\n\n", BENCH_PAYLOAD,
+           seconds);
+    printf("%-10s %14s %12s %12s %12s\n", "transport", "msgs/s", "p50 (us)", "p99 (us)", "p99.9 (us)");
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(devnull, STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        server.use_uring = 0;
+        server.quiet = 1;
+        server.local_path = BENCH_LOCAL_PATH;
+        serve();
+        _exit(0);
+    }
+    const char *transports[2] = { "tcp", "shm" };
+    for (int t = 0; t < 2; t++) {
+        double rate = 0, pct[3] = {0, 0, 0};
+        if (bench_round_trips(t, seconds, &rate, pct) < 0) {
+            printf("%-10s %14s\n", transports[t], "failed");
+            continue;
+        }
+        printf("%-10s %14.0f %12.1f %12.1f %12.1f\n", transports[t], rate, pct[0] / 1e3, pct[1] / 1e3,
+               pct[2] / 1e3);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(BENCH_LOCAL_PATH);
+    return 0;
+}
+
+// Closed-loop load: every connection keeps BENCH_WINDOW DIRECT frames
+// addressed to itself in flight. Each payload starts with its send time, so
+// the echo gives the round trip through the server.
+int bench_backend(int seconds, double *msgs_per_sec, double pct[3]) {
+    struct sockaddr_in addr;
+    int fds[BENCH_CONNS];
+    uint32_t ids[BENCH_CONNS];
+    struct Buffer in[BENCH_CONNS];
+    char frame[FRAME_HEADER_SIZE + BENCH_PAYLOAD];
+    uint64_t *samples = NULL;
+    size_t num_samples = 0, cap_samples = 0;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int result = -1;
+    int opened = 0;
+
+    memset(in, 0, sizeof(in));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+
+    // Connect (retrying while the child starts up) and learn our ids
+    for (; opened < BENCH_CONNS; opened++) {
+        int fd = -1;
+        for (int tries = 0; tries < 200; tries++) {
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) break;
+            close(fd);
+            fd = -1;
+            usleep(10000);
+        }
+        if (fd < 0) goto done;
+        fds[opened] = fd;
+
+        char hello[FRAME_HEADER_SIZE];
+        struct FrameHeader h;
+        if (recv(fd, hello, sizeof(hello), MSG_WAITALL) != sizeof(hello)) {
+            opened++;
+            goto done;
+        }
+        frame_decode_header(hello, &h);
+        ids[opened] = h.peer;
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)opened };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+    memset(frame, 'x', sizeof(frame));
+    uint64_t start = now_ns();
+    uint64_t measure_from = start + 500000000ull; // 0.5 s warm-up
+    uint64_t end = measure_from + (uint64_t)seconds * 1000000000ull;
+
+    for (int i = 0; i < BENCH_CONNS; i++) {
+        for (int w = 0; w < BENCH_WINDOW; w++) {
+            struct FrameHeader h = { BENCH_PAYLOAD, FRAME_DIRECT, 0, 0, ids[i] };
+            uint64_t t = now_ns();
+            frame_encode_header(frame, &h);
+            memcpy(frame + FRAME_HEADER_SIZE, &t, sizeof(t));
+            if (send(fds[i], frame, sizeof(frame), MSG_NOSIGNAL) != (ssize_t)sizeof(frame)) goto done;
+        }
+    }
+
+    while (1) {
+        struct epoll_event events[BENCH_CONNS];
+        uint64_t now = now_ns();
+        if (now >= end) break;
+
+        int n = epoll_wait(epfd, events, BENCH_CONNS, 100);
+        for (int e = 0; e < n; e++) {
+            int i = (int)events[e].data.u32;
+            if (buffer_reserve(&in[i], READ_CHUNK) < 0) goto done;
+            ssize_t got = recv(fds[i], in[i].data + in[i].len, in[i].cap - in[i].len, 0);
+            if (got <= 0) goto done;
+            in[i].len += got;
+
+            struct FrameHeader h;
+            const char *payload;
+            long used;
+            int replies = 0;
+            while ((used = frame_decode(in[i].data + in[i].start, in[i].len - in[i].start, &h, &payload)) > 0) {
+                in[i].start += used;
+                if (h.type != FRAME_DIRECT || h.length < sizeof(uint64_t)) continue;
+
+                uint64_t sent_at;
+                memcpy(&sent_at, payload, sizeof(sent_at));
+                uint64_t t = now_ns();
+                if (sent_at >= measure_from && t < end) {
+                    if (num_samples == cap_samples) {
+                        cap_samples = cap_samples ? cap_samples * 2 : 1 << 16;
+                        uint64_t *grown = realloc(samples, cap_samples * sizeof(*grown));
+                        if (grown == NULL) goto done;
+                        samples = grown;
+                    }
+                    samples[num_samples++] = t - sent_at;
+                }
+                replies++;
+            }
+            buffer_consume(&in[i], 0);
+
+            // Refill the window with one writev-free batch per connection
+            char batch[BENCH_WINDOW * sizeof(frame)];
+            size_t blen = 0;
+            while (replies-- > 0 && blen + sizeof(frame) <= sizeof(batch)) {
+                struct FrameHeader out = { BENCH_PAYLOAD, FRAME_DIRECT, 0, 0, ids[i] };
+                uint64_t t = now_ns();
+                frame_encode_header(frame, &out);
+                memcpy(frame + FRAME_HEADER_SIZE, &t, sizeof(t));
+                memcpy(batch + blen, frame, sizeof(frame));
+                blen += sizeof(frame);
+            }
+            if (blen > 0 && send(fds[i], batch, blen, MSG_NOSIGNAL) != (ssize_t)blen) goto done;
+        }
+    }
+
+    if (num_samples > 0) {
+        qsort(samples, num_samples, sizeof(*samples), compare_u64);
+        *msgs_per_sec = (double)num_samples / seconds;
+        pct[0] = (double)samples[num_samples * 50 / 100];
+        pct[1] = (double)samples[num_samples * 99 / 100];
+        pct[2] = (double)samples[num_samples * 999 / 1000];
+        result = 0;
+    }
+
+done:
+    for (int i = 0; i < opened; i++) {
+        close(fds[i]);
+        free(in[i].data);
+    }
+    free(samples);
+    close(epfd);
+    return result;
+}
+
+// Reads exactly want bytes from the socket or the shared ring
+static int bench_recv(int sock, struct ShmLink *link, char *buf, size_t want) {
+    if (link == NULL) return recv(sock, buf, want, MSG_WAITALL) == (ssize_t)want ? 0 : -1;
+
+    const char *data;
+    while (shm_ring_peek(&link->in, &data) < want) {
+        struct pollfd pfd = { link->wake_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 1000) <= 0) return -1;
+        shm_link_rearm(link);
+    }
+    memcpy(buf, data, want);
+    if (shm_ring_consume(&link->in, want)) shm_wake(link->peer_fd);
+    return 0;
+}
+
+// Ping-pong: sends a DIRECT frame to ourselves and waits for it to come back,
+// over loopback TCP (local = 0) or the shared-memory link (local = 1)
+int bench_round_trips(int local, int seconds, double *msgs_per_sec, double pct[3]) {
+    struct ShmLink link;
+    struct ShmLink *shm = local ? &link : NULL;
+    struct Histogram *hist = malloc(sizeof(*hist));
+    char frame[FRAME_HEADER_SIZE + BENCH_PAYLOAD];
+    struct FrameHeader h;
+    int sock = -1;
+    int result = -1;
+
+    if (hist == NULL) return -1;
+    hist_init(hist);
+    // Connect and wait for our HELLO, retrying while the child starts up (a
+    // previous io_uring child's listener can linger and reset us)
+    for (int tries = 0; tries < 200 && sock < 0; tries++) {
+        if (local) {
+            sock = shm_connect(BENCH_LOCAL_PATH, &link);
+        } else {
+            struct sockaddr_in addr;
+            int one = 1;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(server.port);
+            inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+            sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (sock >= 0 && bench_recv(sock, shm, frame, FRAME_HEADER_SIZE) < 0) {
+            if (local) shm_link_close(&link);
+            close(sock);
+            sock = -1;
+        }
+        if (sock < 0) usleep(10000);
+    }
+    if (sock < 0) {
+        free(hist);
+        return -1;
+    }
+    frame_decode_header(frame, &h);
+    uint32_t id = h.peer;
+
+    memset(frame, 'x', sizeof(frame));
+    uint64_t measure_from = now_ns() + 500000000ull; // 0.5 s warm-up
+    uint64_t end = measure_from + (uint64_t)seconds * 1000000000ull;
+
+    while (1) {
+        struct FrameHeader out = { BENCH_PAYLOAD, FRAME_DIRECT, 0, 0, id };
+        uint64_t sent_at = now_ns();
+        if (sent_at >= end) break;
+        frame_encode_header(frame, &out);
+        if (local) {
+            if (shm_ring_write(&link.out, frame, sizeof(frame)) != sizeof(frame)) goto done;
+            shm_link_notify(&link);
+        } else if (send(sock, frame, sizeof(frame), MSG_NOSIGNAL) != (ssize_t)sizeof(frame)) {
+            goto done;
+        }
+        if (bench_recv(sock, shm, frame, sizeof(frame)) < 0) goto done;
+        if (sent_at >= measure_from) hist_record(hist, now_ns() - sent_at);
+    }
+
+    if (hist->total > 0) {
+        *msgs_per_sec = (double)hist->total / seconds;
+        pct[0] = (double)hist_percentile(hist, 50);
+        pct[1] = (double)hist_percentile(hist, 99);
+        pct[2] = (double)hist_percentile(hist, 99.9);
+        result = 0;
+    }
+
+done:
+    if (local) shm_link_close(&link);
+    close(sock);
+    free(hist);
+    return result;
+}
+
+void mailbox_init(struct Mailbox *mb) {
+    atomic_store(&mb->stub.next, NULL);
+    atomic_store(&mb->head, &mb->stub);
+    mb->tail = &mb->stub;
+    atomic_store(&mb->signaled, 0);
+    mb->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mb->event_fd < 0) {
+        perror("eventfd");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Safe to call from any thread
+void mailbox_push(struct Mailbox *mb, struct MailItem *item) {
+    uint64_t one = 1;
+
+    atomic_store_explicit(&item->next, NULL, memory_order_relaxed);
+    struct MailItem *prev = atomic_exchange_explicit(&mb->head, item, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, item, memory_order_release);
+
+    // Only the first push after a drain pays for the eventfd write
+    if (atomic_exchange(&mb->signaled, 1) == 0) {
+        if (write(mb->event_fd, &one, sizeof(one)) < 0) perror("write(eventfd)");
+    }
+}
+
+// Owner thread only. Returns NULL when empty (or when a push is half-done;
+// the pusher's wake-up brings us back for it).
+struct MailItem *mailbox_pop(struct Mailbox *mb) {
+    struct MailItem *tail = mb->tail;
+    struct MailItem *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &mb->stub) {
+        if (next == NULL) return NULL;
+        mb->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&mb->head, memory_order_acquire)) return NULL;
+
+    // Only one item left: park the stub behind it so it can be detached
+    atomic_store_explicit(&mb->stub.next, NULL, memory_order_relaxed);
+    struct MailItem *prev = atomic_exchange_explicit(&mb->head, &mb->stub, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, &mb->stub, memory_order_release);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next != NULL) {
+        mb->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+struct Connection *id_map_get(struct IdMap *m, int id) {
+    if (m->cap == 0) return NULL;
+    for (unsigned i = (unsigned)id * 2654435761u & (m->cap - 1); m->slots[i] != NULL; i = (i + 1) & (m->cap - 1)) {
+        if (m->slots[i]->id == id) return m->slots[i];
+    }
+    return NULL;
+}
+
+int id_map_put(struct IdMap *m, struct Connection *c) {
+    // Keep the load factor under 1/2 so probe chains stay short
+    if ((m->count + 1) * 2 > m->cap) {
+        struct IdMap grown;
+        grown.cap = m->cap ? m->cap * 2 : 1024;
+        grown.count = 0;
+        grown.slots = calloc(grown.cap, sizeof(*grown.slots));
+        if (grown.slots == NULL) return -1;
+        for (int i = 0; i < m->cap; i++) {
+            if (m->slots[i] != NULL) id_map_put(&grown, m->slots[i]);
+        }
+        free(m->slots);
+        *m = grown;
+    }
+    unsigned i = (unsigned)c->id * 2654435761u & (m->cap - 1);
+    while (m->slots[i] != NULL) i = (i + 1) & (m->cap - 1);
+    m->slots[i] = c;
+    m->count++;
+    return 0;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+void id_map_remove(struct IdMap *m, int id) {
+    unsigned mask = m->cap - 1;
+    unsigned i;
+
+    if (m->cap == 0) return;
+    for (i = (unsigned)id * 2654435761u & mask; m->slots[i] != NULL; i = (i + 1) & mask) {
+        if (m->slots[i]->id == id) break;
+    }
+    if (m->slots[i] == NULL) return;
+
+    m->slots[i] = NULL;
+    m->count--;
+    for (unsigned j = (i + 1) & mask; m->slots[j] != NULL; j = (j + 1) & mask) {
+        unsigned home = (unsigned)m->slots[j]->id * 2654435761u & mask;
+        // Move slot j back into the hole if its home is not in (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->slots[i] = m->slots[j];
+            m->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// Adds c to a topic's subscribers, creating the topic on first use.
+// Subscribing twice is harmless. Returns -1 at the subscription limit or if
+// memory runs out.
+int subscribe(struct Reactor *r, struct Connection *c, const char *name, size_t len) {
+    uint32_t hash = topic_hash(name, len);
+    struct Topic *t = topic_map_get(&r->topics, name, len, hash);
+
+    if (t != NULL) {
+        for (int i = 0; i < c->num_topics; i++) {
+            if (c->topics[i] == t) return 0;
+        }
+    }
+    if (c->num_topics == MAX_SUBSCRIPTIONS) return -1;
+    if (c->num_topics == c->topics_cap) {
+        int cap = c->topics_cap ? c->topics_cap * 2 : 4;
+        struct Topic **grown = realloc(c->topics, cap * sizeof(*grown));
+        if (grown == NULL) return -1;
+        c->topics = grown;
+        c->topics_cap = cap;
+    }
+
+    if (t == NULL) {
+        t = calloc(1, sizeof(*t) + len);
+        if (t == NULL) return -1;
+        t->hash = hash;
+        t->len = (uint32_t)len;
+        memcpy(t->name, name, len);
+        if (topic_map_put(&r->topics, t) < 0) {
+            free(t);
+            return -1;
+        }
+    }
+    if (t->num_subs == t->subs_cap) {
+        int cap = t->subs_cap ? t->subs_cap * 2 : 8;
+        struct Connection **grown = realloc(t->subs, cap * sizeof(*grown));
+        if (grown == NULL) {
+            if (t->num_subs == 0) {
+                topic_map_remove(&r->topics, t);
+                free(t);
+            }
+            return -1;
+        }
+        t->subs = grown;
+        t->subs_cap = cap;
+    }
+    t->subs[t->num_subs++] = c;
+    c->topics[c->num_topics++] = t;
+    return 0;
+}
+
+// Leaving a topic the client never joined is not an error
+void unsubscribe(struct Reactor *r, struct Connection *c, const char *name, size_t len) {
+    struct Topic *t = topic_map_get(&r->topics, name, len, topic_hash(name, len));
+
+    for (int i = 0; t != NULL && i < c->num_topics; i++) {
+        if (c->topics[i] == t) {
+            topic_leave(r, c, i);
+            return;
+        }
+    }
+}
+
+// Removes c from its i-th topic; the last subscriber out frees the topic
+void topic_leave(struct Reactor *r, struct Connection *c, int i) {
+    struct Topic *t = c->topics[i];
+
+    c->topics[i] = c->topics[--c->num_topics];
+    for (int j = 0; j < t->num_subs; j++) {
+        if (t->subs[j] == c) {
+            t->subs[j] = t->subs[--t->num_subs];
+            break;
+        }
+    }
+    if (t->num_subs == 0) {
+        topic_map_remove(&r->topics, t);
+        free(t->subs);
+        free(t);
+    }
+}
+
+// FNV-1a
+uint32_t topic_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= (uint8_t)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+struct Topic *topic_map_get(struct TopicMap *m, const char *name, size_t len, uint32_t hash) {
+    if (m->cap == 0) return NULL;
+    for (unsigned i = hash & (m->cap - 1); m->slots[i] != NULL; i = (i + 1) & (m->cap - 1)) {
+        struct Topic *t = m->slots[i];
+        if (t->hash == hash && t->len == len && memcmp(t->name, name, len) == 0) return t;
+    }
+    return NULL;
+}
+
+int topic_map_put(struct TopicMap *m, struct Topic *t) {
+    // Same load factor as IdMap
+    if ((m->count + 1) * 2 > m->cap) {
+        struct TopicMap grown;
+        grown.cap = m->cap ? m->cap * 2 : 64;
+        grown.count = 0;
+        grown.slots = calloc(grown.cap, sizeof(*grown.slots));
+        if (grown.slots == NULL) return -1;
+        for (int i = 0; i < m->cap; i++) {
+            if (m->slots[i] != NULL) topic_map_put(&grown, m->slots[i]);
+        }
+        free(m->slots);
+        *m = grown;
+    }
+    unsigned i = t->hash & (m->cap - 1);
+    while (m->slots[i] != NULL) i = (i + 1) & (m->cap - 1);
+    m->slots[i] = t;
+    m->count++;
+    return 0;
+}
+
+// Backward-shift deletion, as in id_map_remove
+void topic_map_remove(struct TopicMap *m, struct Topic *t) {
+    unsigned mask = m->cap - 1;
+    unsigned i;
+
+    if (m->cap == 0) return;
+    for (i = t->hash & mask; m->slots[i] != NULL; i = (i + 1) & mask) {
+        if (m->slots[i] == t) break;
+    }
+    if (m->slots[i] == NULL) return;
+
+    m->slots[i] = NULL;
+    m->count--;
+    for (unsigned j = (i + 1) & mask; m->slots[j] != NULL; j = (j + 1) & mask) {
+        unsigned home = m->slots[j]->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            m->slots[i] = m->slots[j];
+            m->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+// Ensures at least `extra` free bytes after b->len
+int buffer_reserve(struct Buffer *b, size_t extra) {
+    if (b->cap - b->len >= extra) return 0;
+
+    // Reclaim already-consumed space at the front before growing
+    if (b->start > 0) buffer_consume(b, 0);
+    if (b->cap - b->len >= extra) return 0;
+
+    size_t cap = b->cap ? b->cap : BUFFER_SIZE;
+    while (cap - b->len < extra) cap *= 2;
+    char *grown = realloc(b->data, cap);
+    if (grown == NULL) return -1;
+    b->data = grown;
+    b->cap = cap;
+    return 0;
+}
+
+int buffer_append(struct Buffer *b, const char *data, size_t len) {
+    if (buffer_reserve(b, len) < 0) return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+// Appends formatted text
+int buffer_printf(struct Buffer *b, const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || buffer_reserve(b, (size_t)n + 1) < 0) return -1;
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+    return n;
+}
+
+// Marks n more bytes as consumed and slides the remainder to the front
+void buffer_consume(struct Buffer *b, size_t n) {
+    b->start += n;
+    if (b->start == b->len) {
+        b->start = b->len = 0;
+    } else if (b->start > 0) {
+        memmove(b->data, b->data + b->start, b->len - b->start);
+        b->len -= b->start;
+        b->start = 0;
+    }
+}
@@ -0,0 +1,295 @@
+/*
+ * Same-Host Shared-Memory Transport (header-only)
+ * * Features:
+ * - A client on the server's machine connects to a Unix domain socket (the
+ *   control path) and is handed two memfd ring buffers and two eventfds with
+ *   SCM_RIGHTS. Frames then travel through shared memory and never touch the
+ *   TCP/IP stack; the socket only tells either side that the other has gone.
+ * - Each ring is single-producer single-consumer: the writer owns tail, the
+ *   reader owns head, and neither takes a lock.
+ * - The data area is mapped twice, back to back, so any span of up to the
+ *   ring size is contiguous: frames are decoded in place and written with a
+ *   single memcpy, even across the wrap.
+ * - Wake-ups are eventfd writes, skipped while the reader already has one
+ *   pending (the same scheme as the server's shard mailboxes). A writer that
+ *   finds the ring full asks to be woken when the reader makes room.
+ */
+
+#ifndef CHAT_SHM_H
+#define CHAT_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SHM_RING_SIZE (256 * 1024)   // Bytes per direction; a power of two
+#define SHM_LINK_FDS 4               // Descriptors passed to the client
+
+// Shared by both ends, in the first page of the memfd. Each position gets its
+// own cache line so the two sides do not contend.
+struct ShmRingHeader {
+    _Alignas(64) _Atomic uint64_t head;   // Bytes ever consumed (reader)
+    _Alignas(64) _Atomic uint64_t tail;   // Bytes ever produced (writer)
+    _Alignas(64) atomic_int signaled;     // 1 = the reader has a wake-up pending
+    atomic_int writer_blocked;            // 1 = the writer waits for room
+};
+
+struct ShmRing {
+    struct ShmRingHeader *hdr;
+    char *data;          // size bytes, immediately followed by the same bytes
+    size_t size;
+    void *map;
+    size_t map_len;
+};
+
+// One end of a connection: a ring each way plus the two wake-up eventfds
+struct ShmLink {
+    struct ShmRing in;   // Peer -> us
+    struct ShmRing out;  // Us -> peer
+    int wake_fd;         // Signalled when `in` has data or `out` has room
+    int peer_fd;         // Signals the peer likewise
+};
+
+static inline size_t shm_page_size() {
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Maps a ring memfd (one header page, then size data bytes) with the data
+// mapped a second time right after the first
+static inline int shm_ring_map(struct ShmRing *r, int fd, size_t size) {
+    size_t page = shm_page_size();
+    size_t len = page + 2 * size;
+
+    // Reserve the whole range first so both halves land next to each other
+    char *base = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return -1;
+    if (mmap(base, page + size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + page + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, (off_t)page) ==
+            MAP_FAILED) {
+        munmap(base, len);
+        return -1;
+    }
+    r->map = base;
+    r->map_len = len;
+    r->hdr = (struct ShmRingHeader *)base;
+    r->data = base + page;
+    r->size = size;
+    return 0;
+}
+
+// Creates and maps an empty ring. Returns its memfd, which the caller passes
+// to the peer and then closes, or -1.
+static inline int shm_ring_create(struct ShmRing *r, size_t size) {
+    int fd = memfd_create("chat-ring", MFD_CLOEXEC);
+
+    if (fd < 0) return -1;
+    // ftruncate() zero-fills, which is the empty state of the header
+    if (ftruncate(fd, (off_t)(shm_page_size() + size)) < 0 || shm_ring_map(r, fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Maps a ring created by the peer; its size comes from the memfd
+static inline int shm_ring_open(struct ShmRing *r, int fd) {
+    struct stat st;
+    size_t page = shm_page_size();
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size <= page) return -1;
+    size_t size = (size_t)st.st_size - page;
+    if ((size & (size - 1)) != 0 || size % page != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return shm_ring_map(r, fd, size);
+}
+
+static inline void shm_ring_unmap(struct ShmRing *r) {
+    if (r->map != NULL) munmap(r->map, r->map_len);
+    r->map = NULL;
+}
+
+// Bytes ready to read, contiguous at *data. Never more than the ring holds,
+// whatever the peer wrote into the header.
+static inline size_t shm_ring_peek(struct ShmRing *r, const char **data) {
+    uint64_t head = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_acquire);
+    uint64_t used = tail - head;
+
+    *data = r->data + (head & (r->size - 1));
+    return used < r->size ? (size_t)used : r->size;
+}
+
+// Frees n bytes. Returns 1 if the writer was waiting for room and must be
+// woken through the peer's eventfd.
+static inline int shm_ring_consume(struct ShmRing *r, size_t n) {
+    uint64_t head = atomic_load_explicit(&r->hdr->head, memory_order_relaxed);
+
+    atomic_store_explicit(&r->hdr->head, head + n, memory_order_release);
+    // Pairs with the fence in shm_ring_write: either the writer sees the new
+    // head, or we see its flag.
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&r->hdr->writer_blocked, memory_order_relaxed) &&
+           atomic_exchange(&r->hdr->writer_blocked, 0);
+}
+
+// Copies as much of src as fits and publishes it. Returns the bytes written;
+// 0 means the ring is full and the reader will wake us when it drains.
+static inline size_t shm_ring_write(struct ShmRing *r, const char *src, size_t len) {
+    uint64_t tail = atomic_load_explicit(&r->hdr->tail, memory_order_relaxed);
+    uint64_t used = tail - atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+
+    if (used >= r->size) {
+        atomic_store_explicit(&r->hdr->writer_blocked, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        used = tail - atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+        if (used >= r->size) return 0;
+        // Room appeared meanwhile; a leftover flag only costs a spare wake-up
+    }
+    if (len > r->size - used) len = r->size - used;
+    memcpy(r->data + (tail & (r->size - 1)), src, len);
+    atomic_store_explicit(&r->hdr->tail, tail + len, memory_order_release);
+    return len;
+}
+
+static inline void shm_wake(int fd) {
+    uint64_t one = 1;
+
+    // Fails only if the peer has let the counter saturate, i.e. is long gone
+    (void)!write(fd, &one, sizeof(one));
+}
+
+// After a batch of writes: wakes the reader unless a wake-up is still pending
+static inline void shm_link_notify(struct ShmLink *l) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&l->out.hdr->signaled, 1) == 0) shm_wake(l->peer_fd);
+}
+
+// Before draining `in`: clears our eventfd and asks for the next wake-up.
+// Everything published after this is either seen by the drain that follows
+// or signalled anew.
+static inline void shm_link_rearm(struct ShmLink *l) {
+    uint64_t count;
+
+    (void)!read(l->wake_fd, &count, sizeof(count)); // EAGAIN if already cleared
+    atomic_store(&l->in.hdr->signaled, 0);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void shm_link_close(struct ShmLink *l) {
+    shm_ring_unmap(&l->in);
+    shm_ring_unmap(&l->out);
+    close(l->wake_fd);
+    close(l->peer_fd);
+}
+
+// Server side: builds both rings and eventfds. fds[] gets what the client
+// needs, in the order shm_link_open() expects; the caller closes fds[0] and
+// fds[1] (the memfds) once they are sent. fds[2..3] stay owned by the link.
+static inline int shm_link_create(struct ShmLink *l, size_t size, int fds[SHM_LINK_FDS]) {
+    memset(l, 0, sizeof(*l));
+    l->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    l->peer_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[0] = shm_ring_create(&l->in, size);
+    fds[1] = fds[0] < 0 ? -1 : shm_ring_create(&l->out, size);
+    if (l->wake_fd < 0 || l->peer_fd < 0 || fds[1] < 0) {
+        if (fds[0] >= 0) close(fds[0]);
+        if (l->wake_fd >= 0) close(l->wake_fd);
+        if (l->peer_fd >= 0) close(l->peer_fd);
+        shm_ring_unmap(&l->in);
+        shm_ring_unmap(&l->out);
+        return -1;
+    }
+    fds[2] = l->wake_fd;
+    fds[3] = l->peer_fd;
+    return 0;
+}
+
+// Client side: the mirror image of shm_link_create(). Takes over the fds.
+static inline int shm_link_open(struct ShmLink *l, const int fds[SHM_LINK_FDS]) {
+    memset(l, 0, sizeof(*l));
+    int rc = (shm_ring_open(&l->out, fds[0]) < 0 || shm_ring_open(&l->in, fds[1]) < 0) ? -1 : 0;
+
+    close(fds[0]);
+    close(fds[1]);
+    l->peer_fd = fds[2];
+    l->wake_fd = fds[3];
+    if (rc < 0) shm_link_close(l);
+    return rc;
+}
+
+// Sends the link's descriptors with a one-byte message
+static inline int shm_send_fds(int sock, const int fds[SHM_LINK_FDS]) {
+    char byte = 'S';
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * SHM_LINK_FDS);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * SHM_LINK_FDS);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+// Connects to the server's local socket and opens the link it hands over.
+// Returns the control socket, or -1.
+static inline int shm_connect(const char *path, struct ShmLink *l) {
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (sock < 0) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov = { &byte, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * SHM_LINK_FDS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg;
+    int fds[SHM_LINK_FDS];
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * SHM_LINK_FDS)) {
+        close(sock);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    if (shm_link_open(l, fds) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+#endif
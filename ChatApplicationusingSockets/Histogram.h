@@ -0,0 +1,81 @@
+/*
+ * Latency Histogram (HDR-style, header-only)
+ * * Features:
+ * - Records 64-bit values (nanoseconds here) in O(1) with no allocation.
+ * - Log-linear buckets: exact below 128, then 64 sub-buckets per power of
+ *   two, so every reported value is within 1/64 (~1.6%) of the truth while
+ *   the whole range fits in a fixed 30 KB table.
+ * - Histograms from several threads can be merged before reporting.
+ */
+
+#ifndef CHAT_HISTOGRAM_H
+#define CHAT_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define HIST_SUB_BITS 7                          // 2^7 linear values before the first doubling
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))     // Sub-buckets per power of two
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_HALF + HIST_HALF)
+
+struct Histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+};
+
+static inline void hist_init(struct Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+static inline int hist_index(uint64_t v) {
+    if (v < (1u << HIST_SUB_BITS)) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - (HIST_SUB_BITS - 1); // Leaves v >> shift in [HALF, 2*HALF)
+    return shift * HIST_HALF + (int)(v >> shift);
+}
+
+// Largest value that lands in bucket i
+static inline uint64_t hist_bucket_high(int i) {
+    if (i < (1 << HIST_SUB_BITS)) return (uint64_t)i;
+    int shift = i / HIST_HALF - 1;
+    uint64_t sub = (uint64_t)(i % HIST_HALF + HIST_HALF);
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void hist_record(struct Histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+}
+
+static inline void hist_merge(struct Histogram *dst, const struct Histogram *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+// Value at or below which `percentile` percent of the samples fall
+static inline uint64_t hist_percentile(const struct Histogram *h, double percentile) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)(percentile / 100.0 * (double)h->total + 0.5);
+    if (rank < 1) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_bucket_high(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
@@ -1,116 +1,2966 @@
 /*
  * Simple Command Line Shell in C
  * * Features:
- * - Runs a Read-Eval-Print Loop (REPL).
- * - Parses user input into commands and arguments.
- * - Uses fork() to create child processes.
- * - Uses execvp() to execute system commands (ls, pwd, echo, etc.).
- * - Implements built-in commands: 'cd' and 'exit'.
+ * - Runs a Read-Eval-Print Loop (REPL), or a script: 'myshell script.sh'.
+ *   Scripts are mmap'd and tokenized in place; each statement's syntax tree
+ *   lives in an arena that is freed in one go once the statement has run.
+ * - Quotes ('...' and "..."), backslash escapes, '#' comments, and no limit
+ *   on line length or argument count.
+ * - Pipelines: 'ls | grep c | wc -l', joined with ';', '&&' and '||'.
+ * - Redirection: '<', '>', '>>', '2>', '2>>' and '2>&1', applied left to right.
+ * - Launches programs with posix_spawnp() instead of fork()+execvp(), so the
+ *   cost of starting a command does not grow with the shell's memory size.
+ * - Remembers where each command was found on PATH (see 'hash'), so running
+ *   it again does not probe every PATH directory.
+ * - Background jobs with '&' and job control: 'jobs', 'fg', 'bg', 'wait' and
+ *   Ctrl-Z. Children are reaped when SIGCHLD arrives instead of blocking in
+ *   wait() on one command at a time.
+ * - 'parallel -j N cmd {}' runs a command once per input line, N at a time.
+ *   It reads stdin or the pipe before it, and must end its pipeline.
+ * - Implements built-in commands: 'cd', 'exit', 'hash', 'echo', 'printf',
+ *   'pwd', 'true', 'false', 'test' / '[' and 'export'. They run inside the
+ *   shell, write through a buffer, and honour redirections.
+ * - 'bench [-n runs] [-w warmup] cmd' times a command over several runs,
+ *   with CPU time, memory and context switches from wait4().
+ * - Line editing with a persistent history: Up/Down to recall, Ctrl-R to
+ *   search it, 'history' to list it. The file is mapped, not read, at
+ *   startup, and searches go through a trigram index.
+ * - '-B count' benchmarks how many short-lived commands per second we can
+ *   run, and how much faster the built-ins are than the programs.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <spawn.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
-#define MAX_CMD_LEN 1024
-#define MAX_ARGS 64
+#define ARENA_BLOCK (64 * 1024) // Parser memory is taken from blocks of this size
+#define PATH_BUCKETS 64    // Hash chains in the command path cache
+#define MAX_JOBS 64        // Background, stopped and 'parallel' jobs at once
+
+#define PARSE_ERROR -1      // Syntax error (already reported)
+#define PARSE_INCOMPLETE -2 // Input ended inside quotes or after '|', '&&' or '||'
+
+extern char **environ;
+
+// Token kinds produced by lex()
+enum TokenType {
+    TOK_WORD,
+    TOK_PIPE,         // |
+    TOK_IN,           // <
+    TOK_OUT,          // >
+    TOK_APPEND,       // >>
+    TOK_ERR_OUT,      // 2>
+    TOK_ERR_APPEND,   // 2>>
+    TOK_ERR_TO_OUT,   // 2>&1
+    TOK_AMP,          // & (run in the background)
+    TOK_SEMI,         // ;
+    TOK_AND_IF,       // &&
+    TOK_OR_IF,        // ||
+    TOK_NEWLINE,
+    TOK_EOF
+};
+
+// A token is a slice of the input; nothing is copied while lexing
+struct Token {
+    enum TokenType type;
+    const char *start;
+    size_t len;
+    int line;
+    int plain;        // A word without quotes or backslashes
+};
+
+struct Lexer {
+    const char *p;
+    const char *end;
+    int line;
+};
+
+// The nodes of one statement are bump-allocated from here and all freed
+// together by arena_reset() once it has run
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    _Alignas(16) char data[];
+};
+
+struct Arena {
+    struct ArenaBlock *head;
+};
+
+struct Parser {
+    struct Lexer lx;
+    struct Token tok;          // The next token, not yet consumed
+    const char *prev_end;      // End of the last consumed token
+    const char *stmt_start;    // Where the statement being parsed began
+    const char *file;          // Script name for error messages, or NULL
+    int pending_terminator;    // tok is the ';', '&' or newline that ended the last statement
+    struct Arena *arena;
+};
+
+// One redirection; 'flags' is -1 for a dup of another descriptor
+struct Redirect {
+    int fd;
+    int flags;
+    int dup_from;
+    char *path;
+};
+
+struct Command {
+    char **args;               // NULL terminated
+    int num_args;
+    struct Redirect *redirs;
+    int num_redirs;
+};
+
+// A statement is a list of pipelines joined by '&&' and '||'
+struct Pipeline {
+    struct Command *cmds;
+    int count;
+    int background;            // Ended with '&'
+    int run_if;                // TOK_AND_IF or TOK_OR_IF: depends on the previous status
+    const char *text;          // The source text, for 'jobs'
+    size_t text_len;
+    struct Pipeline *next;
+};
+// Command name -> absolute path, filled in as commands are first run
+struct PathEntry {
+    char *name;
+    char *path;
+    int hits;
+    struct PathEntry *next;
+};
+
+// A pipeline the shell has started and not yet reaped
+struct Job {
+    int used;
+    int id;                      // [n] for 'jobs'; 0 until it is put in the background
+    pid_t pgid;                  // Its process group, or 0 if it shares ours
+    pid_t *pids;
+    char *stopped;
+    int num_pids;
+    int running;                 // Processes not yet exited (stopped ones included)
+    int num_stopped;
+    int wstatus;                 // waitpid() status of the last process
+    int notify;                  // Report its new state before the next prompt
+    char *cmdline;
+};
+
+int last_status = 0; // Exit status of the last pipeline
+
+struct Job jobs[MAX_JOBS];
+int interactive = 0;           // Job control only when reading from a terminal
+int running_script = 0;
+pid_t shell_pgid;
+struct termios shell_tmodes;
+sigset_t wait_mask;            // Our signal mask with SIGCHLD let through
+volatile sig_atomic_t interrupted = 0; // Ctrl-C while the shell itself waits
+
+struct PathEntry *path_cache[PATH_BUCKETS];
+char *path_cache_env = NULL; // The PATH the cache was filled from
 
 // Function Prototypes
-void read_command(char *cmd);
-void parse_command(char *cmd, char **args);
-void execute_command(char **args);
+void run_repl(void);
+int run_script(const char *path, int noexec);
+void *arena_alloc(struct Arena *a, size_t size);
+void arena_reset(struct Arena *a);
+void parser_init(struct Parser *ps, const char *src, size_t len, const char *file, struct Arena *a);
+int parse_statement(struct Parser *ps, struct Pipeline **out);
+void execute_statement(struct Pipeline *p);
+int run_builtin(struct Command *cmd);
+int run_builtin_background(struct Pipeline *p);
+struct Output;
+void out_flush(struct Output *o);
+void out_write(struct Output *o, const char *s, size_t n);
+void out_printf(struct Output *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+int builtin_cd(char **args);
+int builtin_exit(char **args);
+int builtin_echo(char **args);
+int builtin_printf(char **args);
+int builtin_pwd(char **args);
+int builtin_true(char **args);
+int builtin_false(char **args);
+int builtin_test(char **args);
+int builtin_export(char **args);
+int builtin_bench(char **args);
+int builtin_history(char **args);
+void history_add(const char *text, size_t len);
+ssize_t edit_line(const char *prompt, char **line, size_t *cap);
+const char *path_lookup(const char *name);
+void path_forget(const char *name);
+void path_cache_clear(void);
+int builtin_hash(char **args);
+pid_t spawn_command(struct Command *cmd, int in_fd, int out_fd, pid_t pgid, int take_tty);
+void execute_pipeline(struct Pipeline *p);
+void job_control_init(int allow_tty);
+struct Job *job_new(const char *cmdline, size_t len, int num_pids);
+void job_free(struct Job *j);
+int job_next_id(void);
+void reap_children(void);
+void job_foreground(struct Job *j);
+void job_notify(void);
+int builtin_jobs(char **args);
+int builtin_fg_bg(char **args);
+int builtin_wait(char **args);
+int builtin_parallel(struct Command *cmd, int in_fd);
+void run_spawn_benchmark(int count);
+void run_builtin_benchmark(int count);
+
+int main(int argc, char *argv[]) {
+    if (argc == 3 && strcmp(argv[1], "-B") == 0) {
+        job_control_init(0);
+        running_script = 1;
+        run_spawn_benchmark(atoi(argv[2]));
+        run_builtin_benchmark(atoi(argv[2]));
+        return 0;
+    }
+
+    // myshell [-n] script: run a file ('-n' only checks its syntax)
+    int noexec = argc > 1 && strcmp(argv[1], "-n") == 0;
+    if (argc == 2 + noexec) {
+        job_control_init(0);
+        return run_script(argv[1 + noexec], noexec);
+    }
+    if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-n] [script] | -B count\n", argv[0]);
+        return 1;
+    }
 
-int main() {
-    char command[MAX_CMD_LEN];
-    char *args[MAX_ARGS];
+    job_control_init(1);
 
     printf("========================================\n");
     printf("        Custom C Shell (myshell)        \n");
     printf("========================================\n");
 
+    run_repl();
+    return 0;
+}
+
+void run_repl(void) {
+    struct Arena arena = { NULL };
+    char *line = NULL, *buf = NULL;
+    size_t line_cap = 0, len = 0, cap = 0;
+
     while (1) {
-        printf("myshell> "); // Print prompt
-        
-        // 1. READ
-        read_command(command);
+        if (len == 0) job_notify(); // "[1]  Done  ..." for background jobs
+        // "> " when the statement continues on this line
+        const char *prompt = len == 0 ? "myshell> " : "> ";
+        if (!interactive) printf("%s", prompt); // edit_line() draws its own
+        fflush(stdout);          // Children share our stdout, so empty our buffer first
 
-        // Handle empty input (user just pressed Enter)
-        if (strcmp(command, "") == 0) {
+        // 1. READ, with line editing and history on a terminal
+        ssize_t n = interactive ? edit_line(prompt, &line, &line_cap)
+                                : getline(&line, &line_cap, stdin);
+        if (n == -1) {
+            // Handle Ctrl+D (End of File)
+            printf("\n");
+            exit(last_status);
+        }
+        if (n == 0) {
+            len = 0; // Ctrl-C: drop the statement
             continue;
         }
+        if (len + (size_t)n > cap) {
+            cap = (len + (size_t)n) * 2;
+            buf = realloc(buf, cap);
+        }
+        memcpy(buf + len, line, (size_t)n);
+        len += (size_t)n;
+
+        // A backslash before the newline continues the line
+        size_t slashes = 0;
+        while (slashes + 2 <= len && buf[len - 2 - slashes] == '\\') slashes++;
+        if (buf[len - 1] == '\n' && slashes % 2 == 1) continue;
+
+        // 2. PARSE and 3. EXECUTE each statement on the line in turn
+        struct Parser ps;
+        struct Pipeline *stmt;
+        int rc;
+        parser_init(&ps, buf, len, NULL, &arena);
+        while ((rc = parse_statement(&ps, &stmt)) == 1) {
+            execute_statement(stmt);
+            arena_reset(&arena);
+        }
+        arena_reset(&arena);
+
+        if (rc == PARSE_INCOMPLETE) {
+            // Keep the unfinished statement and read another line for it
+            size_t done = (size_t)(ps.stmt_start - buf);
+            memmove(buf, buf + done, len - done);
+            len -= done;
+        } else {
+            if (interactive) history_add(buf, len);
+            len = 0; // Finished, or a syntax error: start afresh
+        }
+    }
+}
+
+// Runs a script file. It is mapped rather than read line by line, and the
+// lexer works directly on the mapping.
+int run_script(const char *path, int noexec) {
+    running_script = 1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+        if (fd != -1) close(fd);
+        return 127;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    const char *src = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (src == MAP_FAILED) {
+        fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno));
+        return 126;
+    }
+    madvise((void *)src, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    struct Arena arena = { NULL };
+    struct Parser ps;
+    struct Pipeline *stmt;
+    int rc;
+    parser_init(&ps, src, (size_t)st.st_size, path, &arena);
+    while ((rc = parse_statement(&ps, &stmt)) == 1) {
+        if (!noexec) {
+            execute_statement(stmt);
+            job_notify();
+        }
+        arena_reset(&arena);
+    }
+
+    // Like sh, a syntax error ends the script
+    if (rc == PARSE_INCOMPLETE) {
+        fprintf(stderr, "%s: line %d: unexpected end of file\n", path, ps.lx.line);
+    }
+    if (rc != 0) last_status = 2;
+
+    munmap((void *)src, (size_t)st.st_size);
+    while (arena.head) {
+        struct ArenaBlock *b = arena.head;
+        arena.head = b->next;
+        free(b);
+    }
+    return last_status;
+}
+
+// --- Parser ---
+
+void *arena_alloc(struct Arena *a, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    struct ArenaBlock *b = a->head;
+    if (b == NULL || b->size - b->used < size) {
+        size_t block_size = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = malloc(sizeof(*b) + block_size);
+        if (b == NULL) {
+            perror("myshell");
+            exit(1);
+        }
+        b->size = block_size;
+        b->used = 0;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+// Frees everything at once, keeping the first block for the next statement
+void arena_reset(struct Arena *a) {
+    while (a->head && a->head->next) {
+        struct ArenaBlock *b = a->head;
+        a->head = b->next;
+        free(b);
+    }
+    if (a->head) a->head->used = 0;
+}
+
+// Doubles an arena array; the old copy is simply left for arena_reset()
+static void *arena_grow(struct Arena *a, void *old, size_t count, size_t *cap, size_t elem_size) {
+    *cap = *cap ? *cap * 2 : 4;
+    void *p = arena_alloc(a, *cap * elem_size);
+    if (count) memcpy(p, old, count * elem_size);
+    return p;
+}
+
+static int ends_word(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '&' ||
+           c == ';' || c == '<' || c == '>';
+}
 
-        // 2. PARSE
-        parse_command(command, args);
+// Reads the next token. Returns 0, or PARSE_INCOMPLETE if the input ends
+// inside quotes.
+static int lex(struct Lexer *lx, struct Token *t) {
+    const char *p = lx->p, *end = lx->end;
 
-        // 3. EXECUTE
-        // Check for built-in command 'exit'
-        if (strcmp(args[0], "exit") == 0) {
-            printf("Exiting shell...\n");
+    // Skip blanks, comments and backslash-newline continuations
+    while (p < end) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+        } else if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+            p += 2;
+            lx->line++;
+        } else if (*p == '#') {
+            while (p < end && *p != '\n') p++;
+        } else {
             break;
         }
-        
-        // Check for built-in command 'cd' (Change Directory)
-        // We handle this manually because 'cd' changes the state of the parent process.
-        if (strcmp(args[0], "cd") == 0) {
-            if (args[1] == NULL) {
-                fprintf(stderr, "myshell: expected argument to \"cd\"\n");
-            } else {
-                if (chdir(args[1]) != 0) {
-                    perror("myshell"); // Print error if directory doesn't exist
+    }
+
+    t->start = p;
+    t->line = lx->line;
+    t->plain = 1;
+    size_t left = (size_t)(end - p);
+    enum TokenType type = TOK_WORD;
+    size_t len = 1;
+
+    // Operators (longest match first)
+    if (left == 0) { type = TOK_EOF; len = 0; }
+    else if (*p == '\n') { type = TOK_NEWLINE; lx->line++; }
+    else if (*p == ';') type = TOK_SEMI;
+    else if (*p == '<') type = TOK_IN;
+    else if (*p == '|') { type = TOK_PIPE; if (left > 1 && p[1] == '|') { type = TOK_OR_IF; len = 2; } }
+    else if (*p == '&') { type = TOK_AMP; if (left > 1 && p[1] == '&') { type = TOK_AND_IF; len = 2; } }
+    else if (*p == '>') { type = TOK_OUT; if (left > 1 && p[1] == '>') { type = TOK_APPEND; len = 2; } }
+    else if (*p == '2' && left > 1 && p[1] == '>') {
+        if (left > 3 && p[2] == '&' && p[3] == '1') { type = TOK_ERR_TO_OUT; len = 4; }
+        else if (left > 2 && p[2] == '>') { type = TOK_ERR_APPEND; len = 3; }
+        else { type = TOK_ERR_OUT; len = 2; }
+    }
+
+    if (type != TOK_WORD) {
+        t->type = type;
+        t->len = len;
+        lx->p = p + len;
+        return 0;
+    }
+
+    // A word runs until an unquoted blank or operator character. Only its
+    // extent is found here; word_text() removes the quoting later.
+    t->type = TOK_WORD;
+    while (p < end && !ends_word(*p)) {
+        if (*p == '\\') {
+            t->plain = 0;
+            if (++p < end && *p++ == '\n') lx->line++;
+        } else if (*p == '\'' || *p == '"') {
+            char quote = *p++;
+            t->plain = 0;
+            while (p < end && *p != quote) {
+                if (quote == '"' && *p == '\\' && p + 1 < end) p++; // \" does not end it
+                if (*p++ == '\n') lx->line++;
+            }
+            if (p == end) {
+                lx->p = p;
+                return PARSE_INCOMPLETE;
+            }
+            p++;
+        } else {
+            p++;
+        }
+    }
+    t->len = (size_t)(p - t->start);
+    lx->p = p;
+    return 0;
+}
+
+// The NUL-terminated argument a word stands for, built in the arena: the
+// only copy of the text made between the input and execve()
+static char *word_text(struct Arena *a, const struct Token *t) {
+    char *out = arena_alloc(a, t->len + 1), *o = out;
+    const char *p = t->start, *end = p + t->len;
+    if (t->plain) {
+        memcpy(out, p, t->len);
+        out[t->len] = '\0';
+        return out;
+    }
+
+    while (p < end) {
+        if (*p == '\\') {
+            // Outside quotes a backslash keeps the next character (a
+            // backslash-newline disappears)
+            if (++p < end && *p != '\n') *o++ = *p;
+            p++;
+        } else if (*p == '\'') {
+            // Everything up to the next ' is literal
+            for (p++; *p != '\''; ) *o++ = *p++;
+            p++;
+        } else if (*p == '"') {
+            // Inside "..." a backslash only escapes $ ` " \ and newline
+            for (p++; *p != '"'; ) {
+                if (*p == '\\' && memchr("$`\"\\\n", p[1], 5)) {
+                    if (p[1] != '\n') *o++ = p[1];
+                    p += 2;
+                } else {
+                    *o++ = *p++;
                 }
             }
-            continue; // Skip the fork/exec step
+            p++;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+void parser_init(struct Parser *ps, const char *src, size_t len, const char *file, struct Arena *a) {
+    memset(ps, 0, sizeof(*ps));
+    ps->lx.p = src;
+    ps->lx.end = src + len;
+    ps->lx.line = 1;
+    ps->file = file;
+    ps->arena = a;
+    ps->prev_end = src;
+    ps->tok.type = TOK_NEWLINE; // Consumed by the first parse_statement()
+    ps->tok.start = src;
+    ps->pending_terminator = 1;
+}
+
+static int advance(struct Parser *ps) {
+    ps->prev_end = ps->tok.start + ps->tok.len;
+    return lex(&ps->lx, &ps->tok);
+}
+
+static int syntax_error(struct Parser *ps) {
+    const struct Token *t = &ps->tok;
+    if (t->type == TOK_EOF) return PARSE_INCOMPLETE;
+
+    char near[32];
+    if (t->type == TOK_NEWLINE) snprintf(near, sizeof(near), "newline");
+    else snprintf(near, sizeof(near), "%.*s", (int)(t->len < 20 ? t->len : 20), t->start);
+    if (ps->file) fprintf(stderr, "%s: line %d: syntax error near '%s'\n", ps->file, t->line, near);
+    else fprintf(stderr, "myshell: syntax error near '%s'\n", near);
+    return PARSE_ERROR;
+}
+
+// Words and redirections up to the next operator
+static int parse_command(struct Parser *ps, struct Command *c) {
+    struct Arena *a = ps->arena;
+    size_t args_cap = 0, redirs_cap = 0;
+    int rc;
+    memset(c, 0, sizeof(*c));
+
+    while (1) {
+        struct Token *t = &ps->tok;
+        if (t->type == TOK_WORD) {
+            if ((size_t)c->num_args + 1 >= args_cap) {
+                c->args = arena_grow(a, c->args, (size_t)c->num_args, &args_cap, sizeof(char *));
+            }
+            c->args[c->num_args++] = word_text(a, t);
+            if ((rc = advance(ps)) < 0) return rc;
+            continue;
+        }
+        if (t->type < TOK_IN || t->type > TOK_ERR_TO_OUT) break;
+
+        // A redirection
+        if ((size_t)c->num_redirs == redirs_cap) {
+            c->redirs = arena_grow(a, c->redirs, (size_t)c->num_redirs, &redirs_cap, sizeof(struct Redirect));
+        }
+        struct Redirect *r = &c->redirs[c->num_redirs++];
+        r->path = NULL;
+        r->dup_from = -1;
+        switch (t->type) {
+            case TOK_IN:         r->fd = 0; r->flags = O_RDONLY; break;
+            case TOK_OUT:        r->fd = 1; r->flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+            case TOK_APPEND:     r->fd = 1; r->flags = O_WRONLY | O_CREAT | O_APPEND; break;
+            case TOK_ERR_OUT:    r->fd = 2; r->flags = O_WRONLY | O_CREAT | O_TRUNC; break;
+            case TOK_ERR_APPEND: r->fd = 2; r->flags = O_WRONLY | O_CREAT | O_APPEND; break;
+            default:             r->fd = 2; r->flags = -1; r->dup_from = 1; break; // 2>&1
+        }
+        if ((rc = advance(ps)) < 0) return rc;
+        if (r->flags != -1) {
+            if (ps->tok.type != TOK_WORD) {
+                return syntax_error(ps);
+            }
+            r->path = word_text(a, &ps->tok);
+            if ((rc = advance(ps)) < 0) return rc;
+        }
+    }
+
+    if (c->num_args == 0) return syntax_error(ps);
+    c->args[c->num_args] = NULL; // Arguments list must be NULL terminated
+    return 0;
+}
+
+// Skips newlines after '|', '&&' or '||', which may not end the statement
+static int skip_newlines(struct Parser *ps) {
+    int rc;
+    while (ps->tok.type == TOK_NEWLINE) {
+        if ((rc = advance(ps)) < 0) return rc;
+    }
+    return ps->tok.type == TOK_EOF ? PARSE_INCOMPLETE : 0;
+}
+
+static int parse_pipeline(struct Parser *ps, struct Pipeline *p) {
+    size_t cap = 0;
+    int rc;
+    p->text = ps->tok.start;
+    while (1) {
+        if ((size_t)p->count == cap) {
+            p->cmds = arena_grow(ps->arena, p->cmds, (size_t)p->count, &cap, sizeof(struct Command));
         }
+        if ((rc = parse_command(ps, &p->cmds[p->count++])) < 0) return rc;
+        p->text_len = (size_t)(ps->prev_end - p->text);
+        if (ps->tok.type != TOK_PIPE) return 0;
+        if ((rc = advance(ps)) < 0 || (rc = skip_newlines(ps)) < 0) return rc;
+    }
+}
+
+// Parses the next statement into the arena. Returns 1 and sets *out, 0 at
+// the end of the input, or PARSE_ERROR / PARSE_INCOMPLETE.
+int parse_statement(struct Parser *ps, struct Pipeline **out) {
+    int rc;
+    *out = NULL;
+
+    // The terminator of the previous statement is only consumed now, so
+    // nothing past a statement is read before it has run
+    if (ps->pending_terminator) {
+        ps->pending_terminator = 0;
+        rc = advance(ps);
+        ps->stmt_start = ps->tok.start;
+        if (rc < 0) return rc;
+    }
+    while (ps->tok.type == TOK_NEWLINE) {
+        rc = advance(ps);
+        ps->stmt_start = ps->tok.start;
+        if (rc < 0) return rc;
+    }
+    if (ps->tok.type == TOK_EOF) return 0;
+
+    struct Pipeline *first = NULL, **link = &first;
+    int run_if = 0;
+    while (1) {
+        struct Pipeline *p = arena_alloc(ps->arena, sizeof(*p));
+        memset(p, 0, sizeof(*p));
+        p->run_if = run_if;
+        if ((rc = parse_pipeline(ps, p)) < 0) return rc;
+        *link = p;
+        link = &p->next;
+
+        if (ps->tok.type != TOK_AND_IF && ps->tok.type != TOK_OR_IF) break;
+        run_if = ps->tok.type;
+        if ((rc = advance(ps)) < 0 || (rc = skip_newlines(ps)) < 0) return rc;
+    }
+
+    switch (ps->tok.type) {
+        case TOK_AMP:
+            if (first->next) {
+                fprintf(stderr, "myshell: '&' after '&&' or '||' is not supported\n");
+                return PARSE_ERROR;
+            }
+            first->background = 1;
+            first->text_len = (size_t)(ps->tok.start + 1 - first->text);
+            ps->pending_terminator = 1;
+            break;
+        case TOK_SEMI:
+        case TOK_NEWLINE:
+            ps->pending_terminator = 1;
+            break;
+        case TOK_EOF:
+            break;
+        default:
+            return syntax_error(ps);
+    }
+    *out = first;
+    return 1;
+}
+
+// Runs the pipelines of a statement, honouring '&&' and '||'
+void execute_statement(struct Pipeline *p) {
+    for (; p; p = p->next) {
+        if (p->run_if == TOK_AND_IF && last_status != 0) continue;
+        if (p->run_if == TOK_OR_IF && last_status == 0) continue;
+
+        // Built-ins change the state of the shell itself, so they only make
+        // sense as a command on their own
+        if (p->count == 1 && p->background && run_builtin_background(p)) continue;
+        if (p->count == 1 && run_builtin(&p->cmds[0])) continue;
 
         // Execute external commands
-        execute_command(args);
+        execute_pipeline(p);
+    }
+}
+
+// --- Built-in commands ---
+
+// Built-ins run inside the shell, so they write through this buffer instead
+// of stdio: one write() per 8 KB however many 'echo's a script does, and
+// straight to whatever descriptor a redirection opened for them
+struct Output {
+    int fd;
+    int error;                 // A write failed; later output is dropped
+    int unbuffered;            // Flush after every call, like stderr
+    size_t len;
+    char buf[8192];
+};
+
+struct Output *bout, *berr;    // The running built-in's stdout and stderr
+
+struct Builtin {
+    const char *name;
+    int (*run)(char **args);
+};
+
+static const struct Builtin builtins[] = {
+    { "cd", builtin_cd },         { "exit", builtin_exit },   { "hash", builtin_hash },
+    { "jobs", builtin_jobs },     { "fg", builtin_fg_bg },    { "bg", builtin_fg_bg },
+    { "wait", builtin_wait },     { "echo", builtin_echo },   { "printf", builtin_printf },
+    { "pwd", builtin_pwd },       { "true", builtin_true },   { "false", builtin_false },
+    { "test", builtin_test },     { "[", builtin_test },      { "export", builtin_export },
+    { "bench", builtin_bench },   { "history", builtin_history },
+};
+
+void out_flush(struct Output *o) {
+    size_t done = 0;
+    while (done < o->len && !o->error) {
+        ssize_t n = write(o->fd, o->buf + done, o->len - done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) o->error = 1;
+        else done += (size_t)n;
+    }
+    o->len = 0;
+}
+
+void out_write(struct Output *o, const char *s, size_t n) {
+    while (n > 0) {
+        if (o->len == sizeof(o->buf)) out_flush(o);
+        size_t chunk = sizeof(o->buf) - o->len;
+        if (chunk > n) chunk = n;
+        memcpy(o->buf + o->len, s, chunk);
+        o->len += chunk;
+        s += chunk;
+        n -= chunk;
+    }
+    if (o->unbuffered) out_flush(o);
+}
+
+void out_printf(struct Output *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->len, sizeof(o->buf) - o->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(o->buf) - o->len) {
+        o->len += (size_t)n;
+        if (o->unbuffered) out_flush(o);
+        return;
     }
 
+    // Did not fit: format it on the side
+    char *tmp = malloc((size_t)n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tmp, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    out_write(o, tmp, (size_t)n);
+    free(tmp);
+}
+
+// Opens a built-in's redirections without touching the shell's own 0/1/2:
+// fds[] receives the descriptors it should use instead. Returns 0, or -1 if
+// a file could not be opened (already reported).
+static int builtin_redirect(struct Command *cmd, int fds[3], int *opened, int *num_opened) {
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        struct Redirect *r = &cmd->redirs[i];
+        if (r->flags == -1) {
+            fds[r->fd] = fds[r->dup_from];
+            continue;
+        }
+        int fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "myshell: %s: %s\n", r->path, strerror(errno));
+            return -1;
+        }
+        opened[(*num_opened)++] = fd;
+        fds[r->fd] = fd;
+    }
     return 0;
 }
 
-void read_command(char *cmd) {
-    if (fgets(cmd, MAX_CMD_LEN, stdin) == NULL) {
-        // Handle Ctrl+D (End of File)
-        printf("\n");
-        exit(0);
+static const struct Builtin *builtin_find(const char *name) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(name, builtins[i].name) == 0) return &builtins[i];
     }
-    // Remove the newline character at the end
-    cmd[strcspn(cmd, "\n")] = 0;
+    return NULL;
 }
 
-void parse_command(char *cmd, char **args) {
-    int i = 0;
-    // strtok splits the string by spaces
-    char *token = strtok(cmd, " ");
-    
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " ");
+// Returns 1 if the command was a built-in (and has been run)
+int run_builtin(struct Command *cmd) {
+    char **args = cmd->args;
+
+    if (strcmp(args[0], "parallel") == 0) {
+        // Opens its own redirections, since they are shared with its workers
+        last_status = builtin_parallel(cmd, STDIN_FILENO);
+        return 1;
+    }
+
+    const struct Builtin *b = builtin_find(args[0]);
+    if (b == NULL) return 0;
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    int *opened = malloc(sizeof(int) * (size_t)(cmd->num_redirs + 1)), num_opened = 0;
+    if (builtin_redirect(cmd, fds, opened, &num_opened) == 0) {
+        struct Output out = { .fd = fds[1] }, err = { .fd = fds[2], .unbuffered = 1 };
+        bout = &out;
+        berr = fds[2] == fds[1] ? &out : &err; // 2>&1 keeps the two in order
+        fflush(stdout); // The prompt and job messages still go through stdio
+
+        last_status = b->run(args);
+        out_flush(&out);
+        out_flush(&err);
+    } else {
+        last_status = 1;
     }
-    args[i] = NULL; // Arguments list must be NULL terminated
+    while (num_opened > 0) close(opened[--num_opened]);
+    free(opened);
+    return 1;
 }
 
-void execute_command(char **args) {
-    // 1. FORK: Create a new process
-    pid_t pid = fork();
+// 'builtin &': like sh, runs it in a forked copy of the shell, as a job.
+// Whatever it changes ('cd', 'export') changes only in that copy.
+// Returns 0 if the command is not a built-in.
+int run_builtin_background(struct Pipeline *p) {
+    struct Command *cmd = &p->cmds[0];
+    int parallel = strcmp(cmd->args[0], "parallel") == 0;
+    if (!parallel && builtin_find(cmd->args[0]) == NULL) return 0;
+    if (parallel) {
+        fprintf(stderr, "myshell: parallel: cannot run in the background\n");
+        last_status = 1;
+        return 1;
+    }
 
+    struct Job *j = job_new(p->text, p->text_len, 1);
+    if (j == NULL) {
+        fprintf(stderr, "myshell: too many jobs\n");
+        last_status = 1;
+        return 1;
+    }
+    fflush(stdout); // Or the child would print it again
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("myshell: fork");
+        job_free(j);
+        last_status = 1;
+        return 1;
+    }
     if (pid == 0) {
-        // --- CHILD PROCESS ---
-        // This code runs inside the new process.
-        // execvp replaces the current process image with the new program.
-        if (execvp(args[0], args) == -1) {
-            perror("myshell"); // Only prints if execvp fails
-        }
-        exit(EXIT_FAILURE); // Kill child if command failed
-    } else if (pid < 0) {
-        // Error forking
-        perror("myshell");
+        // Out of the terminal's way, with the job-control signals back to
+        // normal; SIGCHLD stays as it is, for the built-in's own children
+        if (interactive) setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+        if (!interactive) {
+            int devnull = open("/dev/null", O_RDONLY); // As for other background jobs
+            if (devnull > STDIN_FILENO) {
+                dup2(devnull, STDIN_FILENO);
+                close(devnull);
+            }
+        }
+        interactive = 0;
+        running_script = 1;
+        run_builtin(cmd);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (interactive) setpgid(pid, pid); // Whichever of us gets there first
+    j->pgid = interactive ? pid : 0;
+    j->pids[j->num_pids++] = pid;
+    j->running = 1;
+    j->id = job_next_id();
+    if (interactive) printf("[%d] %d\n", j->id, (int)pid);
+    last_status = 0;
+    return 1;
+}
+
+int builtin_exit(char **args) {
+    out_flush(bout);
+    if (!running_script) printf("Exiting shell...\n");
+    exit(args[1] ? atoi(args[1]) : last_status);
+}
+
+// Check for built-in command 'cd' (Change Directory)
+// We handle this manually because 'cd' changes the state of the parent process.
+int builtin_cd(char **args) {
+    if (args[1] == NULL) {
+        out_printf(berr, "myshell: expected argument to \"cd\"\n");
+        return 1;
+    }
+    if (chdir(args[1]) != 0) {
+        // Print error if directory doesn't exist
+        out_printf(berr, "myshell: cd: %s: %s\n", args[1], strerror(errno));
+        return 1;
+    }
+    // Keep $PWD right for the programs we start
+    char *cwd = getcwd(NULL, 0);
+    if (cwd) {
+        if (getenv("PWD")) setenv("OLDPWD", getenv("PWD"), 1);
+        setenv("PWD", cwd, 1);
+        free(cwd);
+    }
+    return 0;
+}
+
+int builtin_true(char **args) { (void)args; return 0; }
+int builtin_false(char **args) { (void)args; return 1; }
+
+int builtin_pwd(char **args) {
+    (void)args;
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        out_printf(berr, "myshell: pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    out_printf(bout, "%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// Writes the backslash escape at s (s[0] == '\\') and returns how many
+// characters it used. Octal is \0NNN for echo -e and printf %b, but \NNN in
+// a printf format. Sets *stop for \c (no further output).
+static size_t write_escape(struct Output *o, const char *s, int zero_octal, int *stop) {
+    const char *p = s + 1;
+    int c;
+    switch (*p) {
+        case 'a': c = '\a'; break;
+        case 'b': c = '\b'; break;
+        case 'e': c = 033; break;
+        case 'f': c = '\f'; break;
+        case 'n': c = '\n'; break;
+        case 'r': c = '\r'; break;
+        case 't': c = '\t'; break;
+        case 'v': c = '\v'; break;
+        case '\\': c = '\\'; break;
+        case 'c':
+            *stop = 1;
+            return 2;
+        case 'x': {
+            int n = 0;
+            c = 0;
+            for (p++; n < 2 && isxdigit((unsigned char)*p); n++, p++) {
+                c = c * 16 + (isdigit((unsigned char)*p) ? *p - '0' : (tolower((unsigned char)*p) - 'a' + 10));
+            }
+            if (n == 0) {
+                out_write(o, s, 2); // No digits: keep "\x"
+                return 2;
+            }
+            out_write(o, (char *)&c, 1);
+            return (size_t)(p - s);
+        }
+        default:
+            if (*p >= '0' && *p <= '7' && (!zero_octal || *p == '0')) {
+                if (zero_octal) p++;
+                c = 0;
+                for (int n = 0; n < 3 && *p >= '0' && *p <= '7'; n++, p++) c = c * 8 + (*p - '0');
+                char ch = (char)c;
+                out_write(o, &ch, 1);
+                return (size_t)(p - s);
+            }
+            // Not an escape: keep the backslash (a trailing one on its own)
+            out_write(o, s, *p ? 2 : 1);
+            return *p ? 2 : 1;
+    }
+    char ch = (char)c;
+    out_write(o, &ch, 1);
+    return 2;
+}
+
+// Writes s, expanding escapes; returns 1 if it ended with \c
+static int write_escaped(struct Output *o, const char *s, int zero_octal) {
+    int stop = 0;
+    while (*s && !stop) {
+        size_t plain = strcspn(s, "\\");
+        out_write(o, s, plain);
+        s += plain;
+        if (*s) s += write_escape(o, s, zero_octal, &stop);
+    }
+    return stop;
+}
+
+// echo [-neE] [arg...], as coreutils echo: -n drops the newline, -e turns on
+// backslash escapes, -E (the default) turns them off
+int builtin_echo(char **args) {
+    int newline = 1, escapes = 0, i = 1;
+    for (; args[i] && args[i][0] == '-' && args[i][1]; i++) {
+        const char *f = args[i] + 1;
+        if (f[strspn(f, "neE")] != '\0') break; // Not an option, just text
+        for (; *f; f++) {
+            if (*f == 'n') newline = 0;
+            else escapes = *f == 'e';
+        }
+    }
+
+    for (; args[i]; i++) {
+        if (escapes) {
+            if (write_escaped(bout, args[i], 1)) return 0; // \c: stop right here
+        } else {
+            out_write(bout, args[i], strlen(args[i]));
+        }
+        if (args[i + 1]) out_write(bout, " ", 1);
+    }
+    if (newline) out_write(bout, "\n", 1);
+    return 0;
+}
+
+// printf's numeric arguments: C-style integers (0x.., 0..), or 'c for the
+// code of character c. Sets *status to 1 if the argument is not a number.
+static intmax_t printf_int(const char *arg, int *status) {
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+    char *end;
+    errno = 0;
+    intmax_t v = strtoimax(arg, &end, 0);
+    if (end == arg || *end || errno) {
+        out_printf(berr, "myshell: printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    }
+    return v;
+}
+
+static double printf_double(const char *arg, int *status) {
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char)arg[1];
+    char *end;
+    double v = strtod(arg, &end);
+    if (end == arg || *end) {
+        out_printf(berr, "myshell: printf: '%s': expected a numeric value\n", arg);
+        *status = 1;
+    }
+    return v;
+}
+
+// printf format [argument...]: the format is reused until every argument
+// has been consumed, as in coreutils printf
+int builtin_printf(char **args) {
+    if (args[1] == NULL) {
+        out_printf(berr, "myshell: printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *fmt = args[1];
+    char **argv = args + 2;
+    int status = 0, stop = 0;
+
+    do {
+        char **round_start = argv;
+        for (const char *p = fmt; *p && !stop; ) {
+            size_t plain = strcspn(p, "\\%");
+            out_write(bout, p, plain);
+            p += plain;
+            if (*p == '\\') {
+                p += write_escape(bout, p, 0, &stop);
+                continue;
+            }
+            if (*p == '\0') break;
+            if (p[1] == '%') {
+                out_write(bout, "%", 1);
+                p += 2;
+                continue;
+            }
+
+            // %[flags][width][.precision]conversion; '*' takes an argument
+            char spec[64];
+            size_t n = 0;
+            spec[n++] = *p++;
+            while (*p && strchr("-+ #0", *p) && n < 20) spec[n++] = *p++;
+            for (int part = 0; part < 2; part++) {
+                if (*p == '*') {
+                    int v = (int)printf_int(*argv ? *argv++ : "0", &status);
+                    n += (size_t)snprintf(spec + n, sizeof(spec) - n, "%d", v);
+                    p++;
+                } else {
+                    while (isdigit((unsigned char)*p) && n < 40) spec[n++] = *p++;
+                }
+                if (part == 0 && *p == '.') spec[n++] = *p++;
+                else break;
+            }
+
+            char conv = *p ? *p++ : '\0';
+            const char *arg = *argv ? *argv++ : NULL;
+            switch (conv) {
+                case 'd': case 'i':
+                    memcpy(spec + n, "jd", 3);
+                    out_printf(bout, spec, arg ? printf_int(arg, &status) : 0);
+                    break;
+                case 'o': case 'u': case 'x': case 'X':
+                    spec[n++] = 'j';
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    out_printf(bout, spec, (uintmax_t)(arg ? printf_int(arg, &status) : 0));
+                    break;
+                case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+                    spec[n++] = conv;
+                    spec[n] = '\0';
+                    out_printf(bout, spec, arg ? printf_double(arg, &status) : 0.0);
+                    break;
+                case 'c':
+                    spec[n++] = 'c';
+                    spec[n] = '\0';
+                    if (arg == NULL || arg[0]) out_printf(bout, spec, arg ? arg[0] : '\0');
+                    break;
+                case 's':
+                    spec[n++] = 's';
+                    spec[n] = '\0';
+                    out_printf(bout, spec, arg ? arg : "");
+                    break;
+                case 'b':
+                    if (arg && write_escaped(bout, arg, 1)) stop = 1;
+                    break;
+                default:
+                    out_printf(berr, "myshell: printf: %%%c: invalid conversion specification\n", conv);
+                    return 1;
+            }
+        }
+        if (argv == round_start) break; // The format takes no arguments
+    } while (*argv && !stop);
+
+    return status;
+}
+
+// --- test / [ ---
+
+struct TestArgs {
+    char **argv;
+    int argc;
+    int pos;
+    int error;
+};
+
+static int test_or(struct TestArgs *t);
+
+static int test_is_binary(const char *op) {
+    static const char *ops[] = { "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                 "-gt", "-ge", "-nt", "-ot", "-ef", NULL };
+    for (int i = 0; ops[i]; i++) {
+        if (strcmp(op, ops[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static int test_is_unary(const char *op) {
+    return op[0] == '-' && op[1] && op[2] == '\0' && strchr("bcdefghLkprsStuwxOGnz", op[1]);
+}
+
+static intmax_t test_int(struct TestArgs *t, const char *s) {
+    char *end;
+    errno = 0;
+    while (isspace((unsigned char)*s)) s++;
+    intmax_t v = strtoimax(s, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == s || *end || errno) {
+        if (!t->error) out_printf(berr, "myshell: test: invalid integer '%s'\n", s);
+        t->error = 1;
+    }
+    return v;
+}
+
+static int test_unary(struct TestArgs *t, char op, const char *arg) {
+    struct stat st;
+    if (op == 'n') return arg[0] != '\0';
+    if (op == 'z') return arg[0] == '\0';
+    if (op == 't') return isatty((int)test_int(t, arg));
+    if (op == 'h' || op == 'L') return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    if (op == 'r') return access(arg, R_OK) == 0;
+    if (op == 'w') return access(arg, W_OK) == 0;
+    if (op == 'x') return access(arg, X_OK) == 0;
+    if (stat(arg, &st) != 0) return 0;
+    switch (op) {
+        case 'e': return 1;
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'g': return (st.st_mode & S_ISGID) != 0;
+        case 'u': return (st.st_mode & S_ISUID) != 0;
+        case 'k': return (st.st_mode & S_ISVTX) != 0;
+        case 'O': return st.st_uid == geteuid();
+        case 'G': return st.st_gid == getegid();
+    }
+    return 0;
+}
+
+static int test_binary(struct TestArgs *t, const char *a, const char *op, const char *b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0) {
+        struct stat sa, sb;
+        int ha = stat(a, &sa) == 0, hb = stat(b, &sb) == 0;
+        if (op[1] == 'e') return ha && hb && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (!ha || !hb) return op[1] == 'n' ? ha : hb; // An existing file is the newer one
+        int cmp = sa.st_mtim.tv_sec != sb.st_mtim.tv_sec
+                ? (sa.st_mtim.tv_sec > sb.st_mtim.tv_sec ? 1 : -1)
+                : (sa.st_mtim.tv_nsec > sb.st_mtim.tv_nsec) - (sa.st_mtim.tv_nsec < sb.st_mtim.tv_nsec);
+        return op[1] == 'n' ? cmp > 0 : cmp < 0;
+    }
+
+    intmax_t x = test_int(t, a), y = test_int(t, b);
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y; // -ge
+}
+
+static int test_primary(struct TestArgs *t) {
+    if (t->pos >= t->argc) {
+        if (!t->error) out_printf(berr, "myshell: test: argument expected\n");
+        t->error = 1;
+        return 0;
+    }
+    char *a = t->argv[t->pos];
+
+    if (strcmp(a, "(") == 0) {
+        t->pos++;
+        int v = test_or(t);
+        if (t->pos >= t->argc || strcmp(t->argv[t->pos], ")") != 0) {
+            if (!t->error) out_printf(berr, "myshell: test: ')' expected\n");
+            t->error = 1;
+        }
+        t->pos++;
+        return v;
+    }
+    if (t->pos + 2 < t->argc && test_is_binary(t->argv[t->pos + 1])) {
+        t->pos += 3;
+        return test_binary(t, a, t->argv[t->pos - 2], t->argv[t->pos - 1]);
+    }
+    if (test_is_unary(a) && t->pos + 1 < t->argc) {
+        t->pos += 2;
+        return test_unary(t, a[1], t->argv[t->pos - 1]);
+    }
+    t->pos++;
+    return a[0] != '\0'; // A lone string is true when it is not empty
+}
+
+static int test_not(struct TestArgs *t) {
+    if (t->pos < t->argc && strcmp(t->argv[t->pos], "!") == 0) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static int test_and(struct TestArgs *t) {
+    int v = test_not(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        v = test_not(t) && v;
+    }
+    return v;
+}
+
+static int test_or(struct TestArgs *t) {
+    int v = test_and(t);
+    while (t->pos < t->argc && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        v = test_and(t) || v;
+    }
+    return v;
+}
+
+// test expr / [ expr ]: exits 0 if true, 1 if false and 2 on a usage error
+int builtin_test(char **args) {
+    struct TestArgs t = { args + 1, 0, 0, 0 };
+    while (t.argv[t.argc]) t.argc++;
+    if (strcmp(args[0], "[") == 0) {
+        if (t.argc == 0 || strcmp(t.argv[t.argc - 1], "]") != 0) {
+            out_printf(berr, "myshell: [: missing ']'\n");
+            return 2;
+        }
+        t.argc--;
+    }
+
+    // POSIX fixes the meaning of up to three arguments by their count, which
+    // settles cases like 'test ! = x' and 'test -n' before the grammar does
+    int v;
+    if (t.argc == 0) {
+        return 1;
+    } else if (t.argc == 1) {
+        v = t.argv[0][0] != '\0';
+        t.pos = 1;
+    } else if (t.argc == 3 && test_is_binary(t.argv[1])) {
+        v = test_binary(&t, t.argv[0], t.argv[1], t.argv[2]);
+        t.pos = 3;
     } else {
-        // --- PARENT PROCESS ---
-        // We wait for the child to finish before showing the prompt again.
-        wait(NULL);
+        v = test_or(&t);
+    }
+
+    if (!t.error && t.pos < t.argc) {
+        out_printf(berr, "myshell: test: extra argument '%s'\n", t.argv[t.pos]);
+        t.error = 1;
+    }
+    return t.error ? 2 : !v;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// export [-p] [NAME[=value]...]: without names, lists the environment
+int builtin_export(char **args) {
+    int i = args[1] && strcmp(args[1], "-p") == 0 ? 2 : 1;
+
+    if (args[i] == NULL) {
+        size_t n = 0;
+        while (environ[n]) n++;
+        char **sorted = malloc(sizeof(char *) * (n + 1));
+        memcpy(sorted, environ, sizeof(char *) * n);
+        qsort(sorted, n, sizeof(char *), compare_strings);
+        for (size_t k = 0; k < n; k++) {
+            const char *eq = strchr(sorted[k], '=');
+            if (eq == NULL) continue;
+            out_printf(bout, "export %.*s='", (int)(eq - sorted[k]), sorted[k]);
+            for (const char *v = eq + 1; *v; v++) {
+                if (*v == '\'') out_write(bout, "'\\''", 4);
+                else out_write(bout, v, 1);
+            }
+            out_write(bout, "'\n", 2);
+        }
+        free(sorted);
+        return 0;
+    }
+
+    int status = 0;
+    for (; args[i]; i++) {
+        char *eq = strchr(args[i], '=');
+        size_t name_len = eq ? (size_t)(eq - args[i]) : strlen(args[i]);
+        int valid = name_len > 0 && !isdigit((unsigned char)args[i][0]);
+        for (size_t k = 0; k < name_len; k++) {
+            if (!isalnum((unsigned char)args[i][k]) && args[i][k] != '_') valid = 0;
+        }
+        if (!valid) {
+            out_printf(berr, "myshell: export: '%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        // We have no unexported variables, so a bare NAME has nothing to do
+        if (eq) {
+            *eq = '\0';
+            setenv(args[i], eq + 1, 1);
+            *eq = '=';
+        }
+    }
+    return status;
+}
+
+// --- Command path cache ---
+
+static unsigned path_hash(const char *s) {
+    unsigned h = 2166136261u; // FNV-1a
+    while (*s) h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h % PATH_BUCKETS;
+}
+
+// Returns the link pointing at the entry for 'name' (or at the chain's NULL)
+static struct PathEntry **path_find(const char *name) {
+    struct PathEntry **link = &path_cache[path_hash(name)];
+    while (*link && strcmp((*link)->name, name) != 0) link = &(*link)->next;
+    return link;
+}
+
+void path_cache_clear(void) {
+    for (int i = 0; i < PATH_BUCKETS; i++) {
+        while (path_cache[i]) {
+            struct PathEntry *e = path_cache[i];
+            path_cache[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+void path_forget(const char *name) {
+    struct PathEntry **link = path_find(name);
+    struct PathEntry *e = *link;
+    if (e) {
+        *link = e->next;
+        free(e->name);
+        free(e->path);
+        free(e);
+    }
+}
+
+// Walks PATH the way execvp() would. Returns 1 and fills 'buf' on success;
+// '*relative' says whether the directory was relative (e.g. "." or empty),
+// in which case the answer depends on the working directory.
+static int path_search(const char *name, const char *path_env, char *buf, size_t size, int *relative) {
+    const char *dir = path_env;
+    while (1) {
+        size_t dir_len = strcspn(dir, ":");
+        struct stat st;
+        int n = dir_len ? snprintf(buf, size, "%.*s/%s", (int)dir_len, dir, name)
+                        : snprintf(buf, size, "./%s", name); // Empty entry means '.'
+        if (n > 0 && (size_t)n < size && stat(buf, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(buf, X_OK) == 0) {
+            *relative = buf[0] != '/';
+            return 1;
+        }
+        if (dir[dir_len] == '\0') return 0;
+        dir += dir_len + 1;
+    }
+}
+
+// Absolute path for a command name without a '/', or NULL if it is not on
+// PATH. The pointer stays valid until the entry is forgotten.
+const char *path_lookup(const char *name) {
+    const char *path_env = getenv("PATH");
+    if (path_env == NULL) path_env = "/bin:/usr/bin"; // execvp()'s default
+
+    // Every answer depends on PATH, so throw them all away when it changes
+    if (path_cache_env == NULL || strcmp(path_cache_env, path_env) != 0) {
+        path_cache_clear();
+        free(path_cache_env);
+        path_cache_env = strdup(path_env);
+    }
+
+    struct PathEntry **link = path_find(name);
+    if (*link) {
+        (*link)->hits++;
+        return (*link)->path;
+    }
+
+    static char found[4096];
+    int relative;
+    if (!path_search(name, path_env, found, sizeof(found), &relative)) return NULL;
+    if (relative) return found; // Not cached: it changes with 'cd'
+
+    struct PathEntry *e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = strdup(found);
+    e->hits = 1;
+    e->next = NULL;
+    *link = e;
+    return e->path;
+}
+
+// hash          list the cache
+// hash -r       forget everything
+// hash -d name  forget one command
+// hash name...  look commands up now
+int builtin_hash(char **args) {
+    if (args[1] == NULL) {
+        int empty = 1;
+        for (int i = 0; i < PATH_BUCKETS; i++) {
+            for (struct PathEntry *e = path_cache[i]; e; e = e->next) {
+                if (empty) out_printf(bout, "hits\tcommand\n");
+                out_printf(bout, "%4d\t%s\n", e->hits, e->path);
+                empty = 0;
+            }
+        }
+        if (empty) out_printf(bout, "hash: hash table empty\n");
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        path_cache_clear();
+        return 0;
+    }
+
+    int status = 0;
+    int forget = strcmp(args[1], "-d") == 0;
+    for (int i = forget ? 2 : 1; args[i]; i++) {
+        if (strchr(args[i], '/')) continue; // Never looked up, so never cached
+        if (forget) {
+            if (*path_find(args[i]) == NULL) {
+                out_printf(berr, "myshell: hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+            path_forget(args[i]);
+        } else if (path_lookup(args[i]) == NULL) {
+            out_printf(berr, "myshell: hash: %s: not found\n", args[i]);
+            status = 1;
+        } else {
+            // Looking up is not a use. (Found through a relative PATH entry,
+            // the command was not cached at all.)
+            struct PathEntry *e = *path_find(args[i]);
+            if (e != NULL) e->hits--;
+        }
+    }
+    return status;
+}
+
+// Starts one command with its stdin/stdout connected to in_fd/out_fd, then
+// applies its own redirections in order (so '> f 2>&1' sends both to f, but
+// '2>&1 > f' leaves stderr on the old stdout, as in sh).
+// pgid: -1 to stay in our process group, 0 to start a new one, or the group
+// to join; take_tty makes that group the terminal's foreground group.
+// Returns the child's pid, or -1 if it could not be started.
+pid_t spawn_command(struct Command *cmd, int in_fd, int out_fd, pid_t pgid, int take_tty) {
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+
+    // Children start with nothing blocked and default signal handling, even
+    // though we block SIGCHLD and ignore the job-control signals
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t none, defaults;
+    sigemptyset(&none);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if (pgid != -1) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+        flags |= POSIX_SPAWN_SETPGROUP;
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+        // Take the terminal before exec, or a program that reads it at once
+        // would be stopped with SIGTTIN before we get to tcsetpgrp() below
+        if (take_tty) posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+    }
+    posix_spawnattr_setflags(&attr, flags);
+
+    // The pipe ends carry O_CLOEXEC, so only the dup2() copies reach the program
+    if (in_fd != STDIN_FILENO) posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != STDOUT_FILENO) posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+
+    // Files are opened here rather than by the child, so a failure can name
+    // the file; the child only dup2()s them into place, in order
+    int *opened = malloc(sizeof(int) * (size_t)(cmd->num_redirs + 1)), num_opened = 0;
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        struct Redirect *r = &cmd->redirs[i];
+        if (r->flags == -1) {
+            posix_spawn_file_actions_adddup2(&actions, r->dup_from, r->fd);
+            continue;
+        }
+        int fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            fprintf(stderr, "myshell: %s: %s\n", r->path, strerror(errno));
+            while (num_opened > 0) close(opened[--num_opened]);
+            free(opened);
+            posix_spawn_file_actions_destroy(&actions);
+            posix_spawnattr_destroy(&attr);
+            return -1;
+        }
+        opened[num_opened++] = fd;
+        posix_spawn_file_actions_adddup2(&actions, fd, r->fd);
+    }
+
+    // glibc's posix_spawn uses clone(CLONE_VM | CLONE_VFORK): the child runs
+    // on our address space until exec, so no page tables are copied, and a
+    // failed exec is reported back here as the return value.
+    // Names without a '/' come from the path cache rather than posix_spawnp(),
+    // which would try execve() in each PATH directory every time.
+    pid_t pid;
+    const char *name = cmd->args[0];
+    const char *path = strchr(name, '/') ? name : path_lookup(name);
+    int err = path ? posix_spawn(&pid, path, &actions, &attr, cmd->args, environ) : ENOENT;
+
+    // The cached binary may have been removed or moved since; look again once
+    if (err == ENOENT && path && path != name && access(path, X_OK) != 0) {
+        path_forget(name);
+        path = path_lookup(name);
+        err = path ? posix_spawn(&pid, path, &actions, &attr, cmd->args, environ) : ENOENT;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    while (num_opened > 0) close(opened[--num_opened]);
+    free(opened);
+
+    if (path == NULL) {
+        fprintf(stderr, "myshell: %s: command not found\n", name);
+        return -1;
+    }
+    if (err != 0) {
+        fprintf(stderr, "myshell: %s: %s\n", name, strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+void execute_pipeline(struct Pipeline *p) {
+    // 'cmd | parallel ...' runs parallel here in the shell, reading the pipe
+    struct Command *tail = &p->cmds[p->count - 1];
+    int in_shell = strcmp(tail->args[0], "parallel") == 0;
+    if (in_shell && p->background) {
+        fprintf(stderr, "myshell: parallel: cannot run in the background\n");
+        last_status = 1;
+        return;
+    }
+    // It needs the shell's job table, so it cannot be a stage of its own
+    for (int i = 0; i < p->count - 1; i++) {
+        if (strcmp(p->cmds[i].args[0], "parallel") != 0) continue;
+        fprintf(stderr, "myshell: parallel: must be the last command of a pipeline\n");
+        last_status = 1;
+        return;
+    }
+
+    struct Job *j = job_new(p->text, p->text_len, p->count);
+    if (j == NULL) {
+        fprintf(stderr, "myshell: too many jobs\n");
+        last_status = 1;
+        return;
+    }
+
+    // With job control each pipeline gets its own process group, so Ctrl-C
+    // and Ctrl-Z only reach the job that has the terminal
+    pid_t pgid = interactive && !in_shell ? 0 : -1;
+    int in_fd = STDIN_FILENO;
+    if (p->background && !interactive) {
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC); // As sh does without job control
+    }
+
+    // 1. SPAWN every command, each reading from the previous one's pipe
+    fflush(stdout); // Anything our built-ins printed must come out first
+    int last_failed = 0;
+    for (int i = 0; i < p->count - in_shell; i++) {
+        int pipefd[2] = { -1, STDOUT_FILENO };
+        if (i < p->count - 1 && pipe2(pipefd, O_CLOEXEC) == -1) {
+            perror("myshell");
+            break;
+        }
+
+        pid_t pid = spawn_command(&p->cmds[i], in_fd, pipefd[1], pgid, pgid == 0 && !p->background);
+        last_failed = pid == -1;
+        if (pid != -1) {
+            j->pids[j->num_pids++] = pid;
+            j->running++;
+            if (pgid == 0) pgid = j->pgid = pid; // The rest join the first one's group
+        }
+
+        // The children have their copies now; ours must be closed or the
+        // reader would never see end-of-file
+        if (in_fd != STDIN_FILENO) close(in_fd);
+        if (pipefd[1] != STDOUT_FILENO) close(pipefd[1]);
+        in_fd = pipefd[0];
+    }
+
+    if (in_shell) {
+        last_status = builtin_parallel(tail, in_fd);
+    } else if (last_failed) {
+        last_status = 127;
+    }
+    if (in_fd != STDIN_FILENO && in_fd != -1) close(in_fd);
+
+    if (j->num_pids == 0) {
+        job_free(j);
+        return;
+    }
+    if (p->background) {
+        j->id = job_next_id();
+        if (interactive) printf("[%d] %d\n", j->id, (int)j->pids[j->num_pids - 1]);
+        last_status = 0;
+        return;
+    }
+
+    // 2. WAIT for all of them; the pipeline's status is the last command's
+    int status = last_status;
+    job_foreground(j);
+    if (in_shell || last_failed) last_status = status;
+}
+
+// --- Jobs ---
+
+static void on_sigchld(int sig) { (void)sig; } // Only needs to end sigsuspend()
+static void on_sigint(int sig) { (void)sig; interrupted = 1; }
+
+// allow_tty is 0 for scripts, which never use job control
+void job_control_init(int allow_tty) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_flags = SA_RESTART;
+    sa.sa_handler = on_sigchld;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // SIGCHLD stays blocked except while we sleep in sigsuspend(), so the job
+    // table only changes from normal code and no exit can slip in between
+    // checking a job and going to sleep
+    sigset_t block;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &wait_mask);
+    sigdelset(&wait_mask, SIGCHLD);
+
+    interactive = allow_tty && isatty(STDIN_FILENO);
+    if (!interactive) return;
+
+    // Wait until we are in the foreground, then lead our own process group
+    while (tcgetpgrp(STDIN_FILENO) != getpgrp()) kill(0, SIGTTIN);
+    sa.sa_handler = on_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0);
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+}
+
+// A free job slot with room for num_pids processes, or NULL if the table is full
+struct Job *job_new(const char *cmdline, size_t len, int num_pids) {
+    // A script keeps finished jobs for 'wait'; when the table is full, the
+    // oldest of them makes room
+    int full = 1;
+    for (int i = 0; i < MAX_JOBS; i++) full &= jobs[i].used;
+    struct Job *oldest = NULL;
+    for (int i = 0; i < MAX_JOBS && full && !interactive; i++) {
+        struct Job *j = &jobs[i];
+        if (j->id != 0 && j->running == 0 && (oldest == NULL || j->id < oldest->id)) oldest = j;
+    }
+    if (oldest != NULL) job_free(oldest);
+
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct Job *j = &jobs[i];
+        if (j->used) continue;
+        memset(j, 0, sizeof(*j));
+        j->used = 1;
+        j->cmdline = strndup(cmdline, len);
+        j->pids = calloc((size_t)num_pids, sizeof(pid_t));
+        j->stopped = calloc((size_t)num_pids, 1);
+        return j;
+    }
+    return NULL;
+}
+
+void job_free(struct Job *j) {
+    free(j->cmdline);
+    free(j->pids);
+    free(j->stopped);
+    memset(j, 0, sizeof(*j));
+}
+
+static void job_update(pid_t pid, int wstatus) {
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct Job *j = &jobs[i];
+        for (int k = 0; j->used && k < j->num_pids; k++) {
+            if (j->pids[k] != pid) continue;
+
+            if (WIFSTOPPED(wstatus)) {
+                if (!j->stopped[k]) j->num_stopped++;
+                j->stopped[k] = 1;
+            } else if (WIFCONTINUED(wstatus)) {
+                if (j->stopped[k]) j->num_stopped--;
+                j->stopped[k] = 0;
+                return;
+            } else {
+                if (j->stopped[k]) j->num_stopped--; // Killed while stopped
+                j->stopped[k] = 0;
+                j->pids[k] = 0;
+                j->running--;
+                if (k == j->num_pids - 1) j->wstatus = wstatus;
+            }
+            j->notify = 1;
+            return;
+        }
+    }
+}
+
+// Collects every child that has exited, stopped or continued
+void reap_children(void) {
+    int wstatus;
+    pid_t pid;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        job_update(pid, wstatus);
+    }
+}
+
+static int job_is_stopped(const struct Job *j) {
+    return j->running > 0 && j->num_stopped == j->running;
+}
+
+// Sleeps until the job exits or stops (or until Ctrl-C, if asked to)
+static void job_wait(struct Job *j, int until_interrupt) {
+    while (1) {
+        reap_children();
+        if (j->running == 0 || job_is_stopped(j)) return;
+        if (until_interrupt && interrupted) return;
+        sigsuspend(&wait_mask);
+    }
+}
+
+static int wait_status_code(int wstatus) {
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+
+// "Done", "Exit 2", "Terminated", ... for a finished job
+static const char *job_result(const struct Job *j, char *buf, size_t size) {
+    if (WIFSIGNALED(j->wstatus)) return strsignal(WTERMSIG(j->wstatus));
+    if (WEXITSTATUS(j->wstatus) == 0) return "Done";
+    snprintf(buf, size, "Exit %d", WEXITSTATUS(j->wstatus));
+    return buf;
+}
+
+int job_next_id(void) {
+    int id = 0;
+    for (int i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i].used && jobs[i].id > id) id = jobs[i].id;
+    }
+    return id + 1;
+}
+
+// Runs a job in the foreground: hands it the terminal, waits for it to exit
+// or stop, then takes the terminal back
+void job_foreground(struct Job *j) {
+    if (interactive && j->pgid) tcsetpgrp(STDIN_FILENO, j->pgid);
+    job_wait(j, 0);
+    if (interactive && j->pgid) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (job_is_stopped(j)) {
+        // Ctrl-Z: it becomes a job the user can 'fg' or 'bg'
+        if (j->id == 0) j->id = job_next_id();
+        j->notify = 0;
+        printf("\n[%d]  Stopped    %s\n", j->id, j->cmdline);
+        last_status = 128 + SIGTSTP;
+        return;
+    }
+
+    if (WIFSIGNALED(j->wstatus) && WTERMSIG(j->wstatus) == SIGINT) {
+        if (interactive) printf("\n"); // Start the prompt on a fresh line after ^C
+    } else if (WIFSIGNALED(j->wstatus) && WTERMSIG(j->wstatus) != SIGPIPE) {
+        fprintf(stderr, "%s\n", strsignal(WTERMSIG(j->wstatus))); // e.g. "Segmentation fault"
+    }
+    last_status = wait_status_code(j->wstatus);
+    job_free(j);
+}
+
+// Reports background jobs that finished or stopped since the last prompt
+void job_notify(void) {
+    char buf[32];
+    reap_children();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct Job *j = &jobs[i];
+        if (!j->used || j->id == 0 || !j->notify) continue;
+        // Without a prompt to report them, finished jobs wait for 'wait'
+        if (j->running == 0 && !interactive) continue;
+        j->notify = 0;
+        if (j->running == 0) {
+            printf("[%d]  %-10s %s\n", j->id, job_result(j, buf, sizeof(buf)), j->cmdline);
+            job_free(j);
+        } else if (job_is_stopped(j) && interactive) {
+            printf("[%d]  %-10s %s\n", j->id, "Stopped", j->cmdline);
+        }
+    }
+}
+
+// "%n" or "n" names job n; with 'allow_pid', a bare number is a process id
+// (as for 'wait'). No spec means the most recent job.
+static struct Job *job_from_spec(const char *spec, const char *builtin, int allow_pid) {
+    struct Job *found = NULL;
+    if (spec == NULL) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i].used && jobs[i].id && (found == NULL || jobs[i].id > found->id)) found = &jobs[i];
+        }
+        if (found == NULL) out_printf(berr, "myshell: %s: no current job\n", builtin);
+        return found;
+    }
+
+    int by_pid = allow_pid && spec[0] != '%';
+    int n = atoi(spec[0] == '%' ? spec + 1 : spec);
+    for (int i = 0; i < MAX_JOBS && found == NULL; i++) {
+        struct Job *j = &jobs[i];
+        if (!j->used || j->id == 0) continue;
+        if (!by_pid && j->id == n) found = j;
+        for (int k = 0; by_pid && k < j->num_pids; k++) {
+            if (j->pids[k] == n) found = j;
+        }
+    }
+    if (found == NULL) out_printf(berr, "myshell: %s: %s: no such job\n", builtin, spec);
+    return found;
+}
+
+int builtin_jobs(char **args) {
+    char buf[32];
+    (void)args;
+    reap_children();
+    for (int i = 0; i < MAX_JOBS; i++) {
+        struct Job *j = &jobs[i];
+        if (!j->used || j->id == 0) continue;
+        const char *state = j->running == 0 ? job_result(j, buf, sizeof(buf))
+                          : job_is_stopped(j) ? "Stopped" : "Running";
+        out_printf(bout, "[%d]  %-10s %s\n", j->id, state, j->cmdline);
+        j->notify = 0;
+        if (j->running == 0) job_free(j); // Reported now, so not again at the prompt
+    }
+    return 0;
+}
+
+// fg [job] / bg [job]: continue a stopped job in the foreground or background
+int builtin_fg_bg(char **args) {
+    int fg = strcmp(args[0], "fg") == 0;
+    if (!interactive) {
+        out_printf(berr, "myshell: %s: no job control\n", args[0]);
+        return 1;
+    }
+    struct Job *j = job_from_spec(args[1], args[0], 0);
+    if (j == NULL) return 1;
+
+    if (fg) out_printf(bout, "%s\n", j->cmdline);
+    else out_printf(bout, "[%d]  %s\n", j->id, j->cmdline);
+    out_flush(bout); // Before the job gets to write anything
+
+    // Clear the stopped marks now: the WCONTINUED reports arrive later, and
+    // until then job_wait() would think the job was still stopped
+    for (int k = 0; k < j->num_pids; k++) j->stopped[k] = 0;
+    j->num_stopped = 0;
+    if (j->pgid) {
+        if (fg) tcsetpgrp(STDIN_FILENO, j->pgid);
+        kill(-j->pgid, SIGCONT);
+    } else {
+        for (int k = 0; k < j->num_pids; k++) {
+            if (j->pids[k]) kill(j->pids[k], SIGCONT);
+        }
+    }
+
+    if (!fg) return 0;
+    job_foreground(j);
+    return last_status;
+}
+
+// wait [job|pid]...: with no arguments, waits for every running background job
+int builtin_wait(char **args) {
+    int status = 0;
+    interrupted = 0;
+
+    if (args[1] == NULL) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            struct Job *j = &jobs[i];
+            if (!j->used || j->id == 0 || job_is_stopped(j)) continue;
+            job_wait(j, 1);
+            if (interrupted) {
+                out_write(bout, "\n", 1);
+                return 130;
+            }
+            if (j->running == 0) job_free(j);
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i]; i++) {
+        struct Job *j = job_from_spec(args[i], "wait", 1);
+        if (j == NULL) {
+            status = 127;
+            continue;
+        }
+        job_wait(j, 1);
+        if (interrupted) {
+            out_write(bout, "\n", 1);
+            return 130;
+        }
+        if (j->running == 0) {
+            status = wait_status_code(j->wstatus);
+            job_free(j);
+        }
+    }
+    return status;
+}
+
+// --- parallel ---
+
+// Copy of 'arg' with every "{}" replaced by 'line'
+static char *replace_braces(const char *arg, const char *line) {
+    size_t line_len = strlen(line), len = 0;
+    for (const char *p = arg; (p = strstr(p, "{}")); p += 2) len += line_len;
+    char *out = malloc(strlen(arg) + len + 1), *o = out;
+    while (*arg) {
+        if (arg[0] == '{' && arg[1] == '}') {
+            memcpy(o, line, line_len);
+            o += line_len;
+            arg += 2;
+        } else {
+            *o++ = *arg++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+// Frees the workers that have finished. Returns how many of them failed and
+// sets '*stop' if one was killed by Ctrl-C.
+static int parallel_collect(struct Job **workers, int *active, int *stop) {
+    int failed = 0;
+    reap_children();
+    for (int i = 0; i < *active; ) {
+        struct Job *j = workers[i];
+        if (j->running > 0) {
+            i++;
+            continue;
+        }
+        if (wait_status_code(j->wstatus) != 0) failed++;
+        if (WIFSIGNALED(j->wstatus) && WTERMSIG(j->wstatus) == SIGINT) *stop = 1;
+        job_free(j);
+        workers[i] = workers[--*active];
+    }
+    if (interrupted) *stop = 1;
+    return failed;
+}
+
+// parallel [-j N] command [arg...]
+// Runs 'command' once for every line of input, at most N at a time (default:
+// one per CPU). "{}" in an argument is replaced by the line; without any
+// "{}", the line is added as the last argument. Exits with the number of
+// failed commands (at most 101), like GNU parallel.
+int builtin_parallel(struct Command *cmd, int in_fd) {
+    char **args = cmd->args;
+    int max_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int first = 1;
+    if (args[1] && strcmp(args[1], "-j") == 0 && args[2]) {
+        max_workers = atoi(args[2]);
+        first = 3;
+    } else if (args[1] && strncmp(args[1], "-j", 2) == 0) {
+        max_workers = atoi(args[1] + 2);
+        first = 2;
+    }
+    if (args[first] == NULL || max_workers <= 0) {
+        fprintf(stderr, "myshell: usage: parallel [-j N] command [arg...]\n");
+        return 2;
+    }
+    if (max_workers > MAX_JOBS / 2) max_workers = MAX_JOBS / 2; // Leave room for the user's jobs
+
+    // Our own redirections are opened once here and shared by every worker
+    int out_fd = STDOUT_FILENO, err_fd = STDERR_FILENO;
+    int *opened = malloc(sizeof(int) * (size_t)(cmd->num_redirs + 1)), num_opened = 0;
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        struct Redirect *r = &cmd->redirs[i];
+        int fd = out_fd; // 2>&1
+        if (r->flags != -1) {
+            fd = open(r->path, r->flags | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                fprintf(stderr, "myshell: %s: %s\n", r->path, strerror(errno));
+                while (num_opened > 0) close(opened[--num_opened]);
+                free(opened);
+                return 1;
+            }
+            opened[num_opened++] = fd;
+        }
+        if (r->fd == 0) in_fd = fd;
+        else if (r->fd == 1) out_fd = fd;
+        else err_fd = fd;
+    }
+
+    int has_braces = 0, num_template = 0;
+    for (int i = first; args[i]; i++, num_template++) {
+        if (strstr(args[i], "{}")) has_braces = 1;
+    }
+    char **worker_args = malloc(sizeof(char *) * (size_t)(num_template + 2));
+    struct Redirect err_redirect = { 2, -1, err_fd, NULL };
+
+    FILE *input = in_fd == STDIN_FILENO ? stdin : fdopen(dup(in_fd), "r");
+    int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC); // Workers must not eat our input
+    struct Job *workers[MAX_JOBS];
+    int active = 0, failures = 0, stop = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    interrupted = 0;
+
+    while (!stop && (len = getline(&line, &cap, input)) != -1) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+
+        // Wait for a free worker
+        while (1) {
+            failures += parallel_collect(workers, &active, &stop);
+            if (active < max_workers || stop) break;
+            sigsuspend(&wait_mask);
+        }
+        if (stop) break;
+
+        struct Job *j = job_new(line, (size_t)len, 1);
+        if (j == NULL) {
+            // The user's own jobs fill the table; finish the workers we have
+            fprintf(stderr, "myshell: too many jobs\n");
+            failures++;
+            break;
+        }
+
+        struct Command worker;
+        int n = 0;
+        worker.args = worker_args;
+        for (int i = first; args[i]; i++) {
+            worker.args[n++] = strstr(args[i], "{}") ? replace_braces(args[i], line) : args[i];
+        }
+        if (!has_braces) worker.args[n++] = line;
+        worker.args[n] = NULL;
+        worker.num_args = n;
+        worker.redirs = &err_redirect;
+        worker.num_redirs = err_fd != STDERR_FILENO;
+
+        pid_t pid = spawn_command(&worker, devnull, out_fd, -1, 0);
+        for (int i = first, k = 0; args[i] && k < n; i++, k++) {
+            if (worker.args[k] != args[i]) free(worker.args[k]);
+        }
+        if (pid == -1) {
+            failures++;
+            job_free(j);
+            continue;
+        }
+        j->pids[j->num_pids++] = pid;
+        j->running = 1;
+        workers[active++] = j;
+    }
+
+    // Let the rest finish
+    while (active > 0) {
+        failures += parallel_collect(workers, &active, &stop);
+        if (active > 0) sigsuspend(&wait_mask);
+    }
+
+    free(line);
+    free(worker_args);
+    if (input == stdin) clearerr(stdin); // Ctrl-D ended our input, not the shell's
+    else fclose(input);
+    close(devnull);
+    while (num_opened > 0) close(opened[--num_opened]);
+    free(opened);
+
+    if (interrupted) {
+        printf("\n");
+        return 130;
+    }
+    return failures > 101 ? 101 : failures;
+}
+
+// --- bench ---
+
+enum { BENCH_WALL, BENCH_USER, BENCH_SYS, BENCH_RSS, BENCH_VCSW, BENCH_IVCSW, BENCH_METRICS };
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Square root by Newton's method, so the shell still builds without -lm
+static double bench_sqrt(double x) {
+    if (x <= 0) return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 64; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) break; // Converged: it only decreases until then
+        r = next;
+    }
+    return r;
+}
+
+static double bench_abs(double x) { return x < 0 ? -x : x; }
+
+// Median of n values (sorts a copy)
+static double median_of(const double *v, int n, double *scratch) {
+    memcpy(scratch, v, sizeof(double) * (size_t)n);
+    qsort(scratch, (size_t)n, sizeof(double), compare_doubles);
+    return n % 2 ? scratch[n / 2] : (scratch[n / 2 - 1] + scratch[n / 2]) / 2;
+}
+
+// Runs the command once with its output thrown away. Fills m[] from the
+// child's rusage; returns its wait status, or -1 if it did not start.
+static int bench_run(struct Command *cmd, int devnull, double m[BENCH_METRICS]) {
+    struct timespec t0, t1;
+    struct rusage ru;
+    int wstatus;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = spawn_command(cmd, STDIN_FILENO, devnull, -1, 0);
+    if (pid == -1) return -1;
+    // Waiting for this pid only: reap_children() is not called meanwhile, so
+    // nothing else can collect it
+    while (wait4(pid, &wstatus, 0, &ru) == -1 && errno == EINTR) {}
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    m[BENCH_WALL] = (double)(t1.tv_sec - t0.tv_sec) * 1e3 + (double)(t1.tv_nsec - t0.tv_nsec) / 1e6;
+    m[BENCH_USER] = (double)ru.ru_utime.tv_sec * 1e3 + (double)ru.ru_utime.tv_usec / 1e3;
+    m[BENCH_SYS] = (double)ru.ru_stime.tv_sec * 1e3 + (double)ru.ru_stime.tv_usec / 1e3;
+    m[BENCH_RSS] = (double)ru.ru_maxrss;
+    m[BENCH_VCSW] = (double)ru.ru_nvcsw;
+    m[BENCH_IVCSW] = (double)ru.ru_nivcsw;
+    return wstatus;
+}
+
+// bench [-n runs] [-w warmup] command [arg...]
+// Runs a program repeatedly (its stdout goes to /dev/null) and reports
+// statistics for wall time and the rusage of each run. Runs whose wall time
+// has a modified z-score above 3.5 (Iglewicz and Hoaglin) are listed as
+// outliers: the median and MAD are not pulled around by the outliers
+// themselves the way the mean and stddev are.
+int builtin_bench(char **args) {
+    static const char *names[BENCH_METRICS] = { "wall", "user", "sys", "max rss", "vol cs", "invol cs" };
+    static const char *units[BENCH_METRICS] = { "ms", "ms", "ms", "KB", "", "" };
+    int runs = 10, warmup = 1, i = 1;
+
+    for (; args[i] && args[i][0] == '-'; i += 2) {
+        if (args[i + 1] == NULL) break;
+        if (strcmp(args[i], "-n") == 0) runs = atoi(args[i + 1]);
+        else if (strcmp(args[i], "-w") == 0) warmup = atoi(args[i + 1]);
+        else break;
+    }
+    if (args[i] == NULL || args[i][0] == '-' || runs < 1 || warmup < 0) {
+        out_printf(berr, "myshell: usage: bench [-n runs] [-w warmup] command [arg...]\n");
+        return 2;
+    }
+
+    struct Command cmd = { .args = args + i };
+    while (cmd.args[cmd.num_args]) cmd.num_args++;
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    double (*samples)[BENCH_METRICS] = malloc(sizeof(*samples) * (size_t)runs);
+    double *column = malloc(sizeof(double) * (size_t)runs * 2), *scratch = column + runs;
+    int status = 0, done = 0;
+    interrupted = 0;
+
+    for (int r = 0; r < warmup + runs && !interrupted; r++) {
+        double m[BENCH_METRICS];
+        int wstatus = bench_run(&cmd, devnull, m);
+        if (wstatus == -1 || wait_status_code(wstatus) != 0) {
+            status = wstatus == -1 ? 127 : wait_status_code(wstatus);
+            if (wstatus != -1) out_printf(berr, "myshell: bench: '%s' failed with status %d\n", cmd.args[0], status);
+            break;
+        }
+        if (r >= warmup) memcpy(samples[done++], m, sizeof(m));
+    }
+    close(devnull);
+
+    if (done > 0 && status == 0) {
+        out_printf(bout, "%d runs of '", done);
+        for (int a = 0; a < cmd.num_args; a++) out_printf(bout, "%s%s", a ? " " : "", cmd.args[a]);
+        out_printf(bout, "' (%d warmup)\n\n", warmup);
+        out_printf(bout, "%-9s %12s %12s %12s %12s %12s\n", "", "mean", "stddev", "median", "min", "max");
+        double wall_median = 0, wall_mad = 0;
+
+        for (int k = 0; k < BENCH_METRICS; k++) {
+            double sum = 0, sq = 0, lo = samples[0][k], hi = samples[0][k];
+            for (int r = 0; r < done; r++) {
+                double v = samples[r][k];
+                column[r] = v;
+                sum += v;
+                if (v < lo) lo = v;
+                if (v > hi) hi = v;
+            }
+            double mean = sum / done;
+            for (int r = 0; r < done; r++) sq += (column[r] - mean) * (column[r] - mean);
+            double stddev = done > 1 ? bench_sqrt(sq / (done - 1)) : 0;
+            double median = median_of(column, done, scratch);
+
+            if (k == BENCH_WALL) {
+                wall_median = median;
+                for (int r = 0; r < done; r++) column[r] = bench_abs(column[r] - median);
+                wall_mad = median_of(column, done, scratch) * 1.4826; // Scaled to match a stddev
+            }
+            const char *fmt = k <= BENCH_SYS ? "%12.3f" : "%12.1f";
+            out_printf(bout, "%-9s", names[k]);
+            double stats[5] = { mean, stddev, median, lo, hi };
+            for (int n = 0; n < 5; n++) out_printf(bout, fmt, stats[n]);
+            out_printf(bout, "%s%s\n", units[k][0] ? " " : "", units[k]);
+        }
+
+        int outliers = 0;
+        for (int r = 0; r < done; r++) {
+            double z = wall_mad > 0 ? (samples[r][BENCH_WALL] - wall_median) / wall_mad : 0;
+            if (bench_abs(z) > 3.5) {
+                if (outliers++ == 0) out_printf(bout, "\nOutliers by wall time:\n");
+                out_printf(bout, "  run %d: %.3f ms (z = %.1f)\n", r + 1, samples[r][BENCH_WALL], z);
+            }
+        }
+        if (outliers && samples[0][BENCH_WALL] > wall_median + 3.5 * wall_mad) {
+            out_printf(bout, "The first run was slow: caches may be cold; try a larger -w.\n");
+        }
+    }
+
+    free(samples);
+    free(column);
+    return interrupted ? 130 : status;
+}
+
+// --- History ---
+
+// Commands are appended to ~/.myshell_history (or $MYSHELL_HISTFILE), one
+// per line, with any newline inside a command stored as HIST_NEWLINE. At
+// startup the file is only mapped, so a long history costs nothing until it
+// is used: the first Up or Ctrl-R splits it into entries and the first search
+// builds the trigram index. After that both are only extended with what has
+// been appended since, by this shell or another one sharing the file.
+#define HIST_NEWLINE '\x1e'
+#define TRIGRAM(s) (0x1000000u | (uint32_t)(unsigned char)(s)[0] << 16 | \
+                    (uint32_t)(unsigned char)(s)[1] << 8 | (unsigned char)(s)[2])
+
+// The entries containing one trigram
+struct Posting {
+    uint32_t key;              // TRIGRAM(), so 0 marks an empty slot
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *ids;             // Oldest first
+};
+
+struct History {
+    int state;                 // 0 not opened yet, 1 open, -1 no history file
+    int fd;
+    const char *map;
+    size_t map_len;
+    size_t *offsets;           // Where each entry starts in the map
+    size_t num_entries;
+    size_t offsets_cap;
+    size_t scanned;            // Bytes of the map already split into entries
+    struct Posting *index;     // Open addressing on the trigram
+    size_t index_cap;
+    size_t index_used;
+    size_t indexed;            // Entries already in the index
+};
+
+struct History history;
+
+// Maps whatever has been appended to the file since we last looked
+static void history_remap(void) {
+    struct stat st;
+    if (fstat(history.fd, &st) == -1) return;
+    size_t size = (size_t)st.st_size;
+    if (size < history.map_len) {
+        // Truncated behind our back: forget everything and start again
+        for (size_t i = 0; i < history.index_cap; i++) free(history.index[i].ids);
+        free(history.index);
+        free(history.offsets);
+        munmap((void *)history.map, history.map_len);
+        int fd = history.fd;
+        memset(&history, 0, sizeof(history));
+        history.state = 1;
+        history.fd = fd;
+    }
+    if (size == history.map_len) return;
+
+    void *m = history.map
+        ? mremap((void *)history.map, history.map_len, size, MREMAP_MAYMOVE)
+        : mmap(NULL, size, PROT_READ, MAP_SHARED, history.fd, 0);
+    if (m == MAP_FAILED) return;
+    history.map = m;
+    history.map_len = size;
+}
+
+static int history_open(void) {
+    if (history.state != 0) return history.state == 1;
+    history.state = -1;
+
+    char path[4096];
+    const char *file = getenv("MYSHELL_HISTFILE");
+    if (file == NULL || *file == '\0') {
+        const char *home = getenv("HOME");
+        if (home == NULL) return 0;
+        snprintf(path, sizeof(path), "%s/.myshell_history", home);
+        file = path;
+    }
+    history.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history.fd == -1) return 0;
+    history.state = 1;
+    history_remap();
+    return 1;
+}
+
+// Splits newly mapped lines into entries. A last line still missing its
+// newline is left until it has one.
+static void history_scan(void) {
+    history_remap();
+    if (history.map == NULL) return;
+    const char *p = history.map + history.scanned;
+    const char *end = history.map + history.map_len;
+    const char *nl;
+    while (p < end && (nl = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        if (nl > p) {
+            if (history.num_entries == history.offsets_cap) {
+                history.offsets_cap = history.offsets_cap ? history.offsets_cap * 2 : 1024;
+                history.offsets = realloc(history.offsets, history.offsets_cap * sizeof(size_t));
+            }
+            history.offsets[history.num_entries++] = (size_t)(p - history.map);
+        }
+        p = nl + 1;
+    }
+    history.scanned = (size_t)(p - history.map);
+}
+
+static const char *history_entry(size_t i, size_t *len) {
+    const char *s = history.map + history.offsets[i];
+    *len = (size_t)((const char *)memchr(s, '\n', history.map_len - history.offsets[i]) - s);
+    return s;
+}
+
+static struct Posting *posting_find(uint32_t key) {
+    size_t mask = history.index_cap - 1;
+    size_t i = (size_t)(key * 2654435761u) & mask;
+    while (history.index[i].key != 0 && history.index[i].key != key) i = (i + 1) & mask;
+    return &history.index[i];
+}
+
+static void index_add(uint32_t key, uint32_t id) {
+    if ((history.index_used + 1) * 4 > history.index_cap * 3) {
+        struct Posting *old = history.index;
+        size_t old_cap = history.index_cap;
+        history.index_cap = old_cap ? old_cap * 2 : 4096;
+        history.index = calloc(history.index_cap, sizeof(struct Posting));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (old[i].key != 0) *posting_find(old[i].key) = old[i];
+        }
+        free(old);
+    }
+
+    struct Posting *p = posting_find(key);
+    if (p->key == 0) {
+        p->key = key;
+        history.index_used++;
+    }
+    if (p->count > 0 && p->ids[p->count - 1] == id) return; // Trigram repeats in this entry
+    if (p->count == p->cap) {
+        p->cap = p->cap ? p->cap * 2 : 4;
+        p->ids = realloc(p->ids, p->cap * sizeof(uint32_t));
+    }
+    p->ids[p->count++] = id;
+}
+
+// Brings the entries and the index up to date with the file
+static void history_index_update(void) {
+    history_scan();
+    while (history.indexed < history.num_entries) {
+        size_t len;
+        const char *s = history_entry(history.indexed, &len);
+        for (size_t k = 0; k + 3 <= len; k++) index_add(TRIGRAM(s + k), (uint32_t)history.indexed);
+        history.indexed++;
+    }
+}
+
+// Returns the newest entry older than 'before' that contains 'q', or -1.
+// Call history_index_update() first.
+static long history_search(const char *q, size_t qlen, long before) {
+    if (before > (long)history.num_entries) before = (long)history.num_entries;
+    if (qlen < 3) {
+        for (long i = before - 1; i >= 0; i--) {
+            size_t len;
+            const char *s = history_entry((size_t)i, &len);
+            if (memmem(s, len, q, qlen)) return i;
+        }
+        return -1;
+    }
+
+    // Only entries holding every trigram of the query can match, so walk
+    // the shortest of their lists and check each candidate
+    if (history.index_cap == 0) return -1;
+    struct Posting *best = NULL;
+    for (size_t k = 0; k + 3 <= qlen; k++) {
+        struct Posting *p = posting_find(TRIGRAM(q + k));
+        if (p->key == 0) return -1;
+        if (best == NULL || p->count < best->count) best = p;
+    }
+    size_t lo = 0, hi = best->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((long)best->ids[mid] < before) lo = mid + 1;
+        else hi = mid;
+    }
+    while (lo-- > 0) {
+        size_t len;
+        const char *s = history_entry(best->ids[lo], &len);
+        if (memmem(s, len, q, qlen)) return best->ids[lo];
+    }
+    return -1;
+}
+
+// Appends a command unless it repeats the previous one. Entries and the
+// index pick it up the next time they are used.
+void history_add(const char *text, size_t len) {
+    while (len > 0 && (text[len - 1] == '\n' || text[len - 1] == ' ')) len--;
+    if (len == 0 || !history_open()) return;
+
+    char *rec = malloc(len + 2);
+    size_t n = 0;
+    history_remap();
+    int fresh_line = history.map_len == 0 || history.map[history.map_len - 1] == '\n';
+    if (!fresh_line) rec[n++] = '\n';
+    for (size_t i = 0; i < len; i++) rec[n++] = text[i] == '\n' ? HIST_NEWLINE : text[i];
+    rec[n++] = '\n';
+
+    int repeat = fresh_line && history.map_len >= n &&
+                 (history.map_len == n || history.map[history.map_len - n - 1] == '\n') &&
+                 memcmp(history.map + history.map_len - n, rec, n) == 0;
+    // One write, so commands from shells sharing the file never interleave
+    if (!repeat && write(history.fd, rec, n) != (ssize_t)n) {
+        fprintf(stderr, "myshell: history: %s\n", strerror(errno));
+    }
+    free(rec);
+}
+
+static void history_print(size_t i) {
+    size_t len;
+    const char *s = history_entry(i, &len);
+    out_printf(bout, "%5zu  ", i + 1);
+    for (size_t k = 0; k < len; k++) {
+        char c = s[k] == HIST_NEWLINE ? '\n' : s[k];
+        out_write(bout, &c, 1);
+    }
+    out_write(bout, "\n", 1);
+}
+
+// history [n]: the last n commands (all by default)
+// history -s text: every command containing 'text', newest first
+int builtin_history(char **args) {
+    if (!history_open()) {
+        out_printf(berr, "myshell: history: cannot open the history file\n");
+        return 1;
+    }
+
+    if (args[1] && strcmp(args[1], "-s") == 0) {
+        if (args[2] == NULL || args[3] != NULL) {
+            out_printf(berr, "myshell: history: usage: history -s text\n");
+            return 2;
+        }
+        history_index_update();
+        size_t qlen = strlen(args[2]);
+        int found = 0;
+        for (long i = history_search(args[2], qlen, LONG_MAX); i >= 0;
+             i = history_search(args[2], qlen, i)) {
+            history_print((size_t)i);
+            found = 1;
+        }
+        return found ? 0 : 1;
+    }
+
+    history_scan();
+    size_t first = 0;
+    if (args[1]) {
+        char *end;
+        long n = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1] || n < 0 || args[2] != NULL) {
+            out_printf(berr, "myshell: history: usage: history [n] | -s text\n");
+            return 2;
+        }
+        if ((size_t)n < history.num_entries) first = history.num_entries - (size_t)n;
+    }
+    for (size_t i = first; i < history.num_entries; i++) history_print(i);
+    return 0;
+}
+
+// --- Line editing ---
+
+// Keys beyond the byte values, decoded from escape sequences
+enum {
+    KEY_ESC = 256, KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_HOME, KEY_END, KEY_DELETE
+};
+
+struct LineEdit {
+    char *s;
+    size_t len;
+    size_t cap;
+    size_t pos;                // Cursor, as a byte offset
+    const char *prompt;
+    long hist;                 // Entry shown by Up/Down, or -1 for the typed line
+    char *saved;               // The typed line while browsing the history
+    size_t saved_len;
+};
+
+static int utf8_cont(char c) {
+    return ((unsigned char)c & 0xC0) == 0x80;
+}
+
+// Terminal columns taken by s[0..n): control characters are shown as '?'
+static size_t edit_columns(const char *s, size_t n) {
+    size_t cols = 0;
+    for (size_t i = 0; i < n; i++) cols += !utf8_cont(s[i]);
+    return cols;
+}
+
+static void edit_show(struct Output *o, const char *s, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        char c = (unsigned char)s[i] < 32 || s[i] == 127 ? '?' : s[i];
+        out_write(o, &c, 1);
+    }
+}
+
+static void edit_refresh(struct LineEdit *e) {
+    struct Output o = { .fd = STDOUT_FILENO };
+    out_printf(&o, "\r%s", e->prompt);
+    edit_show(&o, e->s, e->len);
+    out_write(&o, "\x1b[K", 3);
+    size_t back = edit_columns(e->s + e->pos, e->len - e->pos);
+    if (back > 0) out_printf(&o, "\x1b[%zuD", back);
+    out_flush(&o);
+}
+
+static void edit_insert(struct LineEdit *e, const char *s, size_t n) {
+    if (e->len + n + 2 > e->cap) {
+        e->cap = (e->len + n + 2) * 2;
+        e->s = realloc(e->s, e->cap);
+    }
+    memmove(e->s + e->pos + n, e->s + e->pos, e->len - e->pos);
+    memcpy(e->s + e->pos, s, n);
+    e->len += n;
+    e->pos += n;
+}
+
+static void edit_delete(struct LineEdit *e, size_t from, size_t to) {
+    memmove(e->s + from, e->s + to, e->len - to);
+    e->len -= to - from;
+    e->pos = from;
+}
+
+// Replaces the line with a history entry, turning HIST_NEWLINE back into '\n'
+static void edit_set(struct LineEdit *e, const char *s, size_t n) {
+    e->len = e->pos = 0;
+    edit_insert(e, s, n);
+    for (size_t i = 0; i < e->len; i++) {
+        if (e->s[i] == HIST_NEWLINE) e->s[i] = '\n';
+    }
+}
+
+static size_t edit_prev(struct LineEdit *e, size_t pos) {
+    if (pos > 0) pos--;
+    while (pos > 0 && utf8_cont(e->s[pos])) pos--;
+    return pos;
+}
+
+static size_t edit_next(struct LineEdit *e, size_t pos) {
+    if (pos < e->len) pos++;
+    while (pos < e->len && utf8_cont(e->s[pos])) pos++;
+    return pos;
+}
+
+static int edit_key(void) {
+    unsigned char c;
+    ssize_t n;
+    while ((n = read(STDIN_FILENO, &c, 1)) == -1 && errno == EINTR) {}
+    if (n != 1) return -1;
+    if (c != 27) return c;
+
+    // An escape sequence arrives all at once; a lone Esc is followed by nothing
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    unsigned char seq[2];
+    if (poll(&pfd, 1, 50) != 1 || read(STDIN_FILENO, &seq[0], 1) != 1) return KEY_ESC;
+    if (seq[0] != '[' && seq[0] != 'O') return KEY_ESC;
+    if (read(STDIN_FILENO, &seq[1], 1) != 1) return KEY_ESC;
+    switch (seq[1]) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    }
+    if (seq[1] < '0' || seq[1] > '9') return KEY_ESC;
+
+    // ESC [ n ~, or a modified key such as ESC [ 1 ; 5 C, which we ignore
+    int num = seq[1] - '0', plain = 1;
+    while (read(STDIN_FILENO, &c, 1) == 1) {
+        if (c >= '0' && c <= '9' && plain) num = num * 10 + (c - '0');
+        else if (c == ';') plain = 0;
+        else break;
+    }
+    if (c != '~' || !plain) return KEY_ESC;
+    switch (num) {
+    case 1: case 7: return KEY_HOME;
+    case 4: case 8: return KEY_END;
+    case 3: return KEY_DELETE;
+    }
+    return KEY_ESC;
+}
+
+// Up and Down step through the history, keeping the line being typed to
+// come back to
+static void edit_browse(struct LineEdit *e, int older) {
+    if (e->hist == -1) {
+        if (!older || !history_open()) return;
+        history_scan();
+        if (history.num_entries == 0) return;
+        e->saved = realloc(e->saved, e->len + 1);
+        memcpy(e->saved, e->s, e->len);
+        e->saved_len = e->len;
+        e->hist = (long)history.num_entries;
+    }
+    size_t len;
+    if (older) {
+        if (e->hist == 0) return;
+        e->hist--;
+        const char *s = history_entry((size_t)e->hist, &len);
+        edit_set(e, s, len);
+    } else if ((size_t)++e->hist == history.num_entries) {
+        e->hist = -1;
+        edit_set(e, e->saved, e->saved_len);
+    } else {
+        const char *s = history_entry((size_t)e->hist, &len);
+        edit_set(e, s, len);
+    }
+}
+
+// Ctrl-R: shows the newest command containing what has been typed so far,
+// and Ctrl-R again moves on to older ones. Returns the key that ended the
+// search: Enter runs the match, Ctrl-G and Ctrl-C go back to the line as it
+// was, and any other key keeps the match for editing.
+static int edit_search(struct LineEdit *e) {
+    if (!history_open()) return 7;
+    history_index_update();
+
+    char q[256];
+    size_t qlen = 0;
+    long match = -1;
+    int failed = 0;
+    for (;;) {
+        struct Output o = { .fd = STDOUT_FILENO };
+        out_printf(&o, "\r(%sreverse-i-search)`", failed ? "failed " : "");
+        edit_show(&o, q, qlen);
+        out_write(&o, "': ", 3);
+        if (match >= 0) {
+            size_t len;
+            const char *s = history_entry((size_t)match, &len);
+            edit_show(&o, s, len);
+        }
+        out_write(&o, "\x1b[K", 3);
+        out_flush(&o);
+
+        int c = edit_key();
+        long m;
+        if (c == 18) {
+            if (qlen == 0) continue;
+            m = history_search(q, qlen, match >= 0 ? match : LONG_MAX);
+        } else if (c == 127 || c == 8) {
+            if (qlen == 0) continue;
+            while (qlen > 0 && utf8_cont(q[--qlen])) {}
+            m = qlen > 0 ? history_search(q, qlen, LONG_MAX) : -1;
+            match = -1;
+        } else if (c >= 32 && c < 256 && c != 127) {
+            if (qlen == sizeof(q)) continue;
+            q[qlen++] = (char)c;
+            // The current match may still hold the longer text
+            m = history_search(q, qlen, match >= 0 ? match + 1 : LONG_MAX);
+        } else {
+            if (c == 3 || c == 7 || c == -1) return 7;
+            if (match >= 0) {
+                size_t len;
+                const char *s = history_entry((size_t)match, &len);
+                edit_set(e, s, len);
+                e->hist = -1;
+            }
+            return c;
+        }
+        failed = m < 0 && qlen > 0;
+        if (m >= 0) match = m;
+    }
+}
+
+// Reads a line from the terminal with cursor movement, Up/Down through the
+// history and Ctrl-R to search it. Returns its length including the newline,
+// 0 if Ctrl-C abandoned it, or -1 at end of input.
+ssize_t edit_line(const char *prompt, char **line, size_t *cap) {
+    struct termios raw = shell_tmodes;
+    raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if (tcsetattr(STDIN_FILENO, TCSADRAIN, &raw) == -1) {
+        printf("%s", prompt);
+        fflush(stdout);
+        return getline(line, cap, stdin);
+    }
+
+    struct LineEdit e = { .s = *line, .cap = *cap, .prompt = prompt, .hist = -1 };
+    ssize_t result;
+    edit_refresh(&e);
+    for (;;) {
+        int c = edit_key();
+        switch (c) {
+        case -1:
+            if (e.len > 0) goto accept;
+            result = -1;
+            goto out;
+        case '\r':
+        case '\n':
+            goto accept;
+        case 3: // Ctrl-C
+            e.pos = e.len;
+            edit_refresh(&e);
+            if (write(STDOUT_FILENO, "^C\r\n", 4) < 0) {}
+            result = 0;
+            goto out;
+        case 4: // Ctrl-D
+            if (e.len == 0) {
+                result = -1;
+                goto out;
+            }
+            if (e.pos < e.len) edit_delete(&e, e.pos, edit_next(&e, e.pos));
+            break;
+        case 127:
+        case 8:
+            if (e.pos > 0) edit_delete(&e, edit_prev(&e, e.pos), e.pos);
+            break;
+        case KEY_DELETE:
+            if (e.pos < e.len) edit_delete(&e, e.pos, edit_next(&e, e.pos));
+            break;
+        case 1: case KEY_HOME: e.pos = 0; break;
+        case 5: case KEY_END: e.pos = e.len; break;
+        case 2: case KEY_LEFT: e.pos = edit_prev(&e, e.pos); break;
+        case 6: case KEY_RIGHT: e.pos = edit_next(&e, e.pos); break;
+        case 11: edit_delete(&e, e.pos, e.len); break; // Ctrl-K
+        case 21: edit_delete(&e, 0, e.pos); break;     // Ctrl-U
+        case 23: {                                      // Ctrl-W
+            size_t from = e.pos;
+            while (from > 0 && e.s[from - 1] == ' ') from--;
+            while (from > 0 && e.s[from - 1] != ' ') from--;
+            edit_delete(&e, from, e.pos);
+            break;
+        }
+        case 12: // Ctrl-L
+            if (write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7) < 0) {}
+            break;
+        case 16: case KEY_UP: edit_browse(&e, 1); break;
+        case 14: case KEY_DOWN: edit_browse(&e, 0); break;
+        case 18: { // Ctrl-R
+            char *before = malloc(e.len + 1);
+            size_t before_len = e.len, before_pos = e.pos;
+            memcpy(before, e.s, e.len);
+            c = edit_search(&e);
+            if (c == 7) {
+                edit_set(&e, before, before_len);
+                e.pos = before_pos;
+            } else {
+                e.pos = e.len;
+            }
+            free(before);
+            if (c == '\r' || c == '\n') goto accept;
+            break;
+        }
+        default:
+            if (c >= 32 && c < 256 && c != 127) {
+                char ch = (char)c;
+                edit_insert(&e, &ch, 1);
+            }
+        }
+        edit_refresh(&e);
+    }
+
+accept:
+    e.pos = e.len;
+    edit_refresh(&e);
+    if (write(STDOUT_FILENO, "\r\n", 2) < 0) {}
+    edit_insert(&e, "\n", 1);
+    e.s[e.len] = '\0';
+    result = (ssize_t)e.len;
+out:
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    free(e.saved);
+    *line = e.s;
+    *cap = e.cap;
+    return result;
+}
+
+// --- Spawn benchmark (-B) ---
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// Runs /bin/true 'count' times and returns commands per second
+static double bench_spawn(int count, int use_fork) {
+    char *args[] = { "true", NULL };
+    double start = now_seconds();
+
+    for (int i = 0; i < count; i++) {
+        pid_t pid;
+        if (use_fork) {
+            pid = fork();
+            if (pid == 0) {
+                execv("/bin/true", args);
+                _exit(127);
+            }
+        } else if (posix_spawn(&pid, "/bin/true", NULL, NULL, args, environ) != 0) {
+            pid = -1;
+        }
+        if (pid < 0) {
+            perror("myshell");
+            return 0;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    return count / (now_seconds() - start);
+}
+
+// fork() has to copy the page tables of the whole shell (and then take a
+// copy-on-write fault for every page either side touches), so it slows down
+// as the shell grows. posix_spawn() shares the address space until exec.
+void run_spawn_benchmark(int count) {
+    static const int footprints_mb[] = { 0, 256, 1024 };
+    if (count <= 0) count = 1000;
+
+    printf("Starting /bin/true %d times per run\n\n", count);
+    printf("%-12s %14s %14s\n", "Footprint", "fork+exec/s", "posix_spawn/s");
+
+    for (size_t i = 0; i < sizeof(footprints_mb) / sizeof(footprints_mb[0]); i++) {
+        size_t bytes = (size_t)footprints_mb[i] << 20;
+        char *ballast = NULL;
+        if (bytes) {
+            ballast = malloc(bytes);
+            if (ballast == NULL) {
+                printf("%-9d MB   (allocation failed)\n", footprints_mb[i]);
+                continue;
+            }
+            memset(ballast, 1, bytes); // Touch every page so it is really mapped
+        }
+
+        double forked = bench_spawn(count, 1);
+        double spawned = bench_spawn(count, 0);
+        printf("%-9d MB %14.0f %14.0f\n", footprints_mb[i], forked, spawned);
+
+        free(ballast);
+    }
+}
+
+// Times 'count' runs of one statement, returning runs per second
+static double bench_statement(const char *text, int count) {
+    struct Arena arena = { NULL };
+    struct Parser ps;
+    struct Pipeline *stmt;
+    parser_init(&ps, text, strlen(text), NULL, &arena);
+    if (parse_statement(&ps, &stmt) != 1) return 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < count; i++) execute_statement(stmt);
+    double rate = count / (now_seconds() - start);
+
+    arena_reset(&arena);
+    free(arena.head);
+    return rate;
+}
+
+// The built-ins against the same commands run as programs (a name with a
+// '/' always means the program)
+void run_builtin_benchmark(int count) {
+    static const char *commands[][2] = {
+        { "true", "/bin/true" },
+        { "echo hello world > /dev/null", "/bin/echo hello world > /dev/null" },
+        { "printf '%s=%d\\n' x 42 > /dev/null", "/usr/bin/printf '%s=%d\\n' x 42 > /dev/null" },
+        { "test -f /etc/passwd", "/usr/bin/test -f /etc/passwd" },
+        { "[ 1 -lt 2 ]", "/usr/bin/[ 1 -lt 2 ]" },
+        { "pwd > /dev/null", "/bin/pwd > /dev/null" },
+    };
+    if (count <= 0) count = 1000;
+
+    printf("\nBuilt-ins: %d program runs, %d built-in runs per command\n\n", count, count * 100);
+    printf("%-34s %12s %12s %9s\n", "Command", "program/s", "built-in/s", "speedup");
+    for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
+        double external = bench_statement(commands[i][1], count);
+        double builtin = bench_statement(commands[i][0], count * 100);
+        printf("%-34s %12.0f %12.0f %8.0fx\n", commands[i][0], external, builtin, builtin / external);
     }
 }